@@ -0,0 +1,919 @@
+/*
+ * Copyright (c) 2011-2012 Yaroslav Stavnichiy <yarosla@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * httpress-fixture: reference HTTP server for httpress self-benchmarks.
+ *
+ * Uses the same model as httpress itself: one libev loop per thread, each
+ * thread with its own SO_REUSEPORT listening socket. Responses are generated
+ * from a static filler buffer, so the server does no per-request allocation.
+ * Response shape can be set globally from the command line or per request
+ * via query arguments (?size=N&delay=MS&chunk=N&reset=PCT). ?stream=MS
+ * answers with a server-sent event stream, an event every MS milliseconds
+ * until the client leaves or &events=N have been sent.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <limits.h>
+#include <string.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <ev.h>
+#include "httpress_ws.h"
+
+#define VERSION "1.1"
+
+#define MEM_GUARD 128
+#define MAX_HEADERS_SIZE 8192
+#define FILLER_SIZE 65536
+
+enum dist_type {DIST_CONST, DIST_UNIFORM, DIST_EXP};
+
+typedef struct distribution {
+  enum dist_type type;
+  double a, b; // const: a; uniform: [a, b]; exp: mean a
+} distribution;
+
+struct fixture_config {
+  const char* bind_addr;
+  int port;
+  const char* unix_path; // listen on this Unix socket instead of TCP
+  int num_threads;
+  int size_min;
+  int size_max;
+  int chunk_size; // 0 = Content-Length body
+  distribution latency; // seconds
+  double reset_pct;
+  int trickle_bytes;
+  double trickle_interval; // seconds
+  int quiet;
+};
+
+static struct fixture_config fconfig;
+static char filler[FILLER_SIZE];
+
+enum fconn_state {F_READING, F_DELAYING, F_WRITING, F_TRICKLE_WAIT, F_STREAM_WAIT};
+
+typedef struct fthread {
+  pthread_t tid;
+  int id;
+  int listen_fd;
+  struct ev_loop* loop;
+  ev_io watch_accept;
+  uint64_t rnd;
+
+  char _padding0[MEM_GUARD]; // guard from false sharing
+  long num_accepted;
+  long num_requests;
+  long num_resets;
+  long num_bytes_sent;
+} fthread;
+
+typedef struct fconn {
+  struct ev_loop* loop;
+  fthread* tdata;
+  int fd;
+  ev_io watch_read;
+  ev_io watch_write;
+  ev_timer watch_timer;
+
+  enum fconn_state state;
+  unsigned keep_alive:1;
+  unsigned chunked:1;
+  unsigned chunk_started:1;
+  unsigned final_sent:1;
+  unsigned websocket:1; // upgraded: echo frames back
+  unsigned event_due:1; // stream: the next event may be sent
+
+  int read_pos;
+  long discard_left; // request body bytes still to skip
+
+  // response plan, filled by parse_request()
+  long body_size;
+  int chunk_size;
+  double delay;
+  double reset_pct;
+  double stream_interval; // seconds between stream events, 0 = not a stream
+  long events_left; // stream events still to send, -1 = no limit
+  long event_seq;
+
+  long body_left; // body bytes not yet framed (chunked) or sent
+  const char* data; // next bytes to send right after out[]: filler or echoed payload
+  int data_left;
+  int ws_consume; // input bytes of the frame being echoed
+  char ws_key[32]; // Sec-WebSocket-Key of an upgrade request
+  long sent; // response bytes sent so far
+  long reset_at; // inject RST once this many bytes are sent; -1 = never
+  int trickle_budget;
+
+  char out[256]; // status line, headers and chunk framing
+  int out_len;
+  int out_pos;
+
+  char buf[MAX_HEADERS_SIZE];
+} fconn;
+
+void nxweb_die(const char* fmt, ...) {
+  va_list ap;
+  fprintf(stderr, "FATAL: ");
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+  exit(EXIT_FAILURE);
+}
+
+void nxweb_log_error(const char* fmt, ...) {
+  char cur_time[32];
+  time_t t;
+  struct tm tm;
+  va_list ap;
+
+  time(&t);
+  localtime_r(&t, &tm);
+  strftime(cur_time, sizeof(cur_time), "%F %T", &tm);
+  flockfile(stderr);
+  fprintf(stderr, "%s [%u:%p]: ", cur_time, getpid(), (void*)pthread_self());
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+  fflush(stderr);
+  funlockfile(stderr);
+}
+
+static inline double frand(fthread* tdata) {
+  // xorshift64*
+  uint64_t x=tdata->rnd;
+  x^=x>>12; x^=x<<25; x^=x>>27;
+  tdata->rnd=x;
+  return ((x*0x2545F4914F6CDD1DULL)>>11) * (1.0/9007199254740992.0);
+}
+
+static double dist_sample(const distribution* d, fthread* tdata) {
+  switch (d->type) {
+    case DIST_UNIFORM: return d->a + (d->b - d->a) * frand(tdata);
+    case DIST_EXP: return -d->a * log(1. - frand(tdata));
+    default: return d->a;
+  }
+}
+
+// parses "5ms", "1.5s", "200us", "250" (milliseconds when unsuffixed)
+static const char* parse_duration(const char* s, double* value) {
+  char* end;
+  double v=strtod(s, &end);
+  if (end==s || v<0) return 0;
+  if (!strncmp(end, "us", 2)) { v/=1000000.; end+=2; }
+  else if (!strncmp(end, "ms", 2)) { v/=1000.; end+=2; }
+  else if (*end=='s') { end++; }
+  else if (*end=='m') { v*=60.; end++; }
+  else v/=1000.;
+  *value=v;
+  return end;
+}
+
+// parses "5ms", "uniform:1ms-10ms" (or just "1ms-10ms") and "exp:5ms"
+static int parse_distribution(const char* s, distribution* d) {
+  const char* p;
+  memset(d, 0, sizeof(*d));
+  if (!strncmp(s, "const:", 6)) s+=6;
+  else if (!strncmp(s, "uniform:", 8)) { s+=8; d->type=DIST_UNIFORM; }
+  else if (!strncmp(s, "exp:", 4)) { s+=4; d->type=DIST_EXP; }
+  if (!(p=parse_duration(s, &d->a))) return -1;
+  if (*p=='-' && d->type!=DIST_EXP) {
+    d->type=DIST_UNIFORM;
+    if (!(p=parse_duration(p+1, &d->b)) || d->b<d->a) return -1;
+  }
+  else if (d->type==DIST_UNIFORM) return -1;
+  return *p? -1 : 0;
+}
+
+static int setup_socket(int fd) {
+  int flags=fcntl(fd, F_GETFL);
+  if (flags<0) return flags;
+  if (fcntl(fd, F_SETFL, flags|O_NONBLOCK)<0) return -1;
+  int nodelay=1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  return 0;
+}
+
+static void fconn_close(fconn* fc, int good) {
+  ev_io_stop(fc->loop, &fc->watch_read);
+  ev_io_stop(fc->loop, &fc->watch_write);
+  ev_timer_stop(fc->loop, &fc->watch_timer);
+  if (!good) {
+    struct linger linger;
+    linger.l_onoff=1;
+    linger.l_linger=0; // send RST
+    setsockopt(fc->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+  }
+  close(fc->fd);
+  free(fc);
+}
+
+static inline void consume_input(fconn* fc, int n) {
+  if (n<fc->read_pos) memmove(fc->buf, fc->buf+n, fc->read_pos-n);
+  fc->read_pos-=n;
+}
+
+static void parse_query(fconn* fc, const char* q, const char* end) {
+  while (q && q<end) {
+    if (!strncmp(q, "size=", 5)) fc->body_size=atol(q+5);
+    else if (!strncmp(q, "delay=", 6)) fc->delay=atof(q+6)/1000.;
+    else if (!strncmp(q, "chunk=", 6)) fc->chunk_size=atoi(q+6);
+    else if (!strncmp(q, "reset=", 6)) fc->reset_pct=atof(q+6);
+    else if (!strncmp(q, "stream=", 7)) fc->stream_interval=atof(q+7)/1000.;
+    else if (!strncmp(q, "events=", 7)) fc->events_left=atol(q+7);
+    q=memchr(q, '&', end-q);
+    if (q) q++;
+  }
+}
+
+// header line at p (up to end) starts with name, case-insensitive
+static inline int header_is(const char* p, const char* end, const char* name, int len) {
+  return end-p>=len && !strncasecmp(p, name, len);
+}
+
+// start of the header value after name; stays before end
+static inline char* header_value(char* p, const char* end, int len) {
+  for (p+=len; p<end && (*p==' ' || *p=='\t'); p++);
+  return p;
+}
+
+// returns request body length or -1 if request is malformed; looks at the
+// first hdr_len bytes only, the buffer past them holds older requests
+static long parse_request(fconn* fc, int hdr_len) {
+  fthread* tdata=fc->tdata;
+  char* p;
+  char* end=fc->buf+hdr_len;
+  long content_length=0;
+
+  fc->body_size=fconfig.size_min;
+  if (fconfig.size_max>fconfig.size_min)
+    fc->body_size+=(long)(frand(tdata)*(fconfig.size_max-fconfig.size_min+1));
+  fc->chunk_size=fconfig.chunk_size;
+  fc->delay=dist_sample(&fconfig.latency, tdata);
+  fc->reset_pct=fconfig.reset_pct;
+  fc->stream_interval=0;
+  fc->events_left=-1;
+  fc->ws_key[0]='\0';
+
+  char* path=memchr(fc->buf, ' ', hdr_len);
+  if (!path) return -1;
+  path++;
+  char* path_end=memchr(path, ' ', end-path);
+  if (!path_end) return -1;
+  char* query=memchr(path, '?', path_end-path);
+  if (query) parse_query(fc, query+1, path_end);
+  fc->keep_alive=end-path_end>8 && !strncmp(path_end+1, "HTTP/1.1", 8);
+
+  for (p=memchr(fc->buf, '\n', hdr_len); p; p=memchr(p, '\n', end-p)) {
+    if (++p>=end) break;
+    if (header_is(p, end, "Content-Length:", 15)) {
+      content_length=atol(header_value(p, end, 15)); // digits end at the line's \r
+    }
+    else if (header_is(p, end, "Connection:", 11)) {
+      p=header_value(p, end, 11);
+      if (header_is(p, end, "close", 5)) fc->keep_alive=0;
+      else if (header_is(p, end, "keep-alive", 10)) fc->keep_alive=1;
+    }
+    else if (header_is(p, end, "Sec-WebSocket-Key:", 18)) {
+      p=header_value(p, end, 18);
+      int n=0;
+      while (p+n<end && p[n]!='\r' && p[n]!='\n') n++;
+      if (n>=sizeof(fc->ws_key)) return -1;
+      memcpy(fc->ws_key, p, n);
+      fc->ws_key[n]='\0';
+    }
+  }
+  if (fc->body_size<0 || content_length<0) return -1;
+  return content_length;
+}
+
+// Sec-WebSocket-Accept: base64(SHA-1(key + GUID))
+static void ws_accept(const char* key, char* out) {
+  static const char guid[]="258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  static const char b64[]="ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  uint8_t msg[128], digest[20];
+  uint32_t h[5]={0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0}, w[80], a, b, c, d, e, f, k, t;
+  int len=strlen(key), total, i, j;
+  memcpy(msg, key, len);
+  memcpy(msg+len, guid, sizeof(guid)-1);
+  len+=sizeof(guid)-1;
+  total=(len+8)/64*64+64;
+  memset(msg+len, 0, total-len);
+  msg[len]=0x80;
+  for (i=0; i<8; i++) msg[total-1-i]=(uint64_t)len*8>>(8*i);
+  for (j=0; j<total; j+=64) {
+    for (i=0; i<16; i++) w[i]=msg[j+4*i]<<24|msg[j+4*i+1]<<16|msg[j+4*i+2]<<8|msg[j+4*i+3];
+    for (i=16; i<80; i++) { t=w[i-3]^w[i-8]^w[i-14]^w[i-16]; w[i]=t<<1|t>>31; }
+    a=h[0]; b=h[1]; c=h[2]; d=h[3]; e=h[4];
+    for (i=0; i<80; i++) {
+      if (i<20) { f=(b&c)|(~b&d); k=0x5A827999; }
+      else if (i<40) { f=b^c^d; k=0x6ED9EBA1; }
+      else if (i<60) { f=(b&c)|(b&d)|(c&d); k=0x8F1BBCDC; }
+      else { f=b^c^d; k=0xCA62C1D6; }
+      t=(a<<5|a>>27)+f+e+k+w[i];
+      e=d; d=c; c=b<<30|b>>2; b=a; a=t;
+    }
+    h[0]+=a; h[1]+=b; h[2]+=c; h[3]+=d; h[4]+=e;
+  }
+  for (i=0; i<20; i++) digest[i]=h[i/4]>>(24-8*(i%4));
+  for (i=0, j=0; i<20; i+=3) {
+    uint32_t v=digest[i]<<16|(i+1<20? digest[i+1]<<8 : 0)|(i+2<20? digest[i+2] : 0);
+    out[j++]=b64[v>>18&63];
+    out[j++]=b64[v>>12&63];
+    out[j++]=i+1<20? b64[v>>6&63] : '=';
+    out[j++]=i+2<20? b64[v&63] : '=';
+  }
+  out[j]='\0';
+}
+
+static void start_response(fconn* fc) {
+  fthread* tdata=fc->tdata;
+  if (fc->ws_consume) {
+    // echo frame is already set up by ws_echo()
+    fc->state=F_WRITING;
+    tdata->num_requests++;
+    ev_io_start(fc->loop, &fc->watch_write);
+    ev_feed_event(fc->loop, &fc->watch_write, EV_WRITE);
+    return;
+  }
+  fc->chunked=fc->chunk_size>0;
+  fc->chunk_started=0;
+  fc->final_sent=0;
+  fc->out_pos=0;
+  if (fc->ws_key[0]) {
+    char accept[32];
+    ws_accept(fc->ws_key, accept);
+    fc->out_len=snprintf(fc->out, sizeof(fc->out),
+                         "HTTP/1.1 101 Switching Protocols\r\nServer: httpress-fixture\r\n"
+                         "Upgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept);
+    fc->websocket=1;
+    fc->keep_alive=1;
+    fc->chunked=0;
+    fc->data_left=0;
+    fc->body_left=0;
+    fc->body_size=0;
+  }
+  else if (fc->stream_interval>0) {
+    fc->out_len=snprintf(fc->out, sizeof(fc->out),
+                         "HTTP/1.1 200 OK\r\nServer: httpress-fixture\r\nContent-Type: text/event-stream\r\n"
+                         "Cache-Control: no-cache\r\nTransfer-Encoding: chunked\r\nConnection: %s\r\n\r\n",
+                         fc->keep_alive? "keep-alive":"close");
+    fc->chunked=1;
+    fc->data_left=0;
+    fc->body_left=0;
+    fc->body_size=0;
+    fc->event_due=0;
+    fc->event_seq=0;
+  }
+  else if (fc->chunked) {
+    fc->out_len=snprintf(fc->out, sizeof(fc->out),
+                         "HTTP/1.1 200 OK\r\nServer: httpress-fixture\r\nContent-Type: text/plain\r\n"
+                         "Transfer-Encoding: chunked\r\nConnection: %s\r\n\r\n",
+                         fc->keep_alive? "keep-alive":"close");
+    fc->data_left=0;
+    fc->body_left=fc->body_size;
+  }
+  else {
+    fc->out_len=snprintf(fc->out, sizeof(fc->out),
+                         "HTTP/1.1 200 OK\r\nServer: httpress-fixture\r\nContent-Type: text/plain\r\n"
+                         "Content-Length: %ld\r\nConnection: %s\r\n\r\n",
+                         fc->body_size, fc->keep_alive? "keep-alive":"close");
+    fc->data_left=0;
+    fc->body_left=fc->body_size;
+  }
+  fc->sent=0;
+  fc->reset_at=-1;
+  if (fc->reset_pct>0 && frand(tdata)*100.<fc->reset_pct) {
+    // anywhere from before the status line to just before the last byte
+    fc->reset_at=(long)(frand(tdata)*(fc->out_len+fc->body_size));
+  }
+  fc->trickle_budget=fconfig.trickle_bytes;
+  fc->state=F_WRITING;
+  tdata->num_requests++;
+  ev_io_start(fc->loop, &fc->watch_write);
+  ev_feed_event(fc->loop, &fc->watch_write, EV_WRITE);
+}
+
+// refills out[] with the next piece of framing once out[] and the pending
+// filler data are both drained; returns 0 when the response is complete,
+// 2 when a stream has to wait for its next event
+static int next_frame(fconn* fc) {
+  fc->out_pos=fc->out_len=0;
+  if (!fc->chunked) {
+    if (!fc->body_left) return 0;
+    fc->data=filler;
+    fc->data_left=fc->body_left>FILLER_SIZE? FILLER_SIZE : fc->body_left;
+    fc->body_left-=fc->data_left;
+    return 1;
+  }
+  if (fc->final_sent) return 0;
+  if (fc->stream_interval>0 && fc->events_left) {
+    if (!fc->event_due) return 2;
+    char event[64];
+    int len=sprintf(event, "id: %ld\ndata: %ld\n\n", fc->event_seq, fc->event_seq);
+    fc->out_len=sprintf(fc->out, "%s%x\r\n%s", fc->chunk_started? "\r\n":"", len, event);
+    fc->event_seq++;
+    if (fc->events_left>0) fc->events_left--;
+    fc->event_due=0;
+    fc->chunk_started=1;
+    return 1;
+  }
+  int n=fc->body_left>fc->chunk_size? fc->chunk_size : fc->body_left;
+  if (n>FILLER_SIZE) n=FILLER_SIZE;
+  if (n) {
+    fc->out_len=sprintf(fc->out, "%s%x\r\n", fc->chunk_started? "\r\n":"", n);
+    fc->data=filler;
+    fc->data_left=n;
+    fc->body_left-=n;
+    fc->chunk_started=1;
+  }
+  else {
+    fc->out_len=sprintf(fc->out, "%s0\r\n\r\n", fc->chunk_started? "\r\n":"");
+    fc->final_sent=1;
+  }
+  return 1;
+}
+
+static int process_input(fconn* fc);
+static void schedule_response(fconn* fc);
+
+// echoes one buffered client frame; returns 1 if echoing,
+// 0 if more input is needed, -1 if the connection has been closed
+static int ws_echo(fconn* fc) {
+  int opcode;
+  uint64_t len;
+  const uint8_t* mask_key;
+  int n=ws_parse_header((uint8_t*)fc->buf, fc->read_pos, &opcode, &len, &mask_key);
+  if (!n) return 0;
+  if (opcode==WS_OP_CLOSE || !mask_key || len>sizeof(fc->buf)-1-n) {
+    if (opcode!=WS_OP_CLOSE) nxweb_log_error("websocket frame unmasked or too large");
+    fconn_close(fc, opcode==WS_OP_CLOSE);
+    return -1;
+  }
+  if (fc->read_pos<n+len) return 0;
+  ws_mask(fc->buf+n, fc->buf+n, len, mask_key);
+  fc->out_len=ws_frame_header((uint8_t*)fc->out, opcode==WS_OP_PING? WS_OP_PONG : opcode, len, 0);
+  fc->out_pos=0;
+  fc->data=fc->buf+n;
+  fc->data_left=len;
+  fc->body_left=0;
+  fc->chunked=0;
+  fc->sent=0;
+  fc->reset_at=-1;
+  fc->trickle_budget=fconfig.trickle_bytes;
+  fc->ws_consume=n+len;
+  fc->delay=dist_sample(&fconfig.latency, fc->tdata);
+  schedule_response(fc);
+  return 1;
+}
+
+static void response_done(fconn* fc) {
+  ev_io_stop(fc->loop, &fc->watch_write);
+  if (fc->ws_consume) {
+    consume_input(fc, fc->ws_consume);
+    fc->ws_consume=0;
+  }
+  if (!fc->keep_alive) {
+    fconn_close(fc, 1);
+    return;
+  }
+  fc->state=F_READING;
+  ev_io_start(fc->loop, &fc->watch_read);
+  process_input(fc); // pipelined requests already buffered
+}
+
+static void write_cb(struct ev_loop *loop, ev_io *w, int revents) {
+  fconn *fc=((fconn*)(((char*)w)-offsetof(fconn, watch_write)));
+  fthread* tdata=fc->tdata;
+  struct iovec iov[2];
+  ssize_t ret;
+  long limit;
+  int n;
+
+  if (fc->state!=F_WRITING) return;
+  for (;;) {
+    if (fc->out_pos==fc->out_len && !fc->data_left) {
+      int r=next_frame(fc);
+      if (!r) {
+        response_done(fc);
+        return;
+      }
+      if (r>1) {
+        fc->state=F_STREAM_WAIT;
+        ev_io_stop(loop, &fc->watch_write);
+        ev_timer_set(&fc->watch_timer, fc->stream_interval, 0.);
+        ev_timer_start(loop, &fc->watch_timer);
+        return;
+      }
+    }
+    limit=LONG_MAX;
+    if (fc->reset_at>=0) {
+      limit=fc->reset_at-fc->sent;
+      if (!limit) {
+        tdata->num_resets++;
+        fconn_close(fc, 0);
+        return;
+      }
+    }
+    if (fconfig.trickle_bytes) {
+      if (!fc->trickle_budget) {
+        fc->state=F_TRICKLE_WAIT;
+        ev_io_stop(loop, &fc->watch_write);
+        ev_timer_set(&fc->watch_timer, fconfig.trickle_interval, 0.);
+        ev_timer_start(loop, &fc->watch_timer);
+        return;
+      }
+      if (fc->trickle_budget<limit) limit=fc->trickle_budget;
+    }
+    n=0;
+    if (fc->out_pos<fc->out_len) {
+      iov[n].iov_base=fc->out+fc->out_pos;
+      iov[n].iov_len=fc->out_len-fc->out_pos;
+      if (iov[n].iov_len>limit) iov[n].iov_len=limit;
+      limit-=iov[n].iov_len;
+      n++;
+    }
+    if (fc->data_left && limit) {
+      iov[n].iov_base=(char*)fc->data;
+      iov[n].iov_len=fc->data_left<limit? fc->data_left : limit;
+      n++;
+    }
+    ret=writev(fc->fd, iov, n);
+    if (ret<0) {
+      if (errno==EAGAIN) return;
+      fconn_close(fc, 0);
+      return;
+    }
+    tdata->num_bytes_sent+=ret;
+    fc->sent+=ret;
+    if (fconfig.trickle_bytes) fc->trickle_budget-=ret;
+    n=fc->out_len-fc->out_pos;
+    if (ret<n) {
+      fc->out_pos+=ret;
+      continue;
+    }
+    fc->out_pos=fc->out_len;
+    fc->data+=(ret-n);
+    fc->data_left-=(ret-n);
+  }
+}
+
+static void schedule_response(fconn* fc) {
+  ev_io_stop(fc->loop, &fc->watch_read);
+  if (fc->delay>0) {
+    fc->state=F_DELAYING;
+    ev_timer_set(&fc->watch_timer, fc->delay, 0.);
+    ev_timer_start(fc->loop, &fc->watch_timer);
+  }
+  else {
+    start_response(fc);
+  }
+}
+
+// returns 0 if the connection has been closed
+static int process_input(fconn* fc) {
+  while (fc->state==F_READING && fc->websocket) {
+    int r=ws_echo(fc);
+    if (r<=0) return r+1;
+  }
+  while (fc->state==F_READING) {
+    if (fc->discard_left) {
+      int n=fc->read_pos<fc->discard_left? fc->read_pos : fc->discard_left;
+      consume_input(fc, n);
+      fc->discard_left-=n;
+      if (fc->discard_left) return 1; // need more request body
+      schedule_response(fc);
+      return 1;
+    }
+    if (fc->read_pos<4) return 1;
+    char* p;
+    char* end=0;
+    for (p=memchr(fc->buf, '\n', fc->read_pos); p; p=memchr(p+1, '\n', fc->read_pos-(p-fc->buf)-1)) {
+      if (p-fc->buf>=3 && *(p-3)=='\r' && *(p-2)=='\n' && *(p-1)=='\r') { end=p+1; break; }
+    }
+    if (!end) {
+      if (fc->read_pos>=(int)sizeof(fc->buf)-1) {
+        nxweb_log_error("request headers too long");
+        fconn_close(fc, 0);
+        return 0;
+      }
+      return 1;
+    }
+    int hdr_len=end-fc->buf;
+    long body_len=parse_request(fc, hdr_len);
+    if (body_len<0) {
+      nxweb_log_error("malformed request");
+      fconn_close(fc, 0);
+      return 0;
+    }
+    consume_input(fc, hdr_len);
+    fc->discard_left=body_len;
+    if (!body_len) schedule_response(fc);
+  }
+  return 1;
+}
+
+static void read_cb(struct ev_loop *loop, ev_io *w, int revents) {
+  fconn *fc=((fconn*)(((char*)w)-offsetof(fconn, watch_read)));
+  ssize_t ret;
+
+  while (fc->state==F_READING) {
+    int room_avail=sizeof(fc->buf)-fc->read_pos-1;
+    ret=read(fc->fd, fc->buf+fc->read_pos, room_avail);
+    if (ret<=0) {
+      if (ret<0 && errno==EAGAIN) return;
+      // client closed (or failed) between requests; not an error for us
+      fconn_close(fc, ret==0);
+      return;
+    }
+    fc->read_pos+=ret;
+    if (!process_input(fc)) return;
+    if (ret<room_avail) return;
+  }
+}
+
+static void timer_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+  fconn *fc=((fconn*)(((char*)w)-offsetof(fconn, watch_timer)));
+  if (fc->state==F_DELAYING) {
+    start_response(fc);
+  }
+  else if (fc->state==F_TRICKLE_WAIT || fc->state==F_STREAM_WAIT) {
+    if (fc->state==F_STREAM_WAIT) fc->event_due=1;
+    fc->state=F_WRITING;
+    fc->trickle_budget=fconfig.trickle_bytes;
+    ev_io_start(loop, &fc->watch_write);
+    ev_feed_event(loop, &fc->watch_write, EV_WRITE);
+  }
+}
+
+static void accept_cb(struct ev_loop *loop, ev_io *w, int revents) {
+  fthread *tdata=((fthread*)(((char*)w)-offsetof(fthread, watch_accept)));
+  int fd;
+  for (;;) {
+    fd=accept(tdata->listen_fd, 0, 0);
+    if (fd<0) {
+      if (errno!=EAGAIN && errno!=EINTR && errno!=ECONNABORTED)
+        nxweb_log_error("accept() failed %d", errno);
+      return;
+    }
+    if (setup_socket(fd)) {
+      close(fd);
+      continue;
+    }
+    fconn* fc=malloc(sizeof(fconn));
+    if (!fc) {
+      close(fd);
+      continue;
+    }
+    fc->loop=loop;
+    fc->tdata=tdata;
+    fc->fd=fd;
+    fc->state=F_READING;
+    fc->websocket=0;
+    fc->ws_consume=0;
+    fc->read_pos=0;
+    fc->discard_left=0;
+    ev_io_init(&fc->watch_read, read_cb, fd, EV_READ);
+    ev_io_init(&fc->watch_write, write_cb, fd, EV_WRITE);
+    ev_timer_init(&fc->watch_timer, timer_cb, 0., 0.);
+    ev_io_start(loop, &fc->watch_read);
+    tdata->num_accepted++;
+  }
+}
+
+static int open_listen_socket(void) {
+  struct sockaddr_in sa;
+  int one=1;
+  int fd=socket(AF_INET, SOCK_STREAM, 0);
+  if (fd<0) return -1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))) goto ERR;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family=AF_INET;
+  sa.sin_port=htons(fconfig.port);
+  if (inet_pton(AF_INET, fconfig.bind_addr, &sa.sin_addr)!=1) goto ERR;
+  if (bind(fd, (struct sockaddr*)&sa, sizeof(sa))) goto ERR;
+  // take data in the SYN (httpress --fastopen) where net.ipv4.tcp_fastopen allows it
+  int qlen=4096;
+  setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen));
+  if (listen(fd, 65535)) goto ERR;
+  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL)|O_NONBLOCK)<0) goto ERR;
+  return fd;
+ERR:
+  close(fd);
+  return -1;
+}
+
+// one Unix listening socket shared by all threads (no SO_REUSEPORT for AF_UNIX)
+static int open_unix_listen_socket(void) {
+  struct sockaddr_un sa;
+  if (strlen(fconfig.unix_path)>=sizeof(sa.sun_path)) return -1;
+  int fd=socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd<0) return -1;
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family=AF_UNIX;
+  strcpy(sa.sun_path, fconfig.unix_path);
+  unlink(fconfig.unix_path);
+  if (bind(fd, (struct sockaddr*)&sa, sizeof(sa))) goto ERR;
+  if (listen(fd, 65535)) goto ERR;
+  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL)|O_NONBLOCK)<0) goto ERR;
+  return fd;
+ERR:
+  close(fd);
+  return -1;
+}
+
+static void* thread_main(void* pdata) {
+  fthread* tdata=(fthread*)pdata;
+  ev_io_init(&tdata->watch_accept, accept_cb, tdata->listen_fd, EV_READ);
+  ev_io_start(tdata->loop, &tdata->watch_accept);
+  ev_run(tdata->loop, 0);
+  return 0;
+}
+
+static void show_help(void) {
+  printf( "httpress-fixture <options>\n"
+          "  -p port  listen port                     (default: 8080)\n"
+          "  -a addr  listen address                  (default: 0.0.0.0)\n"
+          "  -u path  listen on a Unix socket instead\n"
+          "  -t num   number of threads               (default: 1)\n"
+          "  -s size  body size or min-max range      (default: 1024)\n"
+          "  -C size  chunked body with this chunk size (default: off)\n"
+          "  -l dist  response latency: 5ms, 1ms-10ms, exp:5ms (default: 0)\n"
+          "  -R pct   percent of responses reset midway (default: 0)\n"
+          "  -T b/ms  trickle: send b bytes every ms  (default: off)\n"
+          "  -q       quiet\n"
+          "  -h       show this help\n"
+          "\n"
+          "per-request overrides: /any/path?size=N&delay=MS&chunk=N&reset=PCT\n"
+          "event stream:          /any/path?stream=MS[&events=N]\n"
+          "\n"
+          "example: httpress-fixture -p 8080 -t 2 -s 100-10000 -l exp:2ms -R 0.1\n\n");
+}
+
+int main(int argc, char* argv[]) {
+  fconfig.bind_addr="0.0.0.0";
+  fconfig.port=8080;
+  fconfig.num_threads=1;
+  fconfig.size_min=fconfig.size_max=1024;
+
+  int c;
+  char* p;
+  while ((c=getopt(argc, argv, ":hvqp:a:u:t:s:C:l:R:T:"))!=-1) {
+    switch (c) {
+      case 'h':
+        show_help();
+        return 0;
+      case 'v':
+        printf("version:    " VERSION "\n");
+        printf("build-date: " __DATE__ " " __TIME__ "\n\n");
+        return 0;
+      case 'q':
+        fconfig.quiet=1;
+        break;
+      case 'p':
+        fconfig.port=atoi(optarg);
+        break;
+      case 'a':
+        fconfig.bind_addr=optarg;
+        break;
+      case 'u':
+        fconfig.unix_path=optarg;
+        break;
+      case 't':
+        fconfig.num_threads=atoi(optarg);
+        break;
+      case 's':
+        fconfig.size_min=fconfig.size_max=atoi(optarg);
+        if ((p=strchr(optarg, '-'))) fconfig.size_max=atoi(p+1);
+        break;
+      case 'C':
+        fconfig.chunk_size=atoi(optarg);
+        break;
+      case 'l':
+        if (parse_distribution(optarg, &fconfig.latency)) nxweb_die("can't parse latency distribution: %s", optarg);
+        break;
+      case 'R':
+        fconfig.reset_pct=atof(optarg);
+        break;
+      case 'T':
+        fconfig.trickle_bytes=atoi(optarg);
+        p=strchr(optarg, '/');
+        fconfig.trickle_interval=p? atof(p+1)/1000. : 0.;
+        if (fconfig.trickle_bytes<=0 || fconfig.trickle_interval<=0) nxweb_die("trickle must be bytes/ms: %s", optarg);
+        break;
+      case '?':
+        fprintf(stderr, "unkown option: -%c\n\n", optopt);
+        show_help();
+        return EXIT_FAILURE;
+    }
+  }
+  if (fconfig.port<=0 || fconfig.port>65535) nxweb_die("wrong port");
+  if (fconfig.num_threads<1 || fconfig.num_threads>1024) nxweb_die("wrong number of threads");
+  if (fconfig.size_min<0 || fconfig.size_max<fconfig.size_min) nxweb_die("wrong body size");
+  if (fconfig.chunk_size<0) nxweb_die("wrong chunk size");
+  if (fconfig.reset_pct<0 || fconfig.reset_pct>100) nxweb_die("wrong reset percentage");
+
+  memset(filler, 'x', sizeof(filler));
+
+  // Block signals for all threads; main thread waits for them in sigwait()
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGPIPE);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGQUIT);
+  sigaddset(&set, SIGHUP);
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL)) nxweb_die("can't set pthread_sigmask");
+
+  fthread** threads=calloc(fconfig.num_threads, sizeof(fthread*));
+  if (!threads) nxweb_die("can't allocate thread pool");
+  int i;
+  fthread* tdata;
+  for (i=0; i<fconfig.num_threads; i++) {
+    threads[i]=
+    tdata=memalign(MEM_GUARD, sizeof(fthread)+MEM_GUARD);
+    if (!tdata) nxweb_die("can't allocate thread data");
+    memset(tdata, 0, sizeof(fthread));
+    tdata->id=i+1;
+    tdata->rnd=0x9E3779B97F4A7C15ULL*(i+1);
+    if (fconfig.unix_path) {
+      tdata->listen_fd=i? threads[0]->listen_fd : open_unix_listen_socket();
+      if (tdata->listen_fd<0) nxweb_die("can't listen on %s [%d] %s", fconfig.unix_path, errno, strerror(errno));
+    }
+    else {
+      tdata->listen_fd=open_listen_socket();
+      if (tdata->listen_fd<0) nxweb_die("can't listen on %s:%d [%d] %s", fconfig.bind_addr, fconfig.port, errno, strerror(errno));
+    }
+    tdata->loop=ev_loop_new(0);
+    pthread_create(&tdata->tid, 0, thread_main, tdata);
+  }
+
+  if (!fconfig.quiet) {
+    if (fconfig.unix_path) printf("httpress-fixture listening on %s, %d thread(s)\n", fconfig.unix_path, fconfig.num_threads);
+    else printf("httpress-fixture listening on %s:%d, %d thread(s)\n", fconfig.bind_addr, fconfig.port, fconfig.num_threads);
+    fflush(stdout);
+  }
+
+  sigdelset(&set, SIGPIPE);
+  int sig;
+  sigwait(&set, &sig);
+  if (fconfig.unix_path) unlink(fconfig.unix_path);
+
+  long total_accepted=0, total_requests=0, total_resets=0, total_bytes=0;
+  for (i=0; i<fconfig.num_threads; i++) {
+    tdata=threads[i];
+    total_accepted+=tdata->num_accepted;
+    total_requests+=tdata->num_requests;
+    total_resets+=tdata->num_resets;
+    total_bytes+=tdata->num_bytes_sent;
+  }
+  if (!fconfig.quiet) {
+    printf("\nFIXTURE: %ld accepted, %ld responses, %ld resets, %ld bytes\n",
+           total_accepted, total_requests, total_resets, total_bytes);
+  }
+  return EXIT_SUCCESS;
+}
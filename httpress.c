@@ -31,6 +31,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <malloc.h>
+#include <limits.h>
 #include <string.h>
 #include <time.h>
 #include <stdarg.h>
@@ -40,22 +41,51 @@
 #include <errno.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/sendfile.h>
 #include <netdb.h>
+#include <getopt.h>
 #include <math.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <dlfcn.h>
 
 //#define WITH_SSL
-static int has_fastopen=1;
 
 #ifdef WITH_SSL
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/tls.h>)
+#include <linux/tls.h>
+#define HAVE_KTLS
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#endif
+#endif
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/epoll.h>)
+#include <sys/epoll.h>
+#define HAVE_EPOLL
+#define EPOLL_BATCH 256 // events taken per epoll_wait() in --edge mode
+#endif
 #endif
 
 #include <ev.h>
+#include "httpress_plugin.h"
+#include "httpress_probes.h"
+#include "httpress_ws.h"
 static int first=9;
 #define VERSION "1.1"
 
@@ -66,12 +96,226 @@ typedef uint32_t int_to_ptr;
 #endif
 
 #define MEM_GUARD 128
-#define MAX_URLS 1024
+#define MAX_URLS 65536
+#define MAX_THINKS 256
 #define MAX_SESSIONS 128
 #define MAX_REQ_SIZE 4096
+#define MAX_PHASES 32
+#define MAX_SLO 8
+#define MAX_TRIALS 30
+#define MAX_ITERATIONS 1000
+#define MAX_CONNECTIONS 10000000
+#define MAX_PRIORITIES 16 // -z connection groups
+#define MAX_TLS_SUITES 64 // per thread, --handshake breakdown
+#define CONN_BUF_SIZE 32768 // default per-connection buffer for headers and requests
+#define HOLD_BUF_SIZE 2048 // default with --hold
+#define READ_BUF_SIZE 32768 // per-thread buffer response bodies are read into
 
 time_t start_time_rg;
-time_t current_time;
+
+/*
+ * Latency histogram: log-linear buckets over microseconds with
+ * 2^HIST_SUB_BITS sub-buckets per power of two (~3% precision).
+ * Layout is fixed, so histograms from different threads or agent
+ * processes merge exactly by adding bucket counts.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_MAX_BITS 36 // ~19 hours
+#define HIST_BUCKETS ((HIST_MAX_BITS-HIST_SUB_BITS+1)<<HIST_SUB_BITS)
+
+typedef struct latency_hist {
+  uint64_t count;
+  uint64_t sum; // microseconds
+  uint64_t max;
+  uint64_t buckets[HIST_BUCKETS];
+} latency_hist;
+
+enum timeout_phase {TO_CONNECT, TO_TLS, TO_FIRST_BYTE, TO_TOTAL, TO_MAX};
+
+// transport errors by cause, counted per thread (see count_error)
+enum error_class {EC_REFUSED, EC_RESET, EC_TIMEOUT, EC_TLS, EC_HEADER_OVERFLOW, EC_CHUNK, EC_CLOSED,
+                  EC_OTHER, EC_MAX};
+
+// syscalls and I/O outcomes, counted per thread (see count_read)
+enum io_count {IO_RW, IO_POLL, IO_CTL, IO_OTHER, IO_EAGAIN, IO_PARTIAL_WRITE, IO_READS, IO_READ_BYTES, IO_MAX};
+
+typedef struct run_stats {
+  long num_connect;
+  long num_success;
+  long num_fail;
+  long num_bytes_received;
+  long num_overhead_received;
+  long num_connect_fail;
+  long num_timeout[TO_MAX];
+  latency_hist latency; // request sent to response complete
+  latency_hist connect_latency; // connect() to TCP connection established
+  latency_hist first_latency; // requests that were first on their connection
+  long num_flow_fail; // flows aborted by a failed request
+  latency_hist flow_latency; // completed flows, first request start to last response
+  long num_established; // --hold: streams with response headers received
+  long num_dropped; // --hold: established streams that ended before the run did
+  long num_reconnect; // --hold: new connections replacing dropped streams
+  latency_hist event_gap; // --hold: time between stream events
+  long num_ktls; // --ktls: TLS connections with records handled by the kernel
+  long num_ktls_fallback; // --ktls: TLS connections left to gnutls, fully or in one direction
+  long num_errors[EC_MAX];
+  long num_tunnel_fail; // --proxy: CONNECT tunnels refused or broken
+  latency_hist tunnel_latency; // --proxy: TCP connection established to CONNECT response
+  long num_tfo_data; // --fastopen: connections whose first write went out with the SYN
+  long num_tfo_accepted; // of those, the server acknowledged the data in its SYN-ACK
+  long num_tfo_no_cookie; // SYN sent without data, the kernel had no cookie for the server
+  long num_tfo_fallback; // TCP_FASTOPEN_CONNECT refused, plain connect()
+  long bw_requests; // --client-bw: successful requests measured against their connection's limit
+  long bw_permille; // sum of the share of the limit each one got, per mille
+  latency_hist first_byte_latency; // --client-bw: request start to first response byte
+  long io[IO_MAX];
+} run_stats;
+
+// think time between flow steps
+enum think_type {TH_CONST, TH_UNIFORM, TH_EXP};
+
+typedef struct think_dist {
+  enum think_type type;
+  double a; // constant, uniform minimum or exponential mean; seconds
+  double b; // uniform maximum
+} think_dist;
+
+/*
+ * Per-URL stats in session mode: one flat array per thread indexed like
+ * config.request_data_arr, with a coarser histogram (4 sub-buckets per
+ * power of two, ~19% precision) to stay small with many URLs. Each entry
+ * is ~520 bytes and every thread holds config.num_urls of them, e.g. ~5 MB
+ * per thread for a 10000 URL session file.
+ */
+#define URL_HIST_SUB_BITS 2
+#define URL_HIST_MAX_BITS 32 // ~71 minutes
+#define URL_HIST_BUCKETS ((URL_HIST_MAX_BITS-URL_HIST_SUB_BITS+1)<<URL_HIST_SUB_BITS)
+
+typedef struct url_stats {
+  uint32_t num_success;
+  uint32_t num_fail;
+  uint64_t sum; // microseconds
+  uint32_t max;
+  uint32_t buckets[URL_HIST_BUCKETS];
+} url_stats;
+
+/*
+ * Request trace (--trace): one fixed-size record per traced request, times
+ * in microseconds from the request's start. Workers append to a per-thread
+ * single-producer ring; the main thread drains the rings into a memory-mapped
+ * file while the run goes on. The file starts with a header of the same size
+ * as a record; --trace-decode turns it into CSV.
+ */
+#define TRACE_MAGIC "HTTRACE"
+#define TRACE_VERSION 2
+#define TRACE_RING (1<<16) // records per thread, power of 2
+#define TRACE_WINDOW (1365*12288) // ~16MB, whole pages and whole records
+
+// why a request failed; the phase it was in unless a more specific reason is known
+enum trace_error {TE_OK, TE_CONNECT, TE_TUNNEL, TE_TLS, TE_WRITE, TE_HEADERS, TE_BODY,
+                  TE_TIMEOUT, TE_TIMEOUT_END=TE_TIMEOUT+TO_MAX-1, TE_REJECTED, TE_MAX};
+
+/*
+ * Worker threads don't write to stderr themselves: their error messages go
+ * to a per-thread single-producer ring that the main thread prints, as with
+ * trace records. Each error class logs up to LOG_BURST messages per thread
+ * per second; the rest are counted and summarized.
+ */
+#define LOG_RING 256 // messages per thread, power of 2
+#define LOG_MSG_SIZE 248
+#define LOG_BURST 10
+
+typedef struct log_entry {
+  time_t time;
+  char msg[LOG_MSG_SIZE];
+} log_entry;
+
+typedef struct trace_record {
+  uint64_t start; // ns since trace base time
+  uint32_t connect; // connect and TLS handshake, first request on a connection only
+  uint32_t send; // first byte written (open-loop queueing shows here)
+  uint32_t first_byte; // first response byte
+  uint32_t headers; // response headers parsed
+  uint32_t total;
+  uint32_t conn_id;
+  uint32_t url; // index in session file, 0 for a single URL
+  uint32_t bytes; // body bytes received
+  uint16_t status;
+  uint16_t error; // enum trace_error
+  uint16_t thread;
+  uint16_t alive_count; // earlier requests on this connection
+} trace_record;
+
+typedef struct trace_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  double base_time; // unix time
+  char _reserved[sizeof(trace_record)-24];
+} trace_header;
+
+// number of requests a keep-alive connection serves before the client closes it
+enum conn_requests_type {CR_UNLIMITED, CR_FIXED, CR_UNIFORM, CR_GEOMETRIC};
+
+typedef struct conn_requests_dist {
+  enum conn_requests_type type;
+  double a; // fixed value, uniform minimum or geometric mean
+  double b; // uniform maximum
+} conn_requests_dist;
+
+/*
+ * Load profile: phases run back to back, each driving either the number of
+ * active connections ('c') or the open-loop request rate ('r'):
+ *   ramp A-B<u>/DUR          linear change from A (or current value) to B
+ *   hold [DUR]               keep current values (forever if last)
+ *   step +N<u> every DUR [xK] add N every DUR, K times or until the run ends
+ *   step A-B<u>/S<u>/DUR     go from A to B by S, each level lasting DUR
+ */
+enum profile_phase_type {PH_RAMP, PH_HOLD, PH_STEP};
+
+typedef struct profile_phase {
+  enum profile_phase_type type;
+  char unit; // 'c' connections, 'r' requests per second
+  double from; // ramp or step start, <0 means current value
+  double to;
+  double step;
+  double every;
+  int steps; // 0 means until the end of the run
+  double duration; // seconds, HUGE_VAL for open-ended phases
+} profile_phase;
+
+/*
+ * Hierarchical timer wheel for per-connection timeouts: TW_LEVELS levels of
+ * TW_SLOTS lists each, level l covering TW_SLOTS^(l+1) ticks. Arming and
+ * disarming are O(1) list operations; entries cascade to lower levels as
+ * the wheel turns. One ev_timer per thread drives it, however many
+ * connections are armed.
+ */
+#define TW_BITS 6
+#define TW_SLOTS (1<<TW_BITS)
+#define TW_LEVELS 4 // 2^24 ticks, ~46 hours
+#define TW_TICK 0.01 // seconds
+
+typedef struct tw_entry {
+  struct tw_entry* next; // 0 when not armed
+  struct tw_entry* prev;
+  uint64_t expires; // tick
+} tw_entry;
+
+typedef struct timer_wheel {
+  uint64_t now; // last processed tick
+  tw_entry slots[TW_LEVELS][TW_SLOTS]; // list heads
+} timer_wheel;
+
+/*
+ * SLO search: open-loop trials at varying rates, doubling until the SLO
+ * breaks, then bisecting between the best passing and lowest failing rate.
+ * Threads and connections stay up; each trial just retargets the rate.
+ */
+typedef struct slo_limit {
+  double pct; // latency percentile, 0..100
+  double limit; // seconds
+} slo_limit;
 
 struct config {
   int num_connections;
@@ -81,11 +325,18 @@ struct config {
   struct addrinfo *saddr;
   const char* uri_path;
   const char* uri_host;
-  const char* ssl_cipher_priority;
+  const char* ssl_cipher_priority[MAX_PRIORITIES]; // one per connection group (-z)
+  int num_priorities;
   char request_data[MAX_REQ_SIZE];
   int request_length;
   char *request_data_arr[MAX_URLS];
   int request_length_arr[MAX_URLS];
+  char *url_path_arr[MAX_URLS];
+  short url_think[MAX_URLS]; // think time before this flow step: thinks[i-1], 0 = global
+  think_dist thinks[MAX_THINKS];
+  int num_thinks;
+  think_dist think; // global think time
+  int flow; // walk session URLs in order
   int num_urls;
   int sessions[MAX_SESSIONS];
   const char* session_host[MAX_SESSIONS];
@@ -93,9 +344,60 @@ struct config {
   int last_session;
   int infinite;
   int run_time;
+  const char* session_file;
+  const char* url;
+  const char* proxy; // forward proxy host:port, or NULL
+  int agent_port;
+  const char* agent_bind; // -A: listen address, loopback unless given
+  const char* agent_secret; // -A/-D: shared secret, or $HTTPRESS_AGENT_SECRET
+  const char* agents;
+  double rate; // open-loop requests per second, 0 = closed loop
+  double scale; // share of profile/rate targets run by this process
+  double warmup;
+  const char* profile_spec;
+  profile_phase profile[MAX_PHASES];
+  int num_phases;
+  int profile_conns0; // connections before the first 'c' phase
+  int profile_base; // global -c of a distributed run; 0 when -c is our own
+  const char* slo_spec;
+  slo_limit slo[MAX_SLO];
+  int num_slo;
+  double slo_errors; // error budget, fraction of requests
+  double search_min;
+  double search_max; // 0 = no upper bound
+  int trial_time; // seconds per trial, including settle time
+  double connect_rate; // new connections per second at start, 0 = all at once
+  double timeout[TO_MAX]; // seconds, 0 = none
+  double grace; // time in-flight requests get to finish at shutdown, 0 = auto
+  conn_requests_dist conn_requests;
+  int top_urls; // rows in per-URL tables
+  int timeouts_enabled;
+  const char* plugin_path;
+  const char* plugin_arg;
+  int iterations; // repeat the run this many times
+  const char* baseline; // results file to compare with
+  const char* save_results;
+  double max_regression; // percent
+  const char* trace_path;
+  int trace_sample; // trace every Nth request per thread, 0 = none
+  double trace_slow; // trace requests taking at least this long, 0 = off
+  int ws; // upgrade to WebSocket, then send messages
+  int ws_size; // message payload bytes
+  char* ws_payload;
+  int hold; // keep streaming responses open and count their events
+  int buf_size; // per-connection buffer
+  double reconnect_delay; // --hold: before replacing a dropped stream or retrying a connect
+  int ktls; // move TLS records to the kernel after the handshake
+  int handshake; // TLS handshakes only, no HTTP
+  int close_notify; // --handshake: send close_notify before closing
+  int edge; // register sockets once, edge-triggered, instead of libev watcher changes
+  int fastopen; // TCP Fast Open: first write goes out with the SYN
+  double client_bw_min; // --client-bw: bytes per second per connection, drawn uniformly
+  double client_bw_max;
+  int rcvbuf; // SO_RCVBUF for client sockets, 0 = kernel default
 #ifdef WITH_SSL
   gnutls_certificate_credentials_t ssl_cred;
-  gnutls_priority_t priority_cache;
+  gnutls_priority_t priority_cache[MAX_PRIORITIES];
 #endif
 
   char _padding0[MEM_GUARD]; // guard from false sharing
@@ -110,6 +412,8 @@ struct config {
 
 static struct config config;
 static char host_string[512];
+static const httpress_plugin* plugin; // --plugin hooks, NULL if none
+static void* plugin_handle;
 
 enum nxweb_chunked_decoder_state_code {CDS_CR1=-2, CDS_LF1=-1, CDS_SIZE=0, CDS_LF2, CDS_DATA};
 
@@ -120,7 +424,7 @@ typedef struct nxweb_chunked_decoder_state {
   int64_t chunk_bytes_left;
 } nxweb_chunked_decoder_state;
 
-enum connection_state {C_CONNECTING, C_HANDSHAKING, C_WRITING, C_READING_HEADERS, C_READING_BODY};
+enum connection_state {C_CONNECTING, C_TUNNELING, C_HANDSHAKING, C_WRITING, C_READING_HEADERS, C_READING_BODY};
 
 typedef struct connection {
   struct ev_loop* loop;
@@ -129,6 +433,17 @@ typedef struct connection {
   ev_io watch_read;
   ev_io watch_write;
   ev_tstamp last_activity;
+  ev_tstamp req_start;
+  ev_tstamp connect_start;
+  ev_tstamp send_start; // actual time the current request started
+  ev_tstamp connected; // connection ready for requests (after TLS handshake)
+  ev_tstamp resp_start; // first response byte
+  ev_tstamp headers_end;
+  ev_tstamp last_event; // --hold: previous event, or stream start
+  tw_entry timer;
+  enum timeout_phase timeout_phase;
+  ev_tstamp intended; // open-loop scheduled start of the next request
+  struct connection* paced_next;
 
   nxweb_chunked_decoder_state cdstate;
 
@@ -141,14 +456,33 @@ typedef struct connection {
   int bytes_to_read;
   int bytes_received;
   int alive_count;
+  int max_requests; // on this connection, 0 = unlimited
   int success_count;
+  int status; // HTTP status of the current response
+  int fail_code; // enum trace_error, 0 = by state
+  const char* req_data; // request being sent
+  int req_len;
 
   int keep_alive:1;
   int chunked:1;
   int done:1;
   int secure:1;
+  int parked:1; // above load profile target, no socket open
+  int paced_connect:1; // waiting in pace queue for a new connection
+  int think_closed:1; // connection closed during flow think time or --reconnect-delay
+  int ws_open:1; // WebSocket upgrade done, requests are messages
+  int held:1; // --hold: stream established, reading events
+  int dropped:1; // --hold: stream ended, next connect is a reconnect
+  int sse_nl:1; // --hold: last stream byte ended a line
+  int ktls_tx:1; // kernel encrypts what we send (--ktls)
+  int ktls_rx:1; // kernel decrypts what we receive
+  int tfo:1; // --fastopen: connect() deferred, the first write sends the SYN
+  int tfo_sent:1; // --fastopen: data went with the SYN, see tfo_check()
+  int tls_group; // index of its -z priority string
+  int want; // EV_READ/EV_WRITE interest, see conn_watch()
+  int ready; // --edge: directions not known to be drained since the last EAGAIN
 
-  char buf[32768];
+  char* buf; // config.buf_size bytes in the thread's slab
   char* body_ptr;
 
   enum connection_state state;
@@ -159,24 +493,98 @@ typedef struct connection {
   int num_urls;
   char **urls;
   int *request_length_arr;
+  int first_url; // index of urls[0] in config.request_data_arr
+  int url_index; // of the current request in urls; flow step in flow mode
+  ev_tstamp flow_start;
+  ev_timer watch_think;
+
+  float bw_rate; // --client-bw: this connection's bytes per second
+  float bw_burst; // bucket size
+  float rx_tokens; // bytes it may read now
+  float tx_tokens;
+  ev_tstamp rx_time; // buckets last refilled
+  ev_tstamp tx_time;
+  int bw_dir; // EV_READ or EV_WRITE paused by watch_bw
+  ev_timer watch_bw;
 } connection;
 
+#ifdef WITH_SSL
+// --handshake results per priority group and negotiated parameters
+typedef struct tls_suite {
+  int tls_group;
+  gnutls_protocol_t protocol;
+  gnutls_kx_algorithm_t kx;
+  gnutls_cipher_algorithm_t cipher;
+  gnutls_group_t kx_group; // curve or DH group
+  latency_hist latency; // TCP established to handshake complete
+} tls_suite;
+#endif
+
 typedef struct thread_config {
   pthread_t tid;
   connection *conns;
+  char* conn_bufs; // num_conn*config.buf_size; pages are touched only as used
+  char* read_buf; // READ_BUF_SIZE; response bodies are read here and dropped
   int id;
   int num_conn;
   struct ev_loop* loop;
   ev_tstamp start_time;
   ev_timer watch_heartbeat;
+  ev_check watch_check; // counts event loop iterations, i.e. poll syscalls
+  ev_prepare watch_prepare;
+  ev_tstamp poll_end; // last return from poll
+  ev_tstamp busy_time; // spent outside poll
+  ev_tstamp end_time; // event loop finished
+  volatile long quota; // -n: requests granted to this thread, not started yet; may be stolen
+#ifdef HAVE_EPOLL
+  int epfd; // --edge: connection sockets, registered once each
+  ev_io watch_epoll;
+#endif
 
   int shutdown_in_progress;
+  ev_async watch_stop; // stop request from the main thread
+  ev_timer watch_grace;
+  int loop_ref; // heartbeat keeps loop alive while a profile may reopen connections
 
-  int num_success;
-  int num_fail;
-  long num_bytes_received;
-  long num_overhead_received;
-  int num_connect;
+  int conn_offset; // index of first connection across all threads
+  int active_target; // connections with index below this may be open
+  double rate; // this thread's share of open-loop rate
+  ev_tstamp sched_next; // open-loop start time of the next request
+  ev_timer watch_pace;
+  connection* paced_head; // connections waiting for their scheduled start
+  connection* paced_tail;
+
+  int search_trial; // last SLO search trial applied by this thread
+  uint64_t rng; // xorshift state
+
+  ev_timer watch_connect; // staggers initial connects (--connect-rate)
+  int connect_next; // first connection not opened yet
+  ev_tstamp connect_start;
+
+  timer_wheel wheel;
+  ev_tstamp wheel_start; // time of tick 0
+  ev_timer watch_wheel;
+
+  run_stats stats;
+  run_stats warmup_stats;
+  run_stats* cur_stats; // warmup_stats until warm-up period ends
+  url_stats* url_stats; // session mode, config.num_urls entries
+  void* plugin_ctx;
+
+  trace_record* trace_ring; // TRACE_RING entries, NULL when not tracing
+  uint32_t trace_head; // next record to write, advanced by this thread
+  uint32_t trace_seq; // for 1-in-N sampling
+  long trace_dropped; // ring full
+  log_entry* log_ring; // LOG_RING entries
+  uint32_t log_head; // next message to write, advanced by this thread
+  long log_dropped; // ring full
+  ev_tstamp log_window[EC_MAX]; // current rate limit second of each error class
+  int log_count[EC_MAX]; // messages logged in it
+  long log_suppressed[EC_MAX]; // messages not logged in it
+  char _padding_trace[MEM_GUARD];
+  uint32_t trace_tail; // next record to flush, advanced by the main thread
+  uint32_t log_tail; // next message to print, advanced by the main thread
+  long log_dropped_reported;
   ev_tstamp avg_req_time;
 
 #ifdef WITH_SSL
@@ -193,11 +601,16 @@ typedef struct thread_config {
   gnutls_compression_method_t ssl_compression;
   gnutls_cipher_algorithm_t ssl_cipher;
   gnutls_mac_algorithm_t ssl_mac;
+  tls_suite* tls_suites; // MAX_TLS_SUITES, --handshake only
+  int num_tls_suites;
 #endif
 } thread_config;
 
 static int print_all_cpu_stats=0;
 static volatile int stop_cpu_stats;
+static volatile int threads_running;
+static thread_config** volatile worker_threads; // for stealing quota, set once all are created
+static volatile int stop_requested; // finish the run early (signal, SLO search done)
 typedef struct cpu_info_s {
 	long double max,min,avg;
 	pthread_t tid;
@@ -207,8 +620,8 @@ void strip_newline(char *line) {
 	while (*line) {
 		if ((*line == '\n') || (*line == '\r'))
 			*line=0;
-		line++;
-	}
+		line++;
+	}
 }
 int empty_line(char *line) {
 	while (*line) {
@@ -252,19 +665,20 @@ void nxweb_log_error(const char* fmt, ...) {
   funlockfile(stderr);
 }
 
-static inline int setup_socket(int fd) {
+// Host header and TLS server name for a target host
+static inline const char* host_header(const char* host) {
+  return strncmp(host, "unix:", 5)? host : "localhost";
+}
+
+static inline int setup_socket(int fd, int family) {
   int flags=fcntl(fd, F_GETFL);
   if (flags<0) return flags;
   if (fcntl(fd, F_SETFL, flags|=O_NONBLOCK)<0) return -1;
+  if (family==AF_UNIX) return 0; // the rest is TCP only
 
   int nodelay=1;
-  int qlen = 5;                            
   if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay))) return -1;
-  //try fastopen
-  if (setsockopt(fd, SOL_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen))  != 0) {
-	  has_fastopen=0;
-	  nxweb_log_error("%s","Cannot set fastopen option on socket.\n");
-  }
+  if (config.rcvbuf && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &config.rcvbuf, sizeof(config.rcvbuf))) return -1;
 
 //  struct linger linger;
 //  linger.l_onoff=1;
@@ -300,36 +714,706 @@ static inline void sleep_ms(int ms) {
   while(nanosleep(&req, &req)==-1) continue;
 }
 
+static inline int log_bucket(uint64_t v, int sub_bits, int max_bits) {
+  if (v>=(1ULL<<max_bits)) v=(1ULL<<max_bits)-1;
+  if (v<(1<<sub_bits)) return v;
+  int shift=63-__builtin_clzll(v)-sub_bits;
+  return (shift<<sub_bits)+(v>>shift);
+}
+
+static inline uint64_t log_bucket_low(int b, int sub_bits) {
+  int shift=b<(2<<sub_bits)? 0 : (b>>sub_bits)-1;
+  return (uint64_t)(b-(shift<<sub_bits))<<shift;
+}
+
+static inline int hist_bucket(uint64_t v) {
+  return log_bucket(v, HIST_SUB_BITS, HIST_MAX_BITS);
+}
+
+static inline uint64_t hist_bucket_low(int b) {
+  return log_bucket_low(b, HIST_SUB_BITS);
+}
+
+static inline void hist_record(latency_hist* h, ev_tstamp t) {
+  uint64_t us=t>0? (uint64_t)(t*1000000.+0.5) : 0;
+  h->count++;
+  h->sum+=us;
+  if (us>h->max) h->max=us;
+  h->buckets[hist_bucket(us)]++;
+}
+
+static void hist_merge(latency_hist* dst, const latency_hist* src) {
+  int i;
+  dst->count+=src->count;
+  dst->sum+=src->sum;
+  if (src->max>dst->max) dst->max=src->max;
+  for (i=0; i<HIST_BUCKETS; i++) dst->buckets[i]+=src->buckets[i];
+}
+
+// dst=a-b for cumulative snapshots a taken after b; max is bucket-precise
+static void hist_sub(latency_hist* dst, const latency_hist* a, const latency_hist* b) {
+  int i;
+  dst->count=a->count-b->count;
+  dst->sum=a->sum-b->sum;
+  dst->max=0;
+  for (i=0; i<HIST_BUCKETS; i++) {
+    dst->buckets[i]=a->buckets[i]-b->buckets[i];
+    if (dst->buckets[i]) dst->max=hist_bucket_low(i+1)-1;
+  }
+  if (dst->max>a->max) dst->max=a->max;
+}
+
+// returns latency in seconds of the sample with given rank (1..count)
+static ev_tstamp hist_rank(const latency_hist* h, uint64_t target) {
+  if (!h->count) return 0;
+  uint64_t seen=0;
+  int i;
+  if (target<1) target=1;
+  for (i=0; i<HIST_BUCKETS; i++) {
+    seen+=h->buckets[i];
+    if (seen>=target) {
+      uint64_t low=hist_bucket_low(i);
+      uint64_t v=low+(hist_bucket_low(i+1)-low)/2;
+      if (v>h->max) v=h->max;
+      return v/1000000.;
+    }
+  }
+  return h->max/1000000.;
+}
+
+// returns latency in seconds at given percentile (0..100)
+static ev_tstamp hist_percentile(const latency_hist* h, double pct) {
+  return hist_rank(h, ceil(pct/100.*h->count));
+}
+
+// distribution-free 95% confidence interval of a percentile: order
+// statistics around rank n*q, using the normal approximation of binomial
+static void hist_percentile_ci(const latency_hist* h, double pct, ev_tstamp* lo, ev_tstamp* hi) {
+  double n=h->count, q=pct/100.;
+  double d=1.96*sqrt(n*q*(1-q));
+  double rlo=floor(n*q-d), rhi=ceil(n*q+d)+1;
+  *lo=hist_rank(h, rlo<1? 1 : (uint64_t)rlo);
+  *hi=hist_rank(h, rhi>n? h->count : (uint64_t)rhi);
+}
+
+static void stats_merge(run_stats* dst, const run_stats* src) {
+  int i;
+  dst->num_connect+=src->num_connect;
+  dst->num_success+=src->num_success;
+  dst->num_fail+=src->num_fail;
+  dst->num_bytes_received+=src->num_bytes_received;
+  dst->num_overhead_received+=src->num_overhead_received;
+  dst->num_connect_fail+=src->num_connect_fail;
+  for (i=0; i<TO_MAX; i++) dst->num_timeout[i]+=src->num_timeout[i];
+  hist_merge(&dst->latency, &src->latency);
+  hist_merge(&dst->connect_latency, &src->connect_latency);
+  hist_merge(&dst->first_latency, &src->first_latency);
+  dst->num_flow_fail+=src->num_flow_fail;
+  hist_merge(&dst->flow_latency, &src->flow_latency);
+  dst->num_established+=src->num_established;
+  dst->num_dropped+=src->num_dropped;
+  dst->num_reconnect+=src->num_reconnect;
+  hist_merge(&dst->event_gap, &src->event_gap);
+  dst->num_ktls+=src->num_ktls;
+  dst->num_ktls_fallback+=src->num_ktls_fallback;
+  for (i=0; i<EC_MAX; i++) dst->num_errors[i]+=src->num_errors[i];
+  dst->num_tunnel_fail+=src->num_tunnel_fail;
+  hist_merge(&dst->tunnel_latency, &src->tunnel_latency);
+  dst->num_tfo_data+=src->num_tfo_data;
+  dst->num_tfo_accepted+=src->num_tfo_accepted;
+  dst->num_tfo_no_cookie+=src->num_tfo_no_cookie;
+  dst->num_tfo_fallback+=src->num_tfo_fallback;
+  dst->bw_requests+=src->bw_requests;
+  dst->bw_permille+=src->bw_permille;
+  hist_merge(&dst->first_byte_latency, &src->first_byte_latency);
+  for (i=0; i<IO_MAX; i++) dst->io[i]+=src->io[i];
+}
+
+static void stats_sub(run_stats* dst, const run_stats* a, const run_stats* b) {
+  int i;
+  dst->num_connect=a->num_connect-b->num_connect;
+  dst->num_success=a->num_success-b->num_success;
+  dst->num_fail=a->num_fail-b->num_fail;
+  dst->num_bytes_received=a->num_bytes_received-b->num_bytes_received;
+  dst->num_overhead_received=a->num_overhead_received-b->num_overhead_received;
+  dst->num_connect_fail=a->num_connect_fail-b->num_connect_fail;
+  for (i=0; i<TO_MAX; i++) dst->num_timeout[i]=a->num_timeout[i]-b->num_timeout[i];
+  hist_sub(&dst->latency, &a->latency, &b->latency);
+  hist_sub(&dst->connect_latency, &a->connect_latency, &b->connect_latency);
+  hist_sub(&dst->first_latency, &a->first_latency, &b->first_latency);
+  dst->num_flow_fail=a->num_flow_fail-b->num_flow_fail;
+  hist_sub(&dst->flow_latency, &a->flow_latency, &b->flow_latency);
+  dst->num_established=a->num_established-b->num_established;
+  dst->num_dropped=a->num_dropped-b->num_dropped;
+  dst->num_reconnect=a->num_reconnect-b->num_reconnect;
+  hist_sub(&dst->event_gap, &a->event_gap, &b->event_gap);
+  dst->num_ktls=a->num_ktls-b->num_ktls;
+  dst->num_ktls_fallback=a->num_ktls_fallback-b->num_ktls_fallback;
+  for (i=0; i<EC_MAX; i++) dst->num_errors[i]=a->num_errors[i]-b->num_errors[i];
+  dst->num_tunnel_fail=a->num_tunnel_fail-b->num_tunnel_fail;
+  hist_sub(&dst->tunnel_latency, &a->tunnel_latency, &b->tunnel_latency);
+  dst->num_tfo_data=a->num_tfo_data-b->num_tfo_data;
+  dst->num_tfo_accepted=a->num_tfo_accepted-b->num_tfo_accepted;
+  dst->num_tfo_no_cookie=a->num_tfo_no_cookie-b->num_tfo_no_cookie;
+  dst->num_tfo_fallback=a->num_tfo_fallback-b->num_tfo_fallback;
+  dst->bw_requests=a->bw_requests-b->bw_requests;
+  dst->bw_permille=a->bw_permille-b->bw_permille;
+  hist_sub(&dst->first_byte_latency, &a->first_byte_latency, &b->first_byte_latency);
+  for (i=0; i<IO_MAX; i++) dst->io[i]=a->io[i]-b->io[i];
+}
+
+static double draw_think(thread_config* tdata, const think_dist* d);
+
+static inline uint64_t thread_rand64(thread_config* tdata) {
+  uint64_t x=tdata->rng;
+  x^=x<<13;
+  x^=x>>7;
+  x^=x<<17;
+  tdata->rng=x;
+  return x;
+}
+
+static inline double thread_rand(thread_config* tdata) {
+  return (thread_rand64(tdata)>>11)*(1./9007199254740992.);
+}
+
+static double draw_think(thread_config* tdata, const think_dist* d) {
+  switch (d->type) {
+    case TH_UNIFORM:
+      return d->a+thread_rand(tdata)*(d->b-d->a);
+    case TH_EXP:
+      return -d->a*log(1-thread_rand(tdata));
+    default:
+      return d->a;
+  }
+}
+
+static int draw_conn_requests(thread_config* tdata) {
+  const conn_requests_dist* d=&config.conn_requests;
+  double u;
+  switch (d->type) {
+    case CR_FIXED:
+      return d->a;
+    case CR_UNIFORM:
+      return d->a+(int)(thread_rand(tdata)*(d->b-d->a+1));
+    case CR_GEOMETRIC:
+      // each request is the last one with probability 1/mean
+      if (d->a<=1) return 1;
+      u=thread_rand(tdata);
+      return 1+(int)(log(1-u)/log(1-1/d->a));
+    default:
+      return 0;
+  }
+}
+
+static void tw_init(timer_wheel* tw) {
+  int l, i;
+  tw->now=0;
+  for (l=0; l<TW_LEVELS; l++) {
+    for (i=0; i<TW_SLOTS; i++) tw->slots[l][i].next=tw->slots[l][i].prev=&tw->slots[l][i];
+  }
+}
+
+static inline void tw_del(tw_entry* e) {
+  if (!e->next) return;
+  e->prev->next=e->next;
+  e->next->prev=e->prev;
+  e->next=e->prev=0;
+}
+
+// e->expires must not be before tw->now
+static void tw_add(timer_wheel* tw, tw_entry* e) {
+  uint64_t delta=e->expires-tw->now;
+  int level=0;
+  if (delta>=1ULL<<(TW_BITS*TW_LEVELS)) {
+    delta=(1ULL<<(TW_BITS*TW_LEVELS))-1;
+    e->expires=tw->now+delta;
+  }
+  while (delta>=1ULL<<(TW_BITS*(level+1))) level++;
+  tw_entry* head=&tw->slots[level][(e->expires>>(TW_BITS*level))&(TW_SLOTS-1)];
+  e->prev=head;
+  e->next=head->next;
+  head->next->prev=e;
+  head->next=e;
+}
+
+// moves entries of a higher level slot down once its time range comes up
+static void tw_cascade(timer_wheel* tw, int level) {
+  tw_entry* head=&tw->slots[level][(tw->now>>(TW_BITS*level))&(TW_SLOTS-1)];
+  tw_entry list=*head;
+  if (list.next==head) return;
+  list.next->prev=&list;
+  list.prev->next=&list;
+  head->next=head->prev=head;
+  while (list.next!=&list) {
+    tw_entry* e=list.next;
+    tw_del(e);
+    if (e->expires<=tw->now) e->expires=tw->now; // due this tick, lands in the slot processed next
+    tw_add(tw, e);
+  }
+}
+
+// expires everything up to tick; cb may re-arm entries
+static void tw_advance(timer_wheel* tw, uint64_t tick, void (*cb)(tw_entry* e)) {
+  while (tw->now<tick) {
+    int level;
+    tw->now++;
+    for (level=1; level<TW_LEVELS && !(tw->now&((1ULL<<(TW_BITS*level))-1)); level++);
+    while (--level>0) tw_cascade(tw, level); // highest first
+    tw_entry* head=&tw->slots[0][tw->now&(TW_SLOTS-1)];
+    while (head->next!=head) {
+      tw_entry* e=head->next;
+      tw_del(e);
+      cb(e);
+    }
+  }
+}
+
+static inline void url_record(connection* conn, ev_tstamp latency, int success) {
+  thread_config* tdata=conn->tdata;
+  if (!tdata->url_stats || tdata->cur_stats!=&tdata->stats) return;
+  url_stats* us=&tdata->url_stats[conn->first_url+conn->url_index];
+  if (!success) {
+    us->num_fail++;
+    return;
+  }
+  uint64_t v=latency>0? (uint64_t)(latency*1000000.+0.5) : 0;
+  us->num_success++;
+  us->sum+=v;
+  if (v>us->max) us->max=v>UINT32_MAX? UINT32_MAX : v;
+  us->buckets[log_bucket(v, URL_HIST_SUB_BITS, URL_HIST_MAX_BITS)]++;
+}
+
+static struct {
+  int fd;
+  char* map; // current window of the file
+  off_t map_offset;
+  size_t pos; // in window
+  uint64_t records;
+  ev_tstamp base_time;
+} trace;
+
+static inline uint32_t trace_us(ev_tstamp from, ev_tstamp to) {
+  return to>from? (uint32_t)((to-from)*1000000.+0.5) : 0;
+}
+
+static void trace_request(connection* conn, int error, ev_tstamp now) {
+  thread_config* tdata=conn->tdata;
+  ev_tstamp start=conn->req_start? conn->req_start : conn->connect_start;
+  if (error || (config.trace_sample && !(++tdata->trace_seq%config.trace_sample))
+      || (config.trace_slow>0 && now-start>=config.trace_slow)) {
+    uint32_t head=tdata->trace_head;
+    if (head-__atomic_load_n(&tdata->trace_tail, __ATOMIC_ACQUIRE)>=TRACE_RING) tdata->trace_dropped++;
+    else {
+      trace_record* r=&tdata->trace_ring[head&(TRACE_RING-1)];
+      r->start=start>trace.base_time? (uint64_t)((start-trace.base_time)*1e9) : 0;
+      r->connect=conn->alive_count? 0 : trace_us(conn->connect_start, conn->connected);
+      r->send=conn->send_start>=start? trace_us(start, conn->send_start) : 0;
+      r->first_byte=conn->resp_start? trace_us(start, conn->resp_start) : 0;
+      r->headers=conn->headers_end? trace_us(start, conn->headers_end) : 0;
+      r->total=trace_us(start, now);
+      r->conn_id=tdata->conn_offset+(conn-tdata->conns);
+      r->url=config.num_urls? conn->first_url+conn->url_index : 0;
+      r->bytes=conn->bytes_received>0? conn->bytes_received : 0;
+      r->status=conn->status;
+      r->error=error;
+      r->thread=tdata->id;
+      r->alive_count=conn->alive_count>UINT16_MAX? UINT16_MAX : conn->alive_count;
+      __atomic_store_n(&tdata->trace_head, head+1, __ATOMIC_RELEASE);
+    }
+  }
+  conn->resp_start=conn->headers_end=0;
+  conn->status=0;
+}
+
+static int trace_map(off_t offset) {
+  if (trace.map) munmap(trace.map, TRACE_WINDOW);
+  trace.map=0;
+  if (ftruncate(trace.fd, offset+TRACE_WINDOW)) return -1;
+  void* m=mmap(0, TRACE_WINDOW, PROT_READ|PROT_WRITE, MAP_SHARED, trace.fd, offset);
+  if (m==MAP_FAILED) return -1;
+  trace.map=m;
+  trace.map_offset=offset;
+  trace.pos=0;
+  return 0;
+}
+
+static int trace_open(const char* path) {
+  trace_header h;
+  trace.fd=open(path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+  if (trace.fd==-1 || trace_map(0)) {
+    nxweb_log_error("can't create trace file %s: %d", path, errno);
+    return -1;
+  }
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+  h.version=TRACE_VERSION;
+  h.record_size=sizeof(trace_record);
+  trace.base_time=h.base_time=ev_time();
+  memcpy(trace.map, &h, sizeof(h));
+  trace.pos=sizeof(h);
+  trace.records=0;
+  return 0;
+}
+
+// main thread: moves records from the workers' rings to the file
+static void trace_flush(thread_config** threads) {
+  int i;
+  for (i=0; i<config.num_threads; i++) {
+    thread_config* tdata=threads[i];
+    uint32_t tail=tdata->trace_tail;
+    uint32_t head=__atomic_load_n(&tdata->trace_head, __ATOMIC_ACQUIRE);
+    for (; tail!=head; tail++) {
+      if (!trace.map) continue; // out of disk space or address space; drop
+      memcpy(trace.map+trace.pos, &tdata->trace_ring[tail&(TRACE_RING-1)], sizeof(trace_record));
+      trace.records++;
+      if ((trace.pos+=sizeof(trace_record))==TRACE_WINDOW && trace_map(trace.map_offset+TRACE_WINDOW))
+        nxweb_log_error("trace file window mapping failed: %d", errno);
+    }
+    __atomic_store_n(&tdata->trace_tail, tail, __ATOMIC_RELEASE);
+  }
+}
+
+static void trace_close(void) {
+  off_t size=trace.map_offset+trace.pos;
+  if (trace.map) munmap(trace.map, TRACE_WINDOW);
+  trace.map=0;
+  if (ftruncate(trace.fd, size)) nxweb_log_error("can't truncate trace file");
+  close(trace.fd);
+}
+
+static const char* trace_error_names[TE_MAX]={"", "connect", "tunnel", "tls", "write", "headers", "body",
+  "timeout_connect", "timeout_tls", "timeout_first_byte", "timeout_total", "rejected"};
+
+// --trace-decode: prints a trace file as CSV
+static int trace_decode(const char* path) {
+  FILE* f=fopen(path, "rb");
+  trace_header h;
+  trace_record r;
+  if (!f || fread(&h, sizeof(h), 1, f)!=1 || memcmp(h.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC))
+      || h.version!=TRACE_VERSION || h.record_size!=sizeof(trace_record)) {
+    nxweb_log_error("%s is not a trace file of this httpress version", path);
+    if (f) fclose(f);
+    return -1;
+  }
+  printf("time,thread,conn,url,alive,status,error,bytes,connect_ms,send_ms,first_byte_ms,headers_ms,total_ms\n");
+  while (fread(&r, sizeof(r), 1, f)==1) {
+    printf("%.6f,%u,%u,%u,%u,%u,%s,%u,%.3f,%.3f,%.3f,%.3f,%.3f\n", h.base_time+r.start/1e9,
+           r.thread, r.conn_id, r.url, r.alive_count, r.status, r.error<TE_MAX? trace_error_names[r.error] : "?",
+           r.bytes, r.connect/1000., r.send/1000., r.first_byte/1000., r.headers/1000., r.total/1000.);
+  }
+  fclose(f);
+  return 0;
+}
+
+static const char* error_class_names[EC_MAX]={"refused", "reset", "timeout", "tls", "header-overflow",
+  "chunk", "closed", "other"};
+
+static void log_vpush(thread_config* tdata, const char* fmt, va_list ap) {
+  uint32_t head=tdata->log_head;
+  if (head-__atomic_load_n(&tdata->log_tail, __ATOMIC_ACQUIRE)>=LOG_RING) {
+    tdata->log_dropped++;
+    return;
+  }
+  log_entry* e=&tdata->log_ring[head&(LOG_RING-1)];
+  e->time=ev_now(tdata->loop);
+  vsnprintf(e->msg, LOG_MSG_SIZE, fmt, ap);
+  __atomic_store_n(&tdata->log_head, head+1, __ATOMIC_RELEASE);
+}
+
+static void log_push(thread_config* tdata, const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  log_vpush(tdata, fmt, ap);
+  va_end(ap);
+}
+
+// closes the error class's rate limit window
+static void log_summarize(thread_config* tdata, enum error_class ec) {
+  if (tdata->log_suppressed[ec])
+    log_push(tdata, "%ld more %s errors not logged", tdata->log_suppressed[ec], error_class_names[ec]);
+  tdata->log_suppressed[ec]=0;
+  tdata->log_count[ec]=0;
+}
+
+// nxweb_log_error() for worker threads: never blocks on stderr
+static void thread_log_error(thread_config* tdata, enum error_class ec, const char* fmt, ...) {
+  va_list ap;
+  ev_tstamp now=ev_now(tdata->loop);
+  if (now-tdata->log_window[ec]>=1.) {
+    log_summarize(tdata, ec);
+    tdata->log_window[ec]=now;
+  }
+  if (tdata->log_count[ec]>=LOG_BURST) {
+    tdata->log_suppressed[ec]++;
+    return;
+  }
+  tdata->log_count[ec]++;
+  va_start(ap, fmt);
+  log_vpush(tdata, fmt, ap);
+  va_end(ap);
+}
+
+// prints queued worker thread messages; main thread only
+static void log_flush(thread_config** threads) {
+  char cur_time[32];
+  struct tm tm;
+  int i, locked=0;
+  for (i=0; i<config.num_threads; i++) {
+    thread_config* tdata=threads[i];
+    uint32_t tail=tdata->log_tail;
+    uint32_t head=__atomic_load_n(&tdata->log_head, __ATOMIC_ACQUIRE);
+    long dropped=__atomic_load_n(&tdata->log_dropped, __ATOMIC_RELAXED);
+    if (tail==head && dropped==tdata->log_dropped_reported) continue;
+    if (!locked) {
+      flockfile(stderr);
+      locked=1;
+    }
+    for (; tail!=head; tail++) {
+      const log_entry* e=&tdata->log_ring[tail&(LOG_RING-1)];
+      localtime_r(&e->time, &tm);
+      strftime(cur_time, sizeof(cur_time), "%F %T", &tm);
+      fprintf(stderr, "%s [%u:%p]: %s\n", cur_time, getpid(), (void*)tdata->tid, e->msg);
+    }
+    __atomic_store_n(&tdata->log_tail, tail, __ATOMIC_RELEASE);
+    if (dropped!=tdata->log_dropped_reported) {
+      fprintf(stderr, "thread %d: %ld error messages dropped, log ring full\n", tdata->id,
+              dropped-tdata->log_dropped_reported);
+      tdata->log_dropped_reported=dropped;
+    }
+  }
+  if (locked) {
+    fflush(stderr);
+    funlockfile(stderr);
+  }
+}
+
+static inline void count_error(connection* conn, enum error_class ec) {
+  conn->tdata->cur_stats->num_errors[ec]++;
+}
+
+// classifies errno of a failed connect, read or write
+static enum error_class errno_class(int err) {
+  switch (err) {
+    case ECONNREFUSED: return EC_REFUSED;
+    case ECONNRESET: case EPIPE: case ECONNABORTED: return EC_RESET;
+    case ETIMEDOUT: return EC_TIMEOUT;
+    case EPROTO: return EC_TLS; // see conn_read()
+    case ENOTCONN: return EC_CLOSED;
+    default: return EC_OTHER;
+  }
+}
+
+#ifdef WITH_SSL
+static enum error_class tls_error_class(int ret) {
+  if (ret==GNUTLS_E_PULL_ERROR || ret==GNUTLS_E_PUSH_ERROR) return errno_class(errno);
+  if (ret==GNUTLS_E_PREMATURE_TERMINATION) return EC_CLOSED;
+  return EC_TLS;
+}
+#endif // WITH_SSL
+
+// --client-bw: the share of its connection's limit the request got (the
+// time the response takes at that rate against the request's latency) and
+// how long the server took to start answering; both drop when the server
+// stalls on slow readers instead of buffering for them
+static void bw_record(connection* conn, ev_tstamp latency) {
+  run_stats* st=conn->tdata->cur_stats;
+  double need=(conn->bytes_received+(conn->body_ptr-conn->buf))/conn->bw_rate;
+  st->bw_requests++;
+  st->bw_permille+=need<latency? (long)(1000*need/latency) : 1000;
+  if (conn->resp_start>=conn->req_start) hist_record(&st->first_byte_latency, conn->resp_start-conn->req_start);
+}
+
 static inline void inc_success(connection* conn) {
+  run_stats* st=conn->tdata->cur_stats;
+  ev_tstamp latency=ev_time()-conn->req_start;
   conn->success_count++;
-  conn->tdata->num_success++;
-  conn->tdata->num_bytes_received+=conn->bytes_received;
-  conn->tdata->num_overhead_received+=(conn->body_ptr-conn->buf);
+  st->num_success++;
+  st->num_bytes_received+=conn->bytes_received;
+  st->num_overhead_received+=(conn->body_ptr-conn->buf);
+  hist_record(&st->latency, latency);
+  if (!conn->alive_count) hist_record(&st->first_latency, latency);
+  url_record(conn, latency, 1);
+  if (conn->bw_rate>0) bw_record(conn, latency);
+  if (conn->tdata->trace_ring) trace_request(conn, TE_OK, conn->req_start+latency);
+  conn->req_start=0;
 }
 
 static inline void inc_fail(connection* conn) {
-  conn->tdata->num_fail++;
+  int reason=conn->fail_code? conn->fail_code : TE_CONNECT+conn->state;
+  PROBE(request_fail, conn, conn->tdata->id, conn->bytes_received, conn->state, reason);
+  conn->tdata->cur_stats->num_fail++;
+  if (conn->req_start) url_record(conn, 0, 0);
+  if (conn->tdata->trace_ring) trace_request(conn, reason, ev_time());
+  conn->fail_code=0;
+  if (config.flow && conn->req_start) {
+    // the user gives up; the next flow starts over on a new connection
+    conn->tdata->cur_stats->num_flow_fail++;
+    conn->url_index=0;
+  }
+  conn->req_start=0;
 }
 
 static inline void inc_connect(connection* conn) {
-  conn->tdata->num_connect++;
+  conn->tdata->cur_stats->num_connect++;
+}
+
+static inline void inc_connect_fail(connection* conn) {
+  conn->tdata->cur_stats->num_connect_fail++;
+  if (!conn->fail_code) conn->fail_code=TE_CONNECT;
+  inc_fail(conn);
 }
 
 enum {ERR_AGAIN=-2, ERR_ERROR=-1, ERR_RDCLOSED=-3};
 
-static inline ssize_t conn_read(connection* conn, void* buf, size_t size) {
+// accounts a read()-like syscall; a short read or EAGAIN means the socket
+// is drained, which --edge has to know as it gets no new event until then
+static inline void count_read(connection* conn, ssize_t ret, size_t size) {
+  long* io=conn->tdata->cur_stats->io;
+  io[IO_RW]++;
+  if (ret>0) {
+    io[IO_READS]++;
+    io[IO_READ_BYTES]+=ret;
+    if ((size_t)ret<size) conn->ready&=~EV_READ;
+  }
+  else if (ret<0 && errno==EAGAIN) {
+    io[IO_EAGAIN]++;
+    conn->ready&=~EV_READ;
+  }
+}
+
+static inline void count_write(connection* conn, ssize_t ret, size_t size) {
+  long* io=conn->tdata->cur_stats->io;
+  io[IO_RW]++;
+  if (ret>=0 && (size_t)ret<size) {
+    io[IO_PARTIAL_WRITE]++;
+    conn->ready&=~EV_WRITE;
+  }
+  else if (ret<0 && errno==EAGAIN) {
+    io[IO_EAGAIN]++;
+    conn->ready&=~EV_WRITE;
+  }
+}
+
+// --fastopen: the first write of a deferred connect sends the SYN with the data
+static inline void tfo_first_write(connection* conn, ssize_t ret) {
+  conn->tfo=0;
+  if (ret>0) {
+    conn->tdata->cur_stats->num_tfo_data++;
+    conn->tfo_sent=1;
+  }
+}
+
+// --fastopen: whether the server took the SYN data or the kernel had to resend it
+static void tfo_check(connection* conn) {
+  struct tcp_info ti;
+  socklen_t len=sizeof(ti);
+  conn->tfo_sent=0;
+  conn->tdata->cur_stats->io[IO_OTHER]++;
+  if (!getsockopt(conn->fd, IPPROTO_TCP, TCP_INFO, &ti, &len) && (ti.tcpi_options&TCPI_OPT_SYN_DATA))
+    conn->tdata->cur_stats->num_tfo_accepted++;
+}
+
+// --edge: dispatches the wanted directions that may still make progress
+static inline void conn_recheck(connection* conn) {
+  int events=conn->want&conn->ready;
+  if (events&EV_WRITE) ev_feed_event(conn->loop, &conn->watch_write, EV_WRITE);
+  if (events&EV_READ) ev_feed_event(conn->loop, &conn->watch_read, EV_READ);
+}
+
+/*
+ * Sets the directions the connection waits for. By default these are libev
+ * watchers, so every change is an epoll_ctl() in the next loop iteration
+ * (libev defers removals and merges changes on one fd, so a new nonzero set
+ * counts as one). With --edge the socket stays registered for both
+ * directions and readiness recorded by epoll_cb() is replayed instead.
+ */
+static inline void conn_watch(connection* conn, int events) {
+  int changed=conn->want^events;
+  if (!(events&EV_WRITE)) ev_io_stop(conn->loop, &conn->watch_write); // also drops a pending event
+  if (!(events&EV_READ)) ev_io_stop(conn->loop, &conn->watch_read);
+  if (!changed) return;
+  if (config.edge) {
+    // keeps the loop alive like an active watcher would
+    if (!conn->want) ev_ref(conn->loop);
+    else if (!events) ev_unref(conn->loop);
+    conn->want=events;
+    conn_recheck(conn);
+    return;
+  }
+  if (events&changed&EV_WRITE) ev_io_start(conn->loop, &conn->watch_write);
+  if (events&changed&EV_READ) ev_io_start(conn->loop, &conn->watch_read);
+  if (events) conn->tdata->cur_stats->io[IO_CTL]++;
+  conn->want=events;
+}
+
+#ifdef HAVE_KTLS
+// reads application data from a kTLS socket; other records are returned
+// separately with their type in a control message
+static ssize_t ktls_recv(connection* conn, void* buf, size_t size) {
+  char control[CMSG_SPACE(sizeof(unsigned char))];
+  struct iovec iov={buf, size};
+  struct msghdr msg;
+  for (;;) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov=&iov;
+    msg.msg_iovlen=1;
+    msg.msg_control=control;
+    msg.msg_controllen=sizeof(control);
+    ssize_t ret=recvmsg(conn->fd, &msg, 0);
+    count_read(conn, ret, size);
+    if (ret==0) return ERR_RDCLOSED;
+    if (ret<0) return errno==EAGAIN? ERR_AGAIN : ERR_ERROR;
+    struct cmsghdr* cmsg=CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level!=SOL_TLS || cmsg->cmsg_type!=TLS_GET_RECORD_TYPE) return ret;
+    unsigned char type=*CMSG_DATA(cmsg);
+    if (type==23) return ret; // application data
+    if (type==21) return ERR_RDCLOSED; // alert: close_notify or fatal
+    // handshake record after the handshake, e.g. a TLS 1.3 session ticket: skip
+  }
+}
+#endif // HAVE_KTLS
+
+#ifdef WITH_SSL
+// gnutls transport: the same socket calls, counted like the plain ones
+static ssize_t tls_pull(gnutls_transport_ptr_t ptr, void* buf, size_t size) {
+  connection* conn=ptr;
+  ssize_t ret=recv(conn->fd, buf, size, 0);
+  count_read(conn, ret, size);
+  return ret;
+}
+
+static ssize_t tls_push(gnutls_transport_ptr_t ptr, const void* buf, size_t size) {
+  connection* conn=ptr;
+  ssize_t ret=send(conn->fd, buf, size, 0);
+  if (conn->tfo) tfo_first_write(conn, ret);
+  count_write(conn, ret, size);
+  return ret;
+}
+
+static int tls_pull_timeout(gnutls_transport_ptr_t ptr, unsigned int ms) {
+  return 1; // never wait: the socket is non-blocking and recv() says EAGAIN
+}
+#endif // WITH_SSL
+
+static inline ssize_t conn_recv(connection* conn, void* buf, size_t size) {
+#ifdef HAVE_KTLS
+  if (conn->ktls_rx) return ktls_recv(conn, buf, size);
+#endif
 #ifdef WITH_SSL
   if (conn->secure) {
     ssize_t ret=gnutls_record_recv(conn->session, buf, size);
     if (ret>0) return ret;
     if (ret==GNUTLS_E_AGAIN) return ERR_AGAIN;
     if (ret==0) return ERR_RDCLOSED;
+    errno=tls_error_class(ret)==EC_CLOSED? ENOTCONN : ret==GNUTLS_E_PULL_ERROR? errno : EPROTO;
     return ERR_ERROR;
   }
   else
 #endif
   {
     ssize_t ret=read(conn->fd, buf, size);
+    count_read(conn, ret, size);
     if (ret>0) return ret;
     if (ret==0) return ERR_RDCLOSED;
     if (errno==EAGAIN) return ERR_AGAIN;
@@ -337,41 +1421,143 @@ static inline ssize_t conn_read(connection* conn, void* buf, size_t size) {
   }
 }
 
-static inline ssize_t conn_write(connection* conn, void* buf, size_t size) {
+static inline ssize_t conn_send(connection* conn, void* buf, size_t size) {
 #ifdef WITH_SSL
-  if (conn->secure) {
+  if (conn->secure && !conn->ktls_tx) {
     ssize_t ret=gnutls_record_send(conn->session, buf, size);
     if (ret>=0) return ret;
     if (ret==GNUTLS_E_AGAIN) return ERR_AGAIN;
+    if (ret!=GNUTLS_E_PUSH_ERROR) errno=EPROTO;
     return ERR_ERROR;
   }
   else
 #endif
-  if (has_fastopen) {
-    ssize_t ret=send(conn->fd, buf, size,0);
-    if (ret>=0) return ret;
-    if (errno==EAGAIN) return ERR_AGAIN;
-    return ERR_ERROR;
-  } else  {
-    ssize_t ret=write(conn->fd, buf, size);
+  {
+    ssize_t ret=send(conn->fd, buf, size, 0);
+    if (conn->tfo) tfo_first_write(conn, ret);
+    count_write(conn, ret, size);
     if (ret>=0) return ret;
     if (errno==EAGAIN) return ERR_AGAIN;
     return ERR_ERROR;
   }
 }
 
-static inline void conn_close(connection* conn, int good) {
-#ifdef WITH_SSL
-  if (conn->secure) gnutls_deinit(conn->session);
-#endif
-  if (good) _nxweb_close_good_socket(conn->fd);
-  else _nxweb_close_bad_socket(conn->fd);
-}
+/*
+ * --client-bw: each connection is a client on a slow link. Reads and writes
+ * take from a token bucket per direction, refilled at the connection's rate
+ * and holding at most BW_BURST seconds of it. When a bucket is empty the
+ * direction pauses, watchers off, until it holds a full burst again; the
+ * server's writes then back up in the socket buffers (see --rcvbuf). With TLS
+ * the limit applies to plaintext, and gnutls reads whole records at a time.
+ */
 
-static int open_socket(connection* conn);
-static void rearm_socket(connection* conn);
+#define BW_BURST 0.02
+#define BW_MIN_BURST 1024
 
-#ifdef WITH_SSL
+static void bw_start(connection* conn) {
+  conn->bw_rate=config.client_bw_min+thread_rand(conn->tdata)*(config.client_bw_max-config.client_bw_min);
+  conn->bw_burst=conn->bw_rate*BW_BURST;
+  if (conn->bw_burst<BW_MIN_BURST) conn->bw_burst=BW_MIN_BURST;
+  conn->rx_tokens=conn->tx_tokens=conn->bw_burst;
+  conn->rx_time=conn->tx_time=ev_now(conn->loop);
+}
+
+// how much of size the connection may transfer now; 0 pauses the direction
+// until the bucket is full
+static size_t bw_allow(connection* conn, int dir, size_t size) {
+  float* tokens=dir==EV_READ? &conn->rx_tokens : &conn->tx_tokens;
+  ev_tstamp* last=dir==EV_READ? &conn->rx_time : &conn->tx_time;
+  ev_tstamp now=ev_now(conn->loop);
+  double t=*tokens+(now-*last)*conn->bw_rate;
+  if (t>conn->bw_burst) t=conn->bw_burst;
+  *tokens=t;
+  *last=now;
+  if (t>=size) return size;
+  if (t>=conn->bw_burst/2) return t; // not trickling, but whole chunks
+  conn_watch(conn, 0);
+  conn->bw_dir=dir;
+  ev_timer_set(&conn->watch_bw, (conn->bw_burst-t)/conn->bw_rate, 0.);
+  ev_timer_start(conn->loop, &conn->watch_bw);
+  return 0;
+}
+
+static void bw_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+  connection *conn=((connection*)(((char*)w)-offsetof(connection, watch_bw)));
+  conn_watch(conn, conn->bw_dir);
+  ev_feed_event(loop, conn->bw_dir==EV_READ? &conn->watch_read : &conn->watch_write, conn->bw_dir);
+}
+
+static inline ssize_t conn_read(connection* conn, void* buf, size_t size) {
+  if (conn->bw_rate<=0) return conn_recv(conn, buf, size);
+  if (!(size=bw_allow(conn, EV_READ, size))) return ERR_AGAIN;
+  ssize_t ret=conn_recv(conn, buf, size);
+  if (ret>0) conn->rx_tokens-=ret;
+  return ret;
+}
+
+static inline ssize_t conn_write(connection* conn, void* buf, size_t size) {
+  if (conn->bw_rate<=0) return conn_send(conn, buf, size);
+  if (!(size=bw_allow(conn, EV_WRITE, size))) return ERR_AGAIN;
+  ssize_t ret=conn_send(conn, buf, size);
+  if (ret>0) conn->tx_tokens-=ret;
+  return ret;
+}
+
+static inline void conn_close(connection* conn, int good) {
+  conn_watch(conn, 0);
+  if (conn->bw_rate>0) ev_timer_stop(conn->loop, &conn->watch_bw);
+  tw_del(&conn->timer);
+  conn->tdata->cur_stats->io[IO_OTHER]+=good? 1 : 2; // close, SO_LINGER
+  if (conn->tfo_sent) tfo_check(conn);
+#ifdef WITH_SSL
+  if (conn->secure) gnutls_deinit(conn->session);
+#endif
+  if (good) _nxweb_close_good_socket(conn->fd);
+  else _nxweb_close_bad_socket(conn->fd);
+}
+
+static int open_socket(connection* conn);
+static int connect_socket(connection* conn);
+static void think_cb(struct ev_loop *loop, ev_timer *w, int revents);
+static void rearm_socket(connection* conn);
+static void next_request(connection* conn);
+static void reopen_socket(connection* conn);
+static int pace_request(connection* conn);
+static void tunnel_write(connection* conn);
+
+// (re)arms the connection's single wheel entry for a phase deadline
+static void arm_timeout(connection* conn, enum timeout_phase phase, ev_tstamp deadline) {
+  thread_config* tdata=conn->tdata;
+  tw_del(&conn->timer);
+  conn->timeout_phase=phase;
+  uint64_t tick=(uint64_t)((deadline-tdata->wheel_start)/TW_TICK)+1;
+  conn->timer.expires=tick>tdata->wheel.now? tick : tdata->wheel.now+1;
+  tw_add(&tdata->wheel, &conn->timer);
+}
+
+static inline void start_phase(connection* conn, enum timeout_phase phase) {
+  if (config.timeout[phase]>0) arm_timeout(conn, phase, ev_now(conn->loop)+config.timeout[phase]);
+  else tw_del(&conn->timer);
+}
+
+static void timeout_expired(tw_entry* e) {
+  connection *conn=((connection*)(((char*)e)-offsetof(connection, timer)));
+  conn_watch(conn, 0);
+  conn_close(conn, 0);
+  conn->tdata->cur_stats->num_timeout[conn->timeout_phase]++;
+  count_error(conn, EC_TIMEOUT);
+  conn->fail_code=TE_TIMEOUT+conn->timeout_phase;
+  if (conn->timeout_phase==TO_CONNECT) inc_connect_fail(conn);
+  else inc_fail(conn);
+  open_socket(conn);
+}
+
+static void wheel_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+  thread_config *tdata=((thread_config*)(((char*)w)-offsetof(thread_config, watch_wheel)));
+  tw_advance(&tdata->wheel, (uint64_t)((ev_now(loop)-tdata->wheel_start)/TW_TICK), timeout_expired);
+}
+
+#ifdef WITH_SSL
 static void retrieve_ssl_session_info(connection* conn) {
   if (conn->tdata->ssl_identified) return; // already retrieved
   conn->tdata->ssl_identified=1;
@@ -401,12 +1587,207 @@ static void retrieve_ssl_session_info(connection* conn) {
 }
 #endif // WITH_SSL
 
+#ifdef HAVE_KTLS
+// gives the kernel the keys, IV and sequence number of one direction
+static int ktls_set(connection* conn, int read, int version, gnutls_cipher_algorithm_t cipher) {
+  gnutls_datum_t mac_key, iv, key;
+  unsigned char seq[8];
+  union {
+    struct tls12_crypto_info_aes_gcm_128 aes128;
+    struct tls12_crypto_info_aes_gcm_256 aes256;
+    struct tls12_crypto_info_chacha20_poly1305 chacha;
+  } ci;
+  socklen_t len;
+  if (gnutls_record_get_state(conn->session, read, &mac_key, &iv, &key, seq)) return -1;
+  memset(&ci, 0, sizeof(ci));
+  // TLS 1.2 GCM nonces are salt+explicit part (starting at the sequence
+  // number); TLS 1.3 and ChaCha20 take the whole IV from the key schedule
+  if (cipher==GNUTLS_CIPHER_AES_128_GCM) {
+    if (key.size!=sizeof(ci.aes128.key) || iv.size<(version==TLS_1_2_VERSION? 4 : 12)) return -1;
+    ci.aes128.info.version=version;
+    ci.aes128.info.cipher_type=TLS_CIPHER_AES_GCM_128;
+    memcpy(ci.aes128.iv, version==TLS_1_2_VERSION? seq : iv.data+4, sizeof(ci.aes128.iv));
+    memcpy(ci.aes128.salt, iv.data, sizeof(ci.aes128.salt));
+    memcpy(ci.aes128.rec_seq, seq, sizeof(ci.aes128.rec_seq));
+    memcpy(ci.aes128.key, key.data, sizeof(ci.aes128.key));
+    len=sizeof(ci.aes128);
+  }
+  else if (cipher==GNUTLS_CIPHER_AES_256_GCM) {
+    if (key.size!=sizeof(ci.aes256.key) || iv.size<(version==TLS_1_2_VERSION? 4 : 12)) return -1;
+    ci.aes256.info.version=version;
+    ci.aes256.info.cipher_type=TLS_CIPHER_AES_GCM_256;
+    memcpy(ci.aes256.iv, version==TLS_1_2_VERSION? seq : iv.data+4, sizeof(ci.aes256.iv));
+    memcpy(ci.aes256.salt, iv.data, sizeof(ci.aes256.salt));
+    memcpy(ci.aes256.rec_seq, seq, sizeof(ci.aes256.rec_seq));
+    memcpy(ci.aes256.key, key.data, sizeof(ci.aes256.key));
+    len=sizeof(ci.aes256);
+  }
+  else {
+    if (key.size!=sizeof(ci.chacha.key) || iv.size!=sizeof(ci.chacha.iv)) return -1;
+    ci.chacha.info.version=version;
+    ci.chacha.info.cipher_type=TLS_CIPHER_CHACHA20_POLY1305;
+    memcpy(ci.chacha.iv, iv.data, sizeof(ci.chacha.iv));
+    memcpy(ci.chacha.rec_seq, seq, sizeof(ci.chacha.rec_seq));
+    memcpy(ci.chacha.key, key.data, sizeof(ci.chacha.key));
+    len=sizeof(ci.chacha);
+  }
+  return setsockopt(conn->fd, SOL_TLS, read? TLS_RX : TLS_TX, &ci, len);
+}
+
+// --ktls: after the handshake the kernel takes over record encryption, so
+// conn_read()/conn_write() become plain socket calls. Falls back to gnutls,
+// per direction, when the protocol, cipher or kernel can't do it.
+static void ktls_enable(connection* conn) {
+  static int reported;
+  run_stats* st=conn->tdata->cur_stats;
+  gnutls_protocol_t protocol=gnutls_protocol_get_version(conn->session);
+  gnutls_cipher_algorithm_t cipher=gnutls_cipher_get(conn->session);
+  int version=protocol==GNUTLS_TLS1_2? TLS_1_2_VERSION : TLS_1_3_VERSION;
+  const char* reason=0;
+  if (protocol!=GNUTLS_TLS1_2 && protocol!=GNUTLS_TLS1_3) reason="protocol not supported";
+  else if (cipher!=GNUTLS_CIPHER_AES_128_GCM && cipher!=GNUTLS_CIPHER_AES_256_GCM
+           && cipher!=GNUTLS_CIPHER_CHACHA20_POLY1305) reason="cipher not supported";
+  else if (gnutls_record_check_pending(conn->session)) reason="data buffered by gnutls";
+  else if (setsockopt(conn->fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls"))) reason="no tls module in kernel";
+  else {
+    // without TLS_TX set the socket still sends plain bytes, so a failure
+    // in either direction leaves that direction to gnutls
+    conn->ktls_tx=!ktls_set(conn, 0, version, cipher);
+    conn->ktls_rx=!ktls_set(conn, 1, version, cipher);
+    if (!conn->ktls_tx || !conn->ktls_rx) reason="keys rejected by kernel";
+  }
+  if (!reason) {
+    st->num_ktls++;
+    return;
+  }
+  st->num_ktls_fallback++;
+  if (!reported && __sync_bool_compare_and_swap(&reported, 0, 1))
+    nxweb_log_error("kTLS not used (%s: %s, %s), falling back to gnutls", reason,
+                    gnutls_protocol_get_name(protocol), gnutls_cipher_get_name(cipher));
+}
+#endif // HAVE_KTLS
+
+#ifdef WITH_SSL
+static void tls_suite_record(connection* conn, ev_tstamp latency) {
+  thread_config* tdata=conn->tdata;
+  gnutls_session_t session=conn->session;
+  gnutls_protocol_t protocol=gnutls_protocol_get_version(session);
+  gnutls_kx_algorithm_t kx=gnutls_kx_get(session);
+  gnutls_cipher_algorithm_t cipher=gnutls_cipher_get(session);
+  gnutls_group_t kx_group=gnutls_group_get(session);
+  tls_suite* ts=0;
+  int i;
+  if (tdata->cur_stats!=&tdata->stats) return; // warming up
+  for (i=0; i<tdata->num_tls_suites; i++) {
+    tls_suite* s=&tdata->tls_suites[i];
+    if (s->tls_group==conn->tls_group && s->protocol==protocol && s->kx==kx
+        && s->cipher==cipher && s->kx_group==kx_group) {
+      ts=s;
+      break;
+    }
+  }
+  if (!ts) {
+    if (i==MAX_TLS_SUITES) return;
+    ts=&tdata->tls_suites[tdata->num_tls_suites++];
+    ts->tls_group=conn->tls_group;
+    ts->protocol=protocol;
+    ts->kx=kx;
+    ts->cipher=cipher;
+    ts->kx_group=kx_group;
+  }
+  hist_record(&ts->latency, latency);
+}
+
+// --handshake: a completed handshake is the request. Its latency counts from
+// connect(); the per-suite breakdown only from TCP connection established.
+static void handshake_complete(connection* conn, ev_tstamp tcp_connected) {
+  tls_suite_record(conn, ev_time()-tcp_connected);
+  conn->req_start=conn->connect_start;
+  conn->body_ptr=conn->buf;
+  conn->bytes_received=0;
+  conn->status=0;
+  inc_success(conn);
+  conn_watch(conn, 0);
+  if (config.close_notify) gnutls_bye(conn->session, GNUTLS_SHUT_WR); // a single alert, fits the send buffer
+  conn_close(conn, 1);
+  open_socket(conn);
+}
+#endif // WITH_SSL
+
+static inline int conn_index(connection* conn) {
+  return conn-conn->tdata->conns;
+}
+
+// asks the plugin for the request; conn->buf is free until the response arrives
+static int plugin_request(connection* conn) {
+  int len=plugin->build_request(conn->tdata->plugin_ctx, conn_index(conn), conn->buf, config.buf_size);
+  if (len>0 && len<=config.buf_size) {
+    conn->req_data=conn->buf;
+    conn->req_len=len;
+  }
+  else if (len) {
+    if (len>0) thread_log_error(conn->tdata, EC_OTHER, "plugin request too long: %d", len);
+    conn->req_start=0;
+    conn_watch(conn, 0);
+    conn_close(conn, 1);
+    conn->done=1;
+    ev_feed_event(conn->tdata->loop, &conn->tdata->watch_heartbeat, EV_TIMER);
+    return -1;
+  }
+  return 0;
+}
+
+// the next WebSocket message: a binary frame masked with a fresh random key
+static void ws_message(connection* conn) {
+  uint64_t r=thread_rand64(conn->tdata);
+  uint8_t key[4];
+  memcpy(key, &r, 4);
+  int n=ws_frame_header((uint8_t*)conn->buf, WS_OP_BINARY, config.ws_size, key);
+  ws_mask(conn->buf+n, config.ws_payload, config.ws_size, key);
+  conn->req_data=conn->buf;
+  conn->req_len=n+config.ws_size;
+}
+
 static void write_cb(struct ev_loop *loop, ev_io *w, int revents) {
   connection *conn=((connection*)(((char*)w)-offsetof(connection, watch_write)));
 
   if (conn->state==C_CONNECTING) {
+    // --fastopen connect() was deferred and nothing is sent yet: the first
+    // write below sends the SYN, so there is no connect time
+    if (!conn->tfo) {
+      int err=0;
+      socklen_t len=sizeof(err);
+      conn->tdata->cur_stats->io[IO_OTHER]++;
+      if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+        if (!err) err=errno;
+        enum error_class ec=errno_class(err);
+        count_error(conn, ec);
+        strerror_r(err, conn->buf, config.buf_size);
+        thread_log_error(conn->tdata, ec, "connect failed: %d %s", err, conn->buf);
+        conn_close(conn, 0);
+        inc_connect_fail(conn);
+        reopen_socket(conn);
+        return;
+      }
+      hist_record(&conn->tdata->cur_stats->connect_latency, ev_time()-conn->connect_start);
+    }
     conn->last_activity=ev_now(loop);
-    conn->state=conn->secure? C_HANDSHAKING : C_WRITING;
+    conn->connected=conn->last_activity;
+    PROBE(connected, conn, conn->tdata->id, 0, conn->state, conn->fd);
+    if (conn->secure && config.proxy) {
+      conn->state=C_TUNNELING;
+      conn->write_pos=0;
+    }
+    else {
+      conn->state=conn->secure? C_HANDSHAKING : C_WRITING;
+      if (conn->secure) start_phase(conn, TO_TLS);
+      else tw_del(&conn->timer);
+    }
+  }
+
+  if (conn->state==C_TUNNELING) {
+    tunnel_write(conn);
+    return;
   }
 
 #ifdef WITH_SSL
@@ -415,19 +1796,31 @@ static void write_cb(struct ev_loop *loop, ev_io *w, int revents) {
     int ret=gnutls_handshake(conn->session);
     if (ret==GNUTLS_E_SUCCESS) {
       retrieve_ssl_session_info(conn);
+#ifdef HAVE_KTLS
+      if (config.ktls) ktls_enable(conn);
+#endif
+      tw_del(&conn->timer);
+      ev_tstamp tcp_connected=conn->connected;
+      conn->connected=ev_now(loop);
+      PROBE(handshake_done, conn, conn->tdata->id, 0, conn->state, conn->fd);
+      if (config.handshake) {
+        handshake_complete(conn, tcp_connected);
+        return;
+      }
       conn->state=C_WRITING;
       // fall through to C_WRITING
     }
     else if (ret==GNUTLS_E_AGAIN || !gnutls_error_is_fatal(ret)) {
-      if (ret!=GNUTLS_E_AGAIN) nxweb_log_error("gnutls handshake non-fatal error [%d] %s conn=%p", ret, gnutls_strerror(ret), conn);
+      if (ret!=GNUTLS_E_AGAIN) thread_log_error(conn->tdata, EC_TLS, "gnutls handshake non-fatal error [%d] %s conn=%p", ret, gnutls_strerror(ret), conn);
       if (!gnutls_record_get_direction(conn->session)) {
-        ev_io_stop(conn->loop, &conn->watch_write);
-        ev_io_start(conn->loop, &conn->watch_read);
+        conn_watch(conn, EV_READ);
       }
       return;
     }
     else {
-      nxweb_log_error("gnutls handshake error [%d] %s conn=%p", ret, gnutls_strerror(ret), conn);
+      enum error_class ec=tls_error_class(ret);
+      count_error(conn, ec);
+      thread_log_error(conn->tdata, ec, "gnutls handshake error [%d] %s conn=%p", ret, gnutls_strerror(ret), conn);
       conn_close(conn, 0);
       inc_fail(conn);
       open_socket(conn);
@@ -438,34 +1831,52 @@ static void write_cb(struct ev_loop *loop, ev_io *w, int revents) {
 
   if (conn->state==C_WRITING) {
     int bytes_avail, bytes_sent;
-	int req_index;
 	char *data;
 	int data_len;
-	//use the session urls if in sessions mode
-	if (config.num_urls>0) {
-		req_index=rand() % conn->num_urls;
-		data=conn->urls[req_index];
-		data_len=conn->request_length_arr[req_index];
-	} else {
-		data=config.request_data;
-		data_len=config.request_length;
+	if (!conn->write_pos && !conn->req_start) {
+	  conn->req_start=conn->intended? conn->intended : ev_time();
+	  conn->send_start=ev_now(loop);
+	  start_phase(conn, TO_TOTAL);
+	  if (config.flow) {
+	    if (!conn->url_index) conn->flow_start=conn->req_start;
+	  }
+	  else if (config.num_urls>0 && !conn->ws_open) conn->url_index=rand() % conn->num_urls;
+	  //use the session urls if in sessions mode
+	  if (conn->ws_open) {
+		ws_message(conn);
+	  } else if (config.num_urls>0) {
+		conn->req_data=conn->urls[conn->url_index];
+		conn->req_len=conn->request_length_arr[conn->url_index];
+	  } else {
+		conn->req_data=config.request_data;
+		conn->req_len=config.request_length;
+	  }
+	  if (plugin && plugin->build_request && !conn->ws_open && plugin_request(conn)) return;
 	}
+	data=(char*)conn->req_data;
+	data_len=conn->req_len;
     do {
       bytes_avail=data_len - conn->write_pos;
       if (!bytes_avail) {
+        PROBE(request_sent, conn, conn->tdata->id, data_len, conn->state, conn->alive_count);
         conn->state=C_READING_HEADERS;
         conn->read_pos=0;
-        ev_io_stop(conn->loop, &conn->watch_write);
-        //ev_io_set(&conn->watch_read, conn->fd, EV_READ);
-        ev_io_start(conn->loop, &conn->watch_read);
+        if (config.timeout[TO_FIRST_BYTE]>0) {
+          ev_tstamp deadline=ev_now(loop)+config.timeout[TO_FIRST_BYTE];
+          if (!config.timeout[TO_TOTAL] || deadline<conn->send_start+config.timeout[TO_TOTAL])
+            arm_timeout(conn, TO_FIRST_BYTE, deadline);
+        }
+        conn_watch(conn, EV_READ);
         ev_feed_event(conn->loop, &conn->watch_read, EV_READ);
         return;
       }
       bytes_sent=conn_write(conn, data+conn->write_pos, bytes_avail);
       if (bytes_sent<0) {
         if (bytes_sent!=ERR_AGAIN) {
-          strerror_r(errno, conn->buf, sizeof(conn->buf));
-          nxweb_log_error("conn_write() returned %d: %d %s", bytes_sent, errno, conn->buf);
+          enum error_class ec=errno_class(errno);
+          count_error(conn, ec);
+          strerror_r(errno, conn->buf, config.buf_size);
+          thread_log_error(conn->tdata, ec, "conn_write() returned %d: %d %s", bytes_sent, errno, conn->buf);
           conn_close(conn, 0);
           inc_fail(conn);
           open_socket(conn);
@@ -563,6 +1974,7 @@ static void parse_headers(connection* conn) {
   *(conn->body_ptr-1)='\0';
 
   conn->keep_alive=!strncasecmp(conn->buf, "HTTP/1.1", 8);
+  conn->status=conn->read_pos>12 && !strncasecmp(conn->buf, "HTTP/1.", 7)? atoi(conn->buf+9) : 0;
   conn->bytes_to_read=-1;
   char *p;
   for (p=strchr(conn->buf, '\n'); p; p=strchr(p, '\n')) {
@@ -593,30 +2005,280 @@ static void parse_headers(connection* conn) {
   conn->bytes_received=conn->read_pos-(conn->body_ptr-conn->buf); // what already read
 }
 
+static int plugin_headers(connection* conn) {
+  void* ctx=conn->tdata->plugin_ctx;
+  int id=conn_index(conn);
+  if (plugin->on_headers && plugin->on_headers(ctx, id, conn->status, conn->buf, conn->body_ptr-conn->buf-1)<0) return -1;
+  if (plugin->on_body && conn->bytes_received>0 && plugin->on_body(ctx, id, conn->body_ptr, conn->bytes_received)<0) return -1;
+  return 0;
+}
+
+// echoed message frame header; returns 1 when handled,
+// 0 if more bytes are needed, -1 on anything but a data frame
+static int ws_response(connection* conn) {
+  int opcode;
+  uint64_t len;
+  const uint8_t* mask_key;
+  int n=ws_parse_header((uint8_t*)conn->buf, conn->read_pos, &opcode, &len, &mask_key);
+  if (!n) return 0;
+  if ((opcode!=WS_OP_BINARY && opcode!=WS_OP_TEXT) || len>INT_MAX) {
+    count_error(conn, EC_OTHER);
+    thread_log_error(conn->tdata, EC_OTHER, "unexpected websocket frame: opcode %d, length %llu", opcode, (unsigned long long)len);
+    return -1;
+  }
+  conn->headers_end=conn->last_activity;
+  conn->body_ptr=conn->buf+n;
+  conn->chunked=0;
+  conn->bytes_to_read=len;
+  conn->bytes_received=conn->read_pos-n;
+  if (conn->bytes_received>=conn->bytes_to_read) {
+    rearm_socket(conn);
+    return 1;
+  }
+  conn->state=C_READING_BODY;
+  ev_feed_event(conn->loop, &conn->watch_read, EV_READ);
+  return 1;
+}
+
+// --hold: counts server-sent events (blank line terminated) in decoded body
+// bytes and records the time since the previous event of the stream
+static void hold_events(connection* conn, const char* p, int len) {
+  const char* end=p+len;
+  latency_hist* gaps=&conn->tdata->cur_stats->event_gap;
+  int nl=conn->sse_nl;
+  while (p<end) {
+    if (*p=='\n') {
+      if (nl) {
+        hist_record(gaps, conn->last_activity-conn->last_event);
+        conn->last_event=conn->last_activity;
+        nl=0;
+      }
+      else nl=1;
+      p++;
+    }
+    else if (*p=='\r') p++;
+    else {
+      nl=0;
+      p=memchr(p, '\n', end-p);
+      if (!p) break;
+    }
+  }
+  conn->sse_nl=nl;
+}
+
+// returns 1 when the response is complete, -1 on chunked encoding error
+static int hold_data(connection* conn, char* buf, int len) {
+  int r=0;
+  conn->bytes_received+=len;
+  if (conn->chunked) {
+    r=decode_chunked_stream(&conn->cdstate, buf, &len);
+    if (r<0) return -1;
+  }
+  else if (conn->bytes_to_read>=0 && conn->bytes_received>=conn->bytes_to_read) r=1;
+  hold_events(conn, buf, len);
+  return r;
+}
+
+// --hold: reconnects after --reconnect-delay, like EventSource clients do
+static void reopen_socket(connection* conn) {
+  if (!config.hold || config.reconnect_delay<=0 || conn->tdata->shutdown_in_progress) {
+    open_socket(conn);
+    return;
+  }
+  conn->think_closed=1;
+  ev_timer_set(&conn->watch_think, config.reconnect_delay, 0.);
+  ev_timer_start(conn->loop, &conn->watch_think);
+}
+
+// a held stream ended before the run did: the server finished the response
+// (complete, e.g. a long poll) or the connection broke; the client comes back
+static void hold_end(connection* conn, int complete) {
+  conn->tdata->cur_stats->num_dropped++;
+  conn->held=0;
+  conn_watch(conn, 0);
+  if (complete) {
+    conn->dropped=!config.keep_alive || !conn->keep_alive;
+    next_request(conn);
+  }
+  else {
+    conn->dropped=1;
+    conn_close(conn, 0);
+    reopen_socket(conn);
+  }
+}
+
+// --hold: the request is done once response headers arrive and the stream
+// is then held open until the run ends, with no timeouts
+static void hold_stream(connection* conn) {
+  if (conn->status<200 || conn->status>299) {
+    thread_log_error(conn->tdata, EC_OTHER, "stream refused: status %d", conn->status);
+    conn_close(conn, 0);
+    inc_fail(conn);
+    open_socket(conn);
+    return;
+  }
+  tw_del(&conn->timer);
+  inc_success(conn);
+  conn->tdata->cur_stats->num_established++;
+  if (conn->tdata->shutdown_in_progress) {
+    conn_watch(conn, 0);
+    conn_close(conn, 1);
+    conn->done=1;
+    return;
+  }
+  int len=conn->bytes_received;
+  conn->held=1;
+  conn->sse_nl=0;
+  conn->last_event=conn->headers_end;
+  conn->cdstate.monitor_only=0;
+  conn->bytes_received=0;
+  conn->state=C_READING_BODY;
+  int r=hold_data(conn, conn->body_ptr, len);
+  if (r) hold_end(conn, r>0);
+  else ev_feed_event(conn->loop, &conn->watch_read, EV_READ);
+}
+
+static void hold_read(connection* conn) {
+  char* buf=conn->tdata->read_buf;
+  int n, r;
+  do {
+    n=conn_read(conn, buf, READ_BUF_SIZE);
+    if (n<=0) {
+      if (n!=ERR_AGAIN) {
+        count_error(conn, n==ERR_RDCLOSED? EC_CLOSED : errno_class(errno));
+        hold_end(conn, 0);
+      }
+      return;
+    }
+    conn->tdata->cur_stats->num_bytes_received+=n;
+    if (plugin && plugin->on_body && plugin->on_body(conn->tdata->plugin_ctx, conn_index(conn), buf, n)<0) {
+      hold_end(conn, 0);
+      return;
+    }
+    r=hold_data(conn, buf, n);
+    if (r) {
+      if (r<0) {
+        count_error(conn, EC_CHUNK);
+        thread_log_error(conn->tdata, EC_CHUNK, "chunked encoding error in stream after %d bytes", conn->bytes_received);
+      }
+      hold_end(conn, r>0);
+      return;
+    }
+  } while (n==READ_BUF_SIZE);
+}
+
+/*
+ * --proxy with https: TLS runs through a CONNECT tunnel. The connect timeout
+ * covers the CONNECT exchange; tunnel setup is timed from TCP connection
+ * established to the proxy's 2xx response.
+ */
+static void tunnel_fail(connection* conn) {
+  conn->tdata->cur_stats->num_tunnel_fail++;
+  conn_close(conn, 0);
+  inc_fail(conn);
+  open_socket(conn);
+}
+
+static void tunnel_write(connection* conn) {
+  const char* port=strchr(conn->uri_host, ':')? "" : ":443";
+  int len=snprintf(conn->buf, config.buf_size, "CONNECT %s%s HTTP/1.1\r\nHost: %s%s\r\n\r\n",
+                   conn->uri_host, port, conn->uri_host, port);
+  ssize_t n=write(conn->fd, conn->buf+conn->write_pos, len-conn->write_pos);
+  if (conn->tfo) tfo_first_write(conn, n);
+  count_write(conn, n, len-conn->write_pos);
+  if (n<0) {
+    if (errno==EAGAIN) return;
+    enum error_class ec=errno_class(errno);
+    count_error(conn, ec);
+    thread_log_error(conn->tdata, ec, "proxy CONNECT write failed: %d", errno);
+    tunnel_fail(conn);
+    return;
+  }
+  conn->write_pos+=n;
+  if (conn->write_pos<len) return;
+  conn->write_pos=0;
+  conn->read_pos=0;
+  conn_watch(conn, EV_READ);
+}
+
+static void tunnel_read(connection* conn) {
+  char* body;
+  ssize_t n=read(conn->fd, conn->buf+conn->read_pos, config.buf_size-conn->read_pos-1);
+  count_read(conn, n, config.buf_size-conn->read_pos-1);
+  if (n<=0) {
+    if (n<0 && errno==EAGAIN) return;
+    enum error_class ec=n? errno_class(errno) : EC_CLOSED;
+    count_error(conn, ec);
+    thread_log_error(conn->tdata, ec, "proxy CONNECT read failed: %d", n? errno : 0);
+    tunnel_fail(conn);
+    return;
+  }
+  conn->read_pos+=n;
+  if (!find_end_of_http_headers(conn->buf, conn->read_pos, &body)) {
+    if (conn->read_pos<config.buf_size-1) return;
+    count_error(conn, EC_HEADER_OVERFLOW);
+    thread_log_error(conn->tdata, EC_HEADER_OVERFLOW, "proxy CONNECT response headers too long");
+    tunnel_fail(conn);
+    return;
+  }
+  conn->buf[conn->read_pos]='\0';
+  int status=strncasecmp(conn->buf, "HTTP/1.", 7)? 0 : atoi(conn->buf+9);
+  if (status<200 || status>299) {
+    thread_log_error(conn->tdata, EC_OTHER, "proxy refused CONNECT to %s: status %d", conn->uri_host, status);
+    tunnel_fail(conn);
+    return;
+  }
+  conn->last_activity=ev_now(conn->loop);
+  hist_record(&conn->tdata->cur_stats->tunnel_latency, ev_time()-conn->connected);
+  conn->connected=conn->last_activity;
+  conn->read_pos=0;
+  PROBE(tunnel_done, conn, conn->tdata->id, body-conn->buf, conn->state, status);
+  conn->state=C_HANDSHAKING;
+  start_phase(conn, TO_TLS);
+  conn_watch(conn, EV_WRITE);
+  ev_feed_event(conn->loop, &conn->watch_write, EV_WRITE);
+}
+
 static void read_cb(struct ev_loop *loop, ev_io *w, int revents) {
   connection *conn=((connection*)(((char*)w)-offsetof(connection, watch_read)));
 
+  if (conn->state==C_TUNNELING) {
+    tunnel_read(conn);
+    return;
+  }
+
 #ifdef WITH_SSL
   if (conn->state==C_HANDSHAKING) {
     conn->last_activity=ev_now(loop);
     int ret=gnutls_handshake(conn->session);
     if (ret==GNUTLS_E_SUCCESS) {
       retrieve_ssl_session_info(conn);
+#ifdef HAVE_KTLS
+      if (config.ktls) ktls_enable(conn);
+#endif
+      tw_del(&conn->timer);
+      ev_tstamp tcp_connected=conn->connected;
+      conn->connected=ev_now(loop);
+      PROBE(handshake_done, conn, conn->tdata->id, 0, conn->state, conn->fd);
+      if (config.handshake) {
+        handshake_complete(conn, tcp_connected);
+        return;
+      }
       conn->state=C_WRITING;
-      ev_io_stop(conn->loop, &conn->watch_read);
-      ev_io_start(conn->loop, &conn->watch_write);
+      conn_watch(conn, EV_WRITE);
       return;
     }
     else if (ret==GNUTLS_E_AGAIN || !gnutls_error_is_fatal(ret)) {
-      if (ret!=GNUTLS_E_AGAIN) nxweb_log_error("gnutls handshake non-fatal error [%d] %s conn=%p", ret, gnutls_strerror(ret), conn);
+      if (ret!=GNUTLS_E_AGAIN) thread_log_error(conn->tdata, EC_TLS, "gnutls handshake non-fatal error [%d] %s conn=%p", ret, gnutls_strerror(ret), conn);
       if (gnutls_record_get_direction(conn->session)) {
-        ev_io_stop(conn->loop, &conn->watch_read);
-        ev_io_start(conn->loop, &conn->watch_write);
+        conn_watch(conn, EV_WRITE);
       }
       return;
     }
     else {
-      nxweb_log_error("gnutls handshake error [%d] %s conn=%p", ret, gnutls_strerror(ret), conn);
+      enum error_class ec=tls_error_class(ret);
+      count_error(conn, ec);
+      thread_log_error(conn->tdata, ec, "gnutls handshake error [%d] %s conn=%p", ret, gnutls_strerror(ret), conn);
       conn_close(conn, 0);
       inc_fail(conn);
       open_socket(conn);
@@ -628,10 +2290,11 @@ static void read_cb(struct ev_loop *loop, ev_io *w, int revents) {
   if (conn->state==C_READING_HEADERS) {
     int room_avail, bytes_received;
     do {
-      room_avail=sizeof(conn->buf)-conn->read_pos-1;
+      room_avail=config.buf_size-conn->read_pos-1;
       if (!room_avail) {
         // headers too long
-        nxweb_log_error("response headers too long");
+        count_error(conn, EC_HEADER_OVERFLOW);
+        thread_log_error(conn->tdata, EC_HEADER_OVERFLOW, "response headers too long");
         conn_close(conn, 0);
         inc_fail(conn);
         open_socket(conn);
@@ -641,25 +2304,71 @@ static void read_cb(struct ev_loop *loop, ev_io *w, int revents) {
       if (bytes_received<=0) {
         if (bytes_received==ERR_AGAIN) return;
         if (bytes_received==ERR_RDCLOSED) {
+          count_error(conn, EC_CLOSED);
           conn_close(conn, 0);
           inc_fail(conn);
           open_socket(conn);
           return;
         }
-        strerror_r(errno, conn->buf, sizeof(conn->buf));
-        nxweb_log_error("headers [%d] conn_read() returned %d error: %d %s", conn->alive_count, bytes_received, errno, conn->buf);
+        enum error_class ec=errno_class(errno);
+        count_error(conn, ec);
+        strerror_r(errno, conn->buf, config.buf_size);
+        thread_log_error(conn->tdata, ec, "headers [%d] conn_read() returned %d error: %d %s", conn->alive_count, bytes_received, errno, conn->buf);
         conn_close(conn, 0);
         inc_fail(conn);
         open_socket(conn);
         return;
       }
       conn->last_activity=ev_now(loop);
+      if (!conn->read_pos) conn->resp_start=conn->last_activity;
+      if (!conn->read_pos && conn->timer.next && conn->timeout_phase==TO_FIRST_BYTE) {
+        if (config.timeout[TO_TOTAL]>0) arm_timeout(conn, TO_TOTAL, conn->send_start+config.timeout[TO_TOTAL]);
+        else tw_del(&conn->timer);
+      }
       conn->read_pos+=bytes_received;
       //conn->buf[conn->read_pos]='\0';
+      if (conn->ws_open) {
+        int r=ws_response(conn);
+        if (r<0) {
+          conn_close(conn, 0);
+          inc_fail(conn);
+          open_socket(conn);
+        }
+        if (r) return;
+        continue;
+      }
       if (find_end_of_http_headers(conn->buf, conn->read_pos, &conn->body_ptr)) {
+        conn->headers_end=conn->last_activity;
         parse_headers(conn);
+        PROBE(headers_parsed, conn, conn->tdata->id, conn->body_ptr-conn->buf, conn->state, conn->status);
+        if (config.ws) {
+          // the upgrade counts as the connection's first request
+          if (conn->status!=101) {
+            thread_log_error(conn->tdata, EC_OTHER, "websocket upgrade refused: status %d", conn->status);
+            conn_close(conn, 0);
+            inc_fail(conn);
+            open_socket(conn);
+            return;
+          }
+          conn->ws_open=1;
+          conn->keep_alive=1;
+          conn->bytes_received=0;
+          rearm_socket(conn);
+          return;
+        }
+        if (plugin && plugin_headers(conn)) {
+          conn_close(conn, 0);
+          inc_fail(conn);
+          open_socket(conn);
+          return;
+        }
+        if (config.hold) {
+          hold_stream(conn);
+          return;
+        }
         if (conn->bytes_to_read<0 && !conn->chunked) {
-          nxweb_log_error("response length unknown");
+          count_error(conn, EC_OTHER);
+          thread_log_error(conn->tdata, EC_OTHER, "response length unknown");
           conn_close(conn, 0);
           inc_fail(conn);
           open_socket(conn);
@@ -681,7 +2390,8 @@ static void read_cb(struct ev_loop *loop, ev_io *w, int revents) {
         else {
           int r=decode_chunked_stream(&conn->cdstate, conn->body_ptr, &conn->bytes_received);
           if (r<0) {
-            nxweb_log_error("chunked encoding error");
+            count_error(conn, EC_CHUNK);
+            thread_log_error(conn->tdata, EC_CHUNK, "chunked encoding error");
             conn_close(conn, 0);
             inc_fail(conn);
             open_socket(conn);
@@ -702,25 +2412,39 @@ static void read_cb(struct ev_loop *loop, ev_io *w, int revents) {
 
   if (conn->state==C_READING_BODY) {
     int room_avail, bytes_received, bytes_received2, r;
+    char* buf=conn->tdata->read_buf;
     conn->last_activity=ev_now(loop);
+    if (conn->held) {
+      hold_read(conn);
+      return;
+    }
     do {
-      room_avail=sizeof(conn->buf);
+      room_avail=READ_BUF_SIZE;
       if (conn->bytes_to_read>0) {
         int bytes_left=conn->bytes_to_read - conn->bytes_received;
         if (bytes_left<room_avail) room_avail=bytes_left;
       }
-      bytes_received=conn_read(conn, conn->buf, room_avail);
+      bytes_received=conn_read(conn, buf, room_avail);
       if (bytes_received<=0) {
         if (bytes_received==ERR_AGAIN) return;
         if (bytes_received==ERR_RDCLOSED) {
-          nxweb_log_error("body [%d] read connection closed", conn->alive_count);
+          count_error(conn, EC_CLOSED);
+          thread_log_error(conn->tdata, EC_CLOSED, "body [%d] read connection closed", conn->alive_count);
           conn_close(conn, 0);
           inc_fail(conn);
           open_socket(conn);
           return;
         }
-        strerror_r(errno, conn->buf, sizeof(conn->buf));
-        nxweb_log_error("body [%d] conn_read() returned %d error: %d %s", conn->alive_count, bytes_received, errno, conn->buf);
+        enum error_class ec=errno_class(errno);
+        count_error(conn, ec);
+        strerror_r(errno, conn->buf, config.buf_size);
+        thread_log_error(conn->tdata, ec, "body [%d] conn_read() returned %d error: %d %s", conn->alive_count, bytes_received, errno, conn->buf);
+        conn_close(conn, 0);
+        inc_fail(conn);
+        open_socket(conn);
+        return;
+      }
+      if (plugin && plugin->on_body && plugin->on_body(conn->tdata->plugin_ctx, conn_index(conn), buf, bytes_received)<0) {
         conn_close(conn, 0);
         inc_fail(conn);
         open_socket(conn);
@@ -737,9 +2461,10 @@ static void read_cb(struct ev_loop *loop, ev_io *w, int revents) {
       }
       else {
         bytes_received2=bytes_received;
-        r=decode_chunked_stream(&conn->cdstate, conn->buf, &bytes_received2);
+        r=decode_chunked_stream(&conn->cdstate, buf, &bytes_received2);
         if (r<0) {
-          nxweb_log_error("chunked encoding error after %d bytes received", conn->bytes_received);
+          count_error(conn, EC_CHUNK);
+          thread_log_error(conn->tdata, EC_CHUNK, "chunked encoding error after %d bytes received", conn->bytes_received);
           conn_close(conn, 0);
           inc_fail(conn);
           open_socket(conn);
@@ -758,218 +2483,640 @@ static void read_cb(struct ev_loop *loop, ev_io *w, int revents) {
   }
 }
 
+// kills whatever is still in flight when the grace period ends
 static void shutdown_thread(thread_config* tdata) {
   int i;
   connection* conn;
-  ev_tstamp now=ev_now(tdata->loop);
-  ev_tstamp time_limit=tdata->avg_req_time*4;
-  //fprintf(stderr, "[%.6lf]", time_limit);
   for (i=0; i<tdata->num_conn; i++) {
     conn=&tdata->conns[i];
-    if (!conn->done) {
-      if (ev_is_active(&conn->watch_read) || ev_is_active(&conn->watch_write)) {
-        if ((now - conn->last_activity) > time_limit) {
-          // kill this connection
-          if (ev_is_active(&conn->watch_write)) ev_io_stop(conn->loop, &conn->watch_write);
-          if (ev_is_active(&conn->watch_read)) ev_io_stop(conn->loop, &conn->watch_read);
-          conn_close(conn, 0);
-          inc_fail(conn);
-          conn->done=1;
-          //fprintf(stderr, "*");
-        }
-        else {
-          // don't kill this yet, but wake it up
-          if (ev_is_active(&conn->watch_read)) {
-            ev_feed_event(tdata->loop, &conn->watch_read, EV_READ);
-          }
-          if (ev_is_active(&conn->watch_write)) {
-            ev_feed_event(tdata->loop, &conn->watch_write, EV_WRITE);
-          }
-          //fprintf(stderr, ".");
-        }
-      }
+    if (!conn->done && (conn->want || ev_is_active(&conn->watch_bw))) {
+      conn_watch(conn, 0);
+      conn_close(conn, 0);
+      inc_fail(conn);
+      conn->done=1;
     }
   }
 }
 
-static int more_requests_to_run() {
-  int rc;
-  int print_flag = 0; 
-  rc=__sync_add_and_fetch(&config.request_counter, 1);
-  static time_t previous_time = 0;
-  time_t elapsed_time;
-	/* Infinite Mode */
-  if (config.infinite==1) {  
-      return 1;
-      }
-	/* Time Mode */
-  else if(config.infinite==0){
-	current_time  = time(NULL);
-  	if(current_time < (config.run_time + start_time_rg)){
-		elapsed_time = current_time-previous_time;
-		if(elapsed_time > 4){
-			print_flag = 1;
-		        previous_time = current_time;
-		}
-		else{
-			print_flag = 0;
-		}
-	}
-	else{
-		
-		print_flag = 0;
-		return 0;
-	}
-  }
-	/*Requests Mode */
-  else if(config.infinite==2){
-	if (rc>config.num_requests) {
-            return 0;
-	}
-	else{ 
-	    if(config.progress_step>=10 && (rc%config.progress_step==0 || rc==config.num_requests)){
-		print_flag = 1;
-	    }
-	    else{
-		print_flag = 0;
-	    }
-	}
-  } 
+/*
+ * -n budget: threads take requests from config.request_counter in chunks
+ * that shrink as the budget runs out, so the per-request path touches only
+ * the thread's own quota. Once everything is granted, a thread out of work
+ * steals half of another thread's remaining quota, so none finishes late
+ * with a backlog while the others sit idle.
+ */
+#define QUOTA_CHUNK_MAX 1024
+
+static long grant_requests() {
+  int remaining=config.num_requests-config.request_counter;
+  if (remaining<=0) return 0;
+  int chunk=remaining/(config.num_threads*8);
+  if (chunk<1) chunk=1;
+  else if (chunk>QUOTA_CHUNK_MAX) chunk=QUOTA_CHUNK_MAX;
+  int start=__sync_fetch_and_add(&config.request_counter, chunk);
+  if (start>=config.num_requests) return 0;
+  if (start+chunk>config.num_requests) chunk=config.num_requests-start;
+  return chunk;
+}
 
-  if (!config.quiet && print_flag==1){
-    	if(config.infinite==0)
-		printf("%ld sec:  ",current_time-start_time_rg);
-	printf("%d requests launched\n", rc);
-	print_flag = 0;
+static long steal_requests(thread_config* tdata) {
+  thread_config** threads=worker_threads;
+  int i;
+  if (!threads) return 0;
+  for (i=1; i<config.num_threads; i++) {
+    thread_config* victim=threads[(tdata->id-1+i)%config.num_threads];
+    long q=victim->quota;
+    while (q>1) {
+      if (__sync_bool_compare_and_swap(&victim->quota, q, q-q/2)) return q/2;
+      q=victim->quota;
+    }
   }
-  return 1;
+  return 0;
 }
 
-static void heartbeat_cb(struct ev_loop *loop, ev_timer *w, int revents) {
-  if (
-	(config.request_counter>config.num_requests && config.infinite==2) || 
-	((current_time-start_time_rg) > config.run_time && config.infinite==0)) 
-  {
-    thread_config *tdata=((thread_config*)(((char*)w)-offsetof(thread_config, watch_heartbeat)));
-    if (!tdata->shutdown_in_progress) {
-      ev_tstamp now=ev_now(tdata->loop);
-      tdata->avg_req_time=tdata->num_success? (now-tdata->start_time) * tdata->num_conn / tdata->num_success : 0.1;
-      if (tdata->avg_req_time>1.) tdata->avg_req_time=1.;
-      tdata->shutdown_in_progress=1;
+static int take_request(thread_config* tdata) {
+  for (;;) {
+    long q=tdata->quota;
+    if (q>0) {
+      if (__sync_bool_compare_and_swap(&tdata->quota, q, q-1)) return 1;
+      continue; // lost to a thief
     }
-    shutdown_thread(tdata);
+    long n=grant_requests();
+    if (!n) n=steal_requests(tdata);
+    if (!n) return 0;
+    __sync_fetch_and_add(&tdata->quota, n);
   }
 }
 
-static void rearm_socket(connection* conn) {
-  if (ev_is_active(&conn->watch_write)) ev_io_stop(conn->loop, &conn->watch_write);
-  if (ev_is_active(&conn->watch_read)) ev_io_stop(conn->loop, &conn->watch_read);
+// no request left to start: not here, not granted, and nothing to steal
+static int requests_left(thread_config* tdata) {
+  thread_config** threads=worker_threads;
+  int i;
+  if (tdata->quota>0 || config.request_counter<config.num_requests) return 1;
+  for (i=0; threads && i<config.num_threads; i++) {
+    if (threads[i]->quota>1) return 1;
+  }
+  return 0;
+}
 
-  inc_success(conn);
+static int more_requests_to_run(thread_config* tdata) {
+  if (stop_requested) return 0;
+  /* Requests Mode */
+  if (config.infinite==2) return take_request(tdata);
+  /* Infinite Mode */
+  if (config.infinite==1) return 1;
+  /* Time Mode: the main thread stops the run when time is up */
+  __sync_add_and_fetch(&config.request_counter, 1);
+  return 1;
+}
 
-  if (!config.keep_alive || !conn->keep_alive) {
-    conn_close(conn, 1);
-    open_socket(conn);
+static void resume_paced(connection* conn) {
+  if (conn->paced_connect) {
+    conn->paced_connect=0;
+    connect_socket(conn);
   }
   else {
-if (!more_requests_to_run()) {
-      conn_close(conn, 1);
-      conn->done=1;
-      ev_feed_event(conn->tdata->loop, &conn->tdata->watch_heartbeat, EV_TIMER);
-      return;
-    }
-    conn->alive_count++;
-    conn->state=C_WRITING;
-    conn->write_pos=0;
-    ev_io_start(conn->loop, &conn->watch_write);
+    conn_watch(conn, EV_WRITE);
     ev_feed_event(conn->loop, &conn->watch_write, EV_WRITE);
   }
 }
 
-static int open_socket(connection* conn) {
+// returns 1 if the request may start now; otherwise queues the connection
+// until its slot in the open-loop schedule comes up (see pace_cb)
+static int pace_request(connection* conn) {
+  thread_config* tdata=conn->tdata;
+  conn->intended=0;
+  if (tdata->rate<=0) return 1;
+  ev_tstamp now=ev_now(conn->loop);
+  if (!tdata->paced_head && tdata->sched_next<=now) {
+    conn->intended=tdata->sched_next;
+    tdata->sched_next+=1./tdata->rate;
+    return 1;
+  }
+  conn->last_activity=now;
+  conn->paced_next=0;
+  if (tdata->paced_tail) tdata->paced_tail->paced_next=conn;
+  else tdata->paced_head=conn;
+  tdata->paced_tail=conn;
+  if (!ev_is_active(&tdata->watch_pace)) {
+    ev_timer_set(&tdata->watch_pace, tdata->sched_next>now? tdata->sched_next-now : 0., 0.);
+    ev_timer_start(tdata->loop, &tdata->watch_pace);
+  }
+  return 0;
+}
 
-  if (ev_is_active(&conn->watch_write)) ev_io_stop(conn->loop, &conn->watch_write);
-  if (ev_is_active(&conn->watch_read)) ev_io_stop(conn->loop, &conn->watch_read);
+// latency of paced requests counts from the scheduled start, not from when
+// a connection became free, so server stalls are not hidden by the client
+static void pace_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+  thread_config *tdata=((thread_config*)(((char*)w)-offsetof(thread_config, watch_pace)));
+  ev_tstamp now=ev_now(loop);
+  connection* conn;
+  while ((conn=tdata->paced_head) && (tdata->rate<=0 || tdata->sched_next<=now)) {
+    tdata->paced_head=conn->paced_next;
+    if (!tdata->paced_head) tdata->paced_tail=0;
+    if (tdata->rate>0) {
+      conn->intended=tdata->sched_next;
+      tdata->sched_next+=1./tdata->rate;
+    }
+    resume_paced(conn);
+  }
+  if (tdata->paced_head) {
+    ev_timer_set(w, tdata->sched_next-now, 0.);
+    ev_timer_start(loop, w);
+  }
+}
 
-  if (!more_requests_to_run(conn)) {
+// requests still waiting for their open-loop slot are abandoned at shutdown
+static void drop_paced(thread_config* tdata) {
+  connection* conn;
+  ev_timer_stop(tdata->loop, &tdata->watch_pace);
+  while ((conn=tdata->paced_head)) {
+    tdata->paced_head=conn->paced_next;
+    if (!conn->paced_connect) conn_close(conn, 1);
+    conn->paced_connect=0;
     conn->done=1;
-    ev_feed_event(conn->tdata->loop, &conn->tdata->watch_heartbeat, EV_TIMER);
-    return 1;
   }
+  tdata->paced_tail=0;
+}
+
+// this thread's part of a global connection target, proportional to its
+// share of the connection pool; parts across threads always add up
+static int thread_share(thread_config* tdata, int conns) {
+  return (long)conns*(tdata->conn_offset+tdata->num_conn)/config.num_connections
+        -(long)conns*tdata->conn_offset/config.num_connections;
+}
+
+static void set_thread_targets(thread_config* tdata, int conns, double rate) {
+  int j, old=tdata->active_target;
+  tdata->active_target=thread_share(tdata, conns);
+  // excess connections park themselves when their current request completes
+  for (j=old; j<tdata->active_target; j++) {
+    if (tdata->conns[j].parked) open_socket(&tdata->conns[j]);
+  }
+  rate=rate*tdata->num_conn/config.num_connections;
+  if (rate!=tdata->rate) {
+    if (tdata->rate<=0) tdata->sched_next=ev_now(tdata->loop);
+    tdata->rate=rate;
+    if (rate<=0 && tdata->paced_head) {
+      ev_timer_stop(tdata->loop, &tdata->watch_pace);
+      pace_cb(tdata->loop, &tdata->watch_pace, EV_TIMER);
+    }
+  }
+}
+
+static void profile_targets(ev_tstamp t, int* conns, double* rate) {
+  double c=config.profile_conns0, r=config.rate;
+  int i;
+  for (i=0; i<config.num_phases; i++) {
+    profile_phase* ph=&config.profile[i];
+    double* v=ph->unit=='r'? &r : &c;
+    if (ph->type==PH_RAMP) {
+      double start=ph->from>=0? ph->from : *v;
+      if (t<ph->duration) {
+        *v=start+(ph->to-start)*t/ph->duration;
+        break;
+      }
+      *v=ph->to;
+    }
+    else if (ph->type==PH_STEP) {
+      int n=floor(t/ph->every);
+      if (ph->from>=0) *v=ph->from;
+      if (ph->steps && n>ph->steps) n=ph->steps;
+      *v+=n*ph->step;
+      if (*v<0) *v=0;
+      if (t<ph->duration) break;
+    }
+    else if (t<ph->duration) break;
+    t-=ph->duration;
+  }
+  c*=config.scale;
+  *conns=c>config.num_connections? config.num_connections : c<0? 0 : (int)(c+0.5);
+  *rate=r>0? r*config.scale : 0;
+}
+
+static struct {
+  volatile int trial;
+  volatile double rate;
+} search_target;
+
+static void apply_search(thread_config* tdata) {
+  int trial=search_target.trial;
+  if (tdata->search_trial==trial) return;
+  tdata->search_trial=trial;
+  // backlog of an overloaded trial must not spill into the next one
+  ev_tstamp now=ev_now(tdata->loop);
+  if (tdata->sched_next<now) tdata->sched_next=now;
+  set_thread_targets(tdata, config.num_connections, search_target.rate);
+}
+
+static void apply_profile(thread_config* tdata, ev_tstamp elapsed) {
+  if (tdata->cur_stats!=&tdata->stats && elapsed>=config.warmup) tdata->cur_stats=&tdata->stats;
+  if (config.slo_spec) apply_search(tdata);
+  if (!config.num_phases) return;
+  int conns;
+  double rate;
+  profile_targets(elapsed, &conns, &rate);
+  set_thread_targets(tdata, conns, rate);
+}
+
+static void grace_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+  thread_config *tdata=((thread_config*)(((char*)w)-offsetof(thread_config, watch_grace)));
+  ev_ref(loop);
+  ev_timer_stop(loop, w);
+  shutdown_thread(tdata);
+}
+
+// stops taking new requests; requests in flight get a grace period (--grace,
+// by default four average request times up to 1s) before they are killed
+static void begin_shutdown(thread_config* tdata) {
+  struct ev_loop* loop=tdata->loop;
+  int i;
+  if (tdata->shutdown_in_progress) return;
+  ev_tstamp now=ev_now(loop);
+  tdata->avg_req_time=tdata->stats.num_success? (now-tdata->start_time) * tdata->num_conn / tdata->stats.num_success : 0.1;
+  if (tdata->avg_req_time>1.) tdata->avg_req_time=1.;
+  tdata->shutdown_in_progress=1;
+  ev_timer_stop(loop, &tdata->watch_connect);
+  drop_paced(tdata);
+  for (i=0; i<tdata->num_conn; i++) {
+    connection* conn=&tdata->conns[i];
+    if (!ev_is_active(&conn->watch_think)) continue;
+    ev_timer_stop(loop, &conn->watch_think);
+    if (!conn->think_closed) conn_close(conn, 1);
+    conn->done=1;
+  }
+  if (config.hold) {
+    // streams held to the end are not in flight
+    for (i=0; i<tdata->num_conn; i++) {
+      connection* conn=&tdata->conns[i];
+      if (!conn->held) continue;
+      conn_watch(conn, 0);
+      conn_close(conn, 1);
+      conn->held=0;
+      conn->done=1;
+    }
+  }
+  if (tdata->loop_ref) {
+    ev_unref(loop);
+    tdata->loop_ref=0;
+  }
+  ev_tstamp grace=config.grace>0? config.grace : tdata->avg_req_time*4;
+  if (grace<0.01) grace=0.01;
+  // repeating, as an unreferenced one-shot timer would unbalance the loop's refcount when it expires
+  ev_timer_init(&tdata->watch_grace, grace_cb, grace, grace);
+  ev_timer_start(loop, &tdata->watch_grace);
+  ev_unref(loop); // finishing in-flight requests ends the loop earlier
+}
+
+static void stop_cb(struct ev_loop *loop, ev_async *w, int revents) {
+  begin_shutdown((thread_config*)(((char*)w)-offsetof(thread_config, watch_stop)));
+}
+
+static void heartbeat_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+  thread_config *tdata=((thread_config*)(((char*)w)-offsetof(thread_config, watch_heartbeat)));
+  if (tdata->shutdown_in_progress) return;
+  apply_profile(tdata, ev_now(loop)-tdata->start_time);
+  // paced requests are within the request budget: let them run first
+  if ((config.infinite==2 && !requests_left(tdata) && !tdata->paced_head) || stop_requested) {
+    begin_shutdown(tdata);
+  }
+}
+
+// starts the connection's next request: on a new connection, or on this
+// one when it is kept alive
+static void next_request(connection* conn) {
+  if (!config.keep_alive || !conn->keep_alive) {
+    conn_close(conn, 1);
+    open_socket(conn);
+  }
+  else {
+    if (conn-conn->tdata->conns>=conn->tdata->active_target) {
+      conn_close(conn, 1);
+      conn->parked=1;
+      return;
+    }
+    if (conn->max_requests && conn->alive_count+1>=conn->max_requests) {
+      // client side churn: this connection has served its share
+      conn_close(conn, 1);
+      open_socket(conn);
+      return;
+    }
+    if (!more_requests_to_run(conn->tdata)) {
+      conn_close(conn, 1);
+      conn->done=1;
+      ev_feed_event(conn->tdata->loop, &conn->tdata->watch_heartbeat, EV_TIMER);
+      return;
+    }
+    conn->alive_count++;
+    conn->state=C_WRITING;
+    conn->write_pos=0;
+    if (!pace_request(conn)) return;
+    conn_watch(conn, EV_WRITE);
+    ev_feed_event(conn->loop, &conn->watch_write, EV_WRITE);
+  }
+}
+
+static void think_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+  connection *conn=((connection*)(((char*)w)-offsetof(connection, watch_think)));
+  if (conn->think_closed) open_socket(conn);
+  else next_request(conn);
+}
+
+// the next request follows after think time t; without keep-alive the
+// connection is closed meanwhile
+static void think_then_next(connection* conn, ev_tstamp t) {
+  if (t<=0) {
+    next_request(conn);
+    return;
+  }
+  conn->think_closed=!config.keep_alive || !conn->keep_alive;
+  if (conn->think_closed) conn_close(conn, 1);
+  ev_timer_set(&conn->watch_think, t, 0.);
+  ev_timer_start(conn->loop, &conn->watch_think);
+}
+
+// flow mode: the next step follows after think time; a finished flow is
+// recorded and the next one starts on a new connection, like a new user
+static void next_flow_step(connection* conn) {
+  run_stats* st=conn->tdata->cur_stats;
+  if (++conn->url_index>=conn->num_urls) {
+    hist_record(&st->flow_latency, ev_time()-conn->flow_start);
+    conn->url_index=0;
+    conn_close(conn, 1);
+    open_socket(conn);
+    return;
+  }
+  int think=config.url_think[conn->first_url+conn->url_index];
+  think_then_next(conn, draw_think(conn->tdata, think? &config.thinks[think-1] : &config.think));
+}
+
+static void rearm_socket(connection* conn) {
+  conn_watch(conn, 0);
+  tw_del(&conn->timer);
+  PROBE(request_done, conn, conn->tdata->id, conn->bytes_received, conn->state, conn->status);
+
+  if (plugin && plugin->on_complete && plugin->on_complete(conn->tdata->plugin_ctx, conn_index(conn), conn->status)) {
+    // rejected by the plugin; the connection itself is fine unless a flow has to start over
+    conn->fail_code=TE_REJECTED;
+    inc_fail(conn);
+    if (config.flow) {
+      conn_close(conn, 1);
+      open_socket(conn);
+    }
+    else next_request(conn);
+    return;
+  }
+  inc_success(conn);
+
+  if (config.flow) next_flow_step(conn);
+  else think_then_next(conn, draw_think(conn->tdata, &config.think));
+}
+
+static int open_socket(connection* conn) {
+
+  conn_watch(conn, 0);
+
+  if (conn-conn->tdata->conns>=conn->tdata->active_target) {
+    // above load profile target; apply_profile() reopens it
+    conn->parked=1;
+    return 1;
+  }
+  conn->parked=0;
+
+  if (!more_requests_to_run(conn->tdata)) {
+    conn->done=1;
+    ev_feed_event(conn->tdata->loop, &conn->tdata->watch_heartbeat, EV_TIMER);
+    return 1;
+  }
+
+  if (!pace_request(conn)) {
+    conn->paced_connect=1;
+    return 0;
+  }
+  PROBE(open, conn, conn->tdata->id, 0, conn->state, conn->alive_count);
+  return connect_socket(conn);
+}
 
+static int connect_socket(connection* conn) {
   inc_connect(conn);
+  if (conn->dropped) {
+    conn->tdata->cur_stats->num_reconnect++;
+    conn->dropped=0;
+  }
   
   //if sessions
 	//choose session and set config.saddr to session saddr
 	//if secure, set SSL stuff as well.
 
+  int connected=0;
+  conn->connect_start=ev_time();
   conn->fd=socket(conn->saddr->ai_family, conn->saddr->ai_socktype, conn->saddr->ai_protocol);
   if (conn->fd==-1) {
-    strerror_r(errno, conn->buf, sizeof(conn->buf));
-    nxweb_log_error("can't open socket [%d] %s", errno, conn->buf);
+    count_error(conn, EC_OTHER);
+    strerror_r(errno, conn->buf, config.buf_size);
+    thread_log_error(conn->tdata, EC_OTHER, "can't open socket [%d] %s", errno, conn->buf);
+    inc_connect_fail(conn);
     return -1;
   }
-  if (setup_socket(conn->fd)) {
-    nxweb_log_error("can't setup socket");
+  if (setup_socket(conn->fd, conn->saddr->ai_family)) {
+    count_error(conn, EC_OTHER);
+    thread_log_error(conn->tdata, EC_OTHER, "can't setup socket");
+    close(conn->fd);
+    inc_connect_fail(conn);
     return -1;
   }
-  if (has_fastopen) {
-    ssize_t ret=sendto(conn->fd, "", 0, MSG_FASTOPEN, conn->saddr->ai_addr, sizeof(struct sockaddr));
-	if (ret<0) {
-		if (errno!=EINPROGRESS && errno!=EALREADY && errno!=EISCONN) {
-		  nxweb_log_error("can't connect with fastopen%d", errno);
-		  return -1;
-		}
-	}
-  } else {
-	  if (connect(conn->fd, conn->saddr->ai_addr, conn->saddr->ai_addrlen)) {
-		if (errno!=EINPROGRESS && errno!=EALREADY && errno!=EISCONN) {
-		  nxweb_log_error("can't connect %d", errno);
-		  return -1;
-		}
-	  } 
+  int tfo=0;
+  conn->tfo_sent=0;
+#ifdef TCP_FASTOPEN_CONNECT
+  if (config.fastopen && conn->saddr->ai_family!=AF_UNIX) {
+    // with a cookie for the server connect() returns at once and the SYN
+    // waits for the first write; without, it sends a SYN asking for one
+    int on=1;
+    conn->tdata->cur_stats->io[IO_OTHER]++;
+    if (setsockopt(conn->fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on))) {
+      conn->tdata->cur_stats->num_tfo_fallback++;
+      thread_log_error(conn->tdata, EC_OTHER, "TCP_FASTOPEN_CONNECT failed: %d, connecting without", errno);
+    }
+    else tfo=1;
   }
+#endif
+  if (connect(conn->fd, conn->saddr->ai_addr, conn->saddr->ai_addrlen)) {
+    if (errno!=EINPROGRESS && errno!=EALREADY && errno!=EISCONN) {
+      count_error(conn, errno_class(errno));
+      thread_log_error(conn->tdata, errno_class(errno), "can't connect %d", errno);
+      close(conn->fd);
+      inc_connect_fail(conn);
+      return -1;
+    }
+    if (tfo) conn->tdata->cur_stats->num_tfo_no_cookie++;
+    tfo=0;
+  }
+  else connected=1;
+  conn->tfo=tfo;
+  // socket, fcntl x2, TCP_NODELAY, SO_RCVBUF, connect
+  conn->tdata->cur_stats->io[IO_OTHER]+=(conn->saddr->ai_family==AF_UNIX? 4 : 5+(config.rcvbuf>0));
+  if (config.client_bw_max>0) bw_start(conn);
 
 #ifdef WITH_SSL
   if (config.secure) {
     gnutls_init(&conn->session, GNUTLS_CLIENT);
-    gnutls_server_name_set(conn->session, GNUTLS_NAME_DNS, conn->uri_host, strlen(conn->uri_host));
-    gnutls_priority_set(conn->session, config.priority_cache);
+    const char* server_name=host_header(conn->uri_host);
+    gnutls_server_name_set(conn->session, GNUTLS_NAME_DNS, server_name, strlen(server_name));
+    gnutls_priority_set(conn->session, config.priority_cache[conn->tls_group]);
     gnutls_credentials_set(conn->session, GNUTLS_CRD_CERTIFICATE, config.ssl_cred);
-    gnutls_transport_set_ptr(conn->session, (gnutls_transport_ptr_t)(int_to_ptr)conn->fd);
+    gnutls_transport_set_ptr(conn->session, conn);
+    gnutls_transport_set_pull_function(conn->session, tls_pull);
+    gnutls_transport_set_pull_timeout_function(conn->session, tls_pull_timeout);
+    gnutls_transport_set_push_function(conn->session, tls_push);
   }
 #endif // WITH_SSL
 
   conn->state=C_CONNECTING;
   conn->write_pos=0;
   conn->alive_count=0;
+  conn->ws_open=0;
+  conn->held=0;
+  conn->ktls_tx=0;
+  conn->ktls_rx=0;
+  conn->max_requests=draw_conn_requests(conn->tdata);
   conn->done=0;
+  conn->ready=0;
+#ifdef HAVE_EPOLL
+  if (config.edge) {
+    // the only epoll_ctl() for this socket; closing it removes it
+    struct epoll_event ev={EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET, {.ptr=conn}};
+    conn->tdata->cur_stats->io[IO_CTL]++;
+    if (epoll_ctl(conn->tdata->epfd, EPOLL_CTL_ADD, conn->fd, &ev)) {
+      count_error(conn, EC_OTHER);
+      thread_log_error(conn->tdata, EC_OTHER, "can't add socket to epoll: %d", errno);
+      conn_close(conn, 0);
+      inc_connect_fail(conn);
+      return -1;
+    }
+  }
+#endif
   ev_io_set(&conn->watch_write, conn->fd, EV_WRITE);
   ev_io_set(&conn->watch_read, conn->fd, EV_READ);
-  ev_io_start(conn->loop, &conn->watch_write);
-  ev_feed_event(conn->loop, &conn->watch_write, EV_WRITE);
+  conn_watch(conn, EV_WRITE);
+  start_phase(conn, TO_CONNECT);
+  // otherwise EV_WRITE fires once the connection is established
+  if (connected) ev_feed_event(conn->loop, &conn->watch_write, EV_WRITE);
   return 0;
 }
 
+// opens this thread's connections, at most its share of --connect-rate
+// per second, so large pools don't hit the server with a SYN burst
+static void connect_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+  thread_config *tdata=((thread_config*)(((char*)w)-offsetof(thread_config, watch_connect)));
+  double rate=config.connect_rate*tdata->num_conn/config.num_connections;
+  int due=tdata->num_conn;
+  if (rate>0) {
+    double d=(ev_now(loop)-tdata->connect_start)*rate+1;
+    if (d<due) due=d;
+  }
+  while (tdata->connect_next<due) open_socket(&tdata->conns[tdata->connect_next++]);
+  if (tdata->connect_next<tdata->num_conn) {
+    ev_timer_set(w, 1./rate>0.001? 1./rate : 0.001, 0.);
+    ev_timer_start(loop, w);
+  }
+}
+
+// counts event loop iterations: each is one epoll_wait() (or other backend poll)
+static void check_cb(struct ev_loop *loop, ev_check *w, int revents) {
+  thread_config *tdata=((thread_config*)(((char*)w)-offsetof(thread_config, watch_check)));
+  tdata->cur_stats->io[IO_POLL]++;
+  tdata->poll_end=ev_now(loop); // updated right after the poll
+}
+
+// the loop is about to poll: the time since the last poll was spent working
+static void prepare_cb(struct ev_loop *loop, ev_prepare *w, int revents) {
+  thread_config *tdata=((thread_config*)(((char*)w)-offsetof(thread_config, watch_prepare)));
+  tdata->busy_time+=ev_time()-tdata->poll_end;
+}
+
+#ifdef HAVE_EPOLL
+// --edge: records what became ready; nothing is re-armed
+static void epoll_cb(struct ev_loop *loop, ev_io *w, int revents) {
+  thread_config *tdata=((thread_config*)(((char*)w)-offsetof(thread_config, watch_epoll)));
+  struct epoll_event events[EPOLL_BATCH];
+  int i, n=epoll_wait(tdata->epfd, events, EPOLL_BATCH, 0);
+  tdata->cur_stats->io[IO_POLL]++;
+  for (i=0; i<n; i++) {
+    connection* conn=events[i].data.ptr;
+    uint32_t e=events[i].events;
+    if (e&(EPOLLIN|EPOLLRDHUP|EPOLLHUP|EPOLLERR)) conn->ready|=EV_READ;
+    if (e&(EPOLLOUT|EPOLLHUP|EPOLLERR)) conn->ready|=EV_WRITE;
+    conn_recheck(conn);
+  }
+  // more than EPOLL_BATCH ready: epfd stays readable and libev calls again
+}
+
+// --edge: a callback that stopped before EAGAIN runs again, as it would
+// with level-triggered watchers
+static void edge_write_cb(struct ev_loop *loop, ev_io *w, int revents) {
+  write_cb(loop, w, revents);
+  conn_recheck((connection*)(((char*)w)-offsetof(connection, watch_write)));
+}
+
+static void edge_read_cb(struct ev_loop *loop, ev_io *w, int revents) {
+  read_cb(loop, w, revents);
+  conn_recheck((connection*)(((char*)w)-offsetof(connection, watch_read)));
+}
+#endif // HAVE_EPOLL
 
 static void* thread_main(void* pdata) {
   thread_config* tdata=(thread_config*)pdata;
+  int i;
 
   ev_timer_init(&tdata->watch_heartbeat, heartbeat_cb, 0.1, 0.1);
   ev_timer_start(tdata->loop, &tdata->watch_heartbeat);
-  ev_unref(tdata->loop); // don't keep loop running just for heartbeat
+  if (config.num_phases || config.slo_spec) tdata->loop_ref=1; // parked connections may come back
+  else ev_unref(tdata->loop); // don't keep loop running just for heartbeat
+  ev_async_init(&tdata->watch_stop, stop_cb);
+  ev_async_start(tdata->loop, &tdata->watch_stop);
+  ev_unref(tdata->loop);
+  ev_check_init(&tdata->watch_check, check_cb);
+  ev_check_start(tdata->loop, &tdata->watch_check);
+  ev_unref(tdata->loop);
+  ev_prepare_init(&tdata->watch_prepare, prepare_cb);
+  ev_prepare_start(tdata->loop, &tdata->watch_prepare);
+  ev_unref(tdata->loop);
+#ifdef HAVE_EPOLL
+  if (config.edge) {
+    ev_io_start(tdata->loop, &tdata->watch_epoll);
+    ev_unref(tdata->loop); // connections keep the loop alive, see conn_watch()
+  }
+#endif
+  ev_timer_init(&tdata->watch_connect, connect_cb, 0., 0.);
+  ev_now_update(tdata->loop);
+  tw_init(&tdata->wheel);
+  tdata->wheel_start=ev_now(tdata->loop);
+  if (config.timeouts_enabled) {
+    ev_timer_init(&tdata->watch_wheel, wheel_cb, TW_TICK, TW_TICK);
+    ev_timer_start(tdata->loop, &tdata->watch_wheel);
+    ev_unref(tdata->loop); // armed connections keep the loop alive by their own watchers
+  }
+  if (plugin && plugin->thread_init && plugin->thread_init(tdata->id, tdata->num_conn, config.plugin_arg, &tdata->plugin_ctx))
+    nxweb_die("plugin initialization failed in thread %d", tdata->id);
+  tdata->connect_start=ev_now(tdata->loop);
+  tdata->poll_end=ev_time();
+  connect_cb(tdata->loop, &tdata->watch_connect, EV_TIMER);
   ev_run(tdata->loop, 0);
+  tdata->end_time=ev_time();
+  tdata->busy_time+=tdata->end_time-tdata->poll_end;
+  for (i=0; i<EC_MAX; i++) log_summarize(tdata, i);
   stop_cpu_stats=1;
-
-  ev_loop_destroy(tdata->loop);
+  if (plugin && plugin->thread_done) plugin->thread_done(tdata->plugin_ctx);
+  // the loop is destroyed by free_threads(): stop_threads() may still signal it
 
   if (!config.quiet && config.num_threads>1) {
-    printf("thread %d: %d connect, %d requests, %d success, %d fail, %ld bytes, %ld overhead\n",
-         tdata->id, tdata->num_connect, tdata->num_success+tdata->num_fail,
-         tdata->num_success, tdata->num_fail, tdata->num_bytes_received,
-         tdata->num_overhead_received);
+    printf("thread %d: %ld connect, %ld requests, %ld success, %ld fail, %ld bytes, %ld overhead, %.0f%% busy\n",
+         tdata->id, tdata->stats.num_connect, tdata->stats.num_success+tdata->stats.num_fail,
+         tdata->stats.num_success, tdata->stats.num_fail, tdata->stats.num_bytes_received,
+         tdata->stats.num_overhead_received, 100*tdata->busy_time/(tdata->end_time-tdata->start_time));
   }
 
+  __sync_sub_and_fetch(&threads_running, 1);
   return 0;
 }
 
@@ -1000,7 +3147,6 @@ static void *cpu_stat_thread(void *pdata) {
     FILE *fp;
 	long double max,min;
 	cpu_info_t *data=(cpu_info_t *)pdata;
-	stop_cpu_stats=0;
 	
     sleep(1);
 	loadavg=get_cpu_load();
@@ -1030,7 +3176,7 @@ static void *cpu_stat_thread(void *pdata) {
     }
 	data->max=	max*100.0;
 	data->min=	min*100.0;
-	data->avg=	total*100.0 / count;
+	data->avg=	count? total*100.0 / count : 0.0;
 	
 	if (max > .95) 
 		printf("Warning! Detected max cpu usage > 95%%\n");
@@ -1038,7 +3184,38 @@ static void *cpu_stat_thread(void *pdata) {
     return data;
 }
 
+// getaddrinfo() doesn't do AF_UNIX; the entry and its address are one
+// block of our own, released by free_host()
+static int resolve_unix(struct addrinfo** saddr, const char* path) {
+  struct {
+    struct addrinfo ai;
+    struct sockaddr_un sun;
+  } *r;
+  if (!*path || strlen(path)>=sizeof(r->sun.sun_path)) return -1;
+  r=calloc(1, sizeof(*r));
+  if (!r) return -1;
+  r->sun.sun_family=AF_UNIX;
+  strcpy(r->sun.sun_path, path);
+  r->ai.ai_family=AF_UNIX;
+  r->ai.ai_socktype=SOCK_STREAM;
+  r->ai.ai_addr=(struct sockaddr*)&r->sun;
+  r->ai.ai_addrlen=sizeof(r->sun);
+  *saddr=&r->ai;
+  return 0;
+}
+
+// releases what resolve_host() returned: resolve_host() keeps only an AF_INET
+// entry from getaddrinfo(), so AF_UNIX ones are always from resolve_unix()
+static void free_host(struct addrinfo* saddr) {
+  if (!saddr) return;
+  if (saddr->ai_family==AF_UNIX) free(saddr);
+  else freeaddrinfo(saddr);
+}
+
+// host is "name[:port]" or "unix:/path/to.sock"
 static int resolve_host(struct addrinfo** saddr, const char *host_and_port) {
+  if (!strncmp(host_and_port, "unix:", 5)) return resolve_unix(saddr, host_and_port+5);
+
   char* host=strdup(host_and_port);
   char* port=strchr(host, ':');
   if (port) *port++='\0';
@@ -1089,8 +3266,53 @@ static void show_help(void) {
           "  -k       keep alive             (default: no)\n"
           "  -i        run forever           (default: no)\n"
           "  -q       no progress indication (default: no)\n"
-          "  -z pri   GNUTLS cipher priority (default: NORMAL)\n"
+          "  -z pri   GNUTLS cipher priority (default: NORMAL); repeat to split connections into groups\n"
           "  -r       Run for time in seconds(default: 120 seconds)\n"
+          "  -A port  run as agent, accept workloads on control port\n"
+          "  -D list  distribute workload to agents host:port[,host:port...]\n"
+          "  --agent-bind addr  address the agent listens on (default: 127.0.0.1)\n"
+          "  --agent-secret s   shared secret of agent and coordinator (default: $HTTPRESS_AGENT_SECRET)\n"
+          "  --profile spec  load phases, e.g. \"ramp 10-200c/30s, hold 60s, step 500-2000r/250r/10s\"\n"
+          "  --rate N         open-loop request rate, requests/second (default: closed loop)\n"
+          "  --warmup dur     exclude first dur of the run from results (default: 0)\n"
+          "  --slo spec       search max rate meeting SLO, e.g. \"p99<50ms,err<1%%\"\n"
+          "  --search min-max request rate range for SLO search (default: 100-unbounded)\n"
+          "  --trial dur      duration of each SLO search trial (default: 10s)\n"
+          "  --connect-rate N open at most N new connections per second at start (default: no limit)\n"
+          "  --connect-timeout dur, --tls-timeout dur, --first-byte-timeout dur, --timeout dur\n"
+          "                   fail and reconnect when a phase or whole request takes longer (default: none)\n"
+          "  --grace dur      time for requests in flight to finish at the end (default: 4 avg req times, max 1s)\n"
+          "  --max-requests-per-conn N|min-max|exp:mean  requests per keep-alive connection (default: unlimited)\n"
+          "  --new-conn-ratio p  share of requests opening a new connection, same as exp:1/p\n"
+          "  --top N          rows in per-URL tables in session mode, 0 to disable (default: 10)\n"
+          "  --flow           walk each session's URLs in order, like a user (needs -f)\n"
+          "  --think dist     think time between requests on a connection (flow steps with --flow):\n"
+          "                   1s, 500ms-2s or exp:1s (default: 0)\n"
+          "  --plugin lib.so  build requests and check responses with a plugin, see httpress_plugin.h\n"
+          "  --plugin-arg str argument passed to the plugin's thread_init()\n"
+          "  --iterations N   repeat the run N times and report means with confidence intervals\n"
+          "  --save file      save per-iteration results for later --baseline comparisons\n"
+          "  --baseline file  compare with saved results, exit with 2 on significant regression\n"
+          "  --max-regression pct  tolerated significant regression (default: 5%%)\n"
+          "  --trace file     write a binary record per request (all unless sampled)\n"
+          "  --trace-sample N trace every Nth request\n"
+          "  --trace-slow dur trace requests taking at least dur; failures are always traced\n"
+          "  --trace-decode file  print a trace file as CSV and exit\n"
+          "  --ws             WebSocket: upgrade each connection, then send messages and time the echo\n"
+          "  --ws-size N      message payload size in bytes (default: 64)\n"
+          "  --hold           hold streaming responses (SSE, long poll) open, count events (needs -r or -i)\n"
+          "  --reconnect-delay dur  with --hold, wait before replacing a dropped stream (default: 0)\n"
+          "  --ktls           hand TLS records to the kernel after the handshake, if it can\n"
+          "  --handshake      TLS handshakes only: connect, handshake, close, repeat; no HTTP\n"
+          "  --close-notify   with --handshake, send close_notify before closing\n"
+          "  --proxy host:port  send requests through a forward proxy; https uses CONNECT tunnels\n"
+          "  --edge           register each socket once with edge-triggered epoll instead of\n"
+          "                   changing watchers per request\n"
+          "  --fastopen       TCP Fast Open: the request (or TLS ClientHello) goes out with the SYN\n"
+          "  --client-bw rate emulate slow clients: per-connection read and write limit, e.g. 256kbit,\n"
+          "                   2mbit, 64kB, or a range drawn per connection: 128kbit-1mbit\n"
+          "  --rcvbuf N       SO_RCVBUF for client sockets in bytes (default: kernel autotuning)\n"
+          "  --buf-size N     per-connection buffer for response headers (default: 32768, 2048 with --hold)\n"
           "  -h       show this help\n"
           //"  -v       show version\n"
           "\n"
@@ -1099,17 +3321,52 @@ static void show_help(void) {
 
 static char host_buf[1024];
 
+// request target prefix: plain http through a forward proxy uses absolute URIs
+static const char* proxy_origin(const char* host) {
+  static char buf[sizeof(host_buf)+8];
+  if (!config.proxy || config.secure) return "";
+  snprintf(buf, sizeof(buf), "http://%s", host);
+  return buf;
+}
+
+// connections go to the proxy instead of the target host
+static int resolve_target(struct addrinfo** saddr, const char* host) {
+  if (!config.proxy) return resolve_host(saddr, host);
+  if (!strncmp(host, "unix:", 5)) {
+    nxweb_log_error("--proxy can't be used with Unix socket URLs");
+    return -1;
+  }
+  return resolve_host(saddr, config.proxy);
+}
+
+// http+unix:///run/app.sock:/index.html targets a Unix socket;
+// its host becomes "unix:/run/app.sock"
 static int parse_uri_to(const char* uri, const char **host, const char **path) {
+  int unix_socket=0;
   if (!strncmp(uri, "http://", 7)) uri+=7;
+  else if (!strncmp(uri, "http+unix://", 12)) { uri+=12; unix_socket=1; }
 #ifdef WITH_SSL
   else if (!strncmp(uri, "https://", 8)) { uri+=8; config.secure=1; }
+  else if (!strncmp(uri, "https+unix://", 13)) { uri+=13; config.secure=1; unix_socket=1; }
 #endif
   else return -1;
 
+  if (unix_socket) {
+    const char* p=strstr(uri, ":/");
+    int len=p? p-uri : strlen(uri);
+    if (!len || len+6>sizeof(host_buf)) return -1;
+    memcpy(host_buf, "unix:", 5);
+    memcpy(host_buf+5, uri, len);
+    host_buf[len+5]='\0';
+    *host=host_buf;
+    *path=p? p+1 : "/";
+    return 0;
+  }
+
   const char* p=strchr(uri, '/');
   if (!p) {
-    config.uri_host=uri;
-    config.uri_path="/";
+    *host=uri;
+    *path="/";
     return 0;
   }
   if ((p-uri)>sizeof(host_buf)-1) return -1;
@@ -1124,9 +3381,268 @@ static int parse_uri(const char* uri) {
 	return parse_uri_to(uri, &config.uri_host, &config.uri_path);
 }
 
+// parses "30s", "5m", "1h", "250ms"; bare numbers are seconds
+static const char* parse_duration(const char* s, double* value) {
+  char* end;
+  double v=strtod(s, &end);
+  if (end==s || v<0) return 0;
+  if (!strncmp(end, "ms", 2)) { v/=1000.; end+=2; }
+  else if (*end=='s') end++;
+  else if (*end=='m') { v*=60.; end++; }
+  else if (*end=='h') { v*=3600.; end++; }
+  *value=v;
+  return end;
+}
 
+static inline const char* skip_spaces(const char* p) {
+  while (*p==' ' || *p=='\t') p++;
+  return p;
+}
 
-int main(int argc, char* argv[]) {
+static int parse_profile_phase(const char* p, profile_phase* ph) {
+  char* end;
+  memset(ph, 0, sizeof(*ph));
+  ph->unit='c';
+  ph->from=-1;
+  ph->duration=HUGE_VAL;
+  p=skip_spaces(p);
+  if (!strncmp(p, "ramp", 4)) {
+    ph->type=PH_RAMP;
+    p=skip_spaces(p+4);
+    ph->to=strtod(p, &end);
+    if (end==p) return -1;
+    p=end;
+    if (*p=='-') {
+      ph->from=ph->to;
+      ph->to=strtod(++p, &end);
+      if (end==p) return -1;
+      p=end;
+    }
+    if (*p!='c' && *p!='r') return -1;
+    ph->unit=*p++;
+    if (*p!='/' || !(p=parse_duration(p+1, &ph->duration)) || ph->duration<=0) return -1;
+  }
+  else if (!strncmp(p, "hold", 4)) {
+    ph->type=PH_HOLD;
+    p=skip_spaces(p+4);
+    if (*p && !(p=parse_duration(p, &ph->duration))) return -1;
+  }
+  else if (!strncmp(p, "step", 4)) {
+    ph->type=PH_STEP;
+    p=skip_spaces(p+4);
+    ph->step=strtod(p, &end);
+    if (end==p) return -1;
+    p=end;
+    if (*p=='-') {
+      // A-B<u>/S<u>/DUR: levels A, A+S, ... up to B
+      double by;
+      ph->from=ph->step;
+      ph->to=strtod(++p, &end);
+      if (end==p) return -1;
+      p=end;
+      if (*p!='c' && *p!='r') return -1;
+      ph->unit=*p++;
+      if (*p++!='/') return -1;
+      by=strtod(p, &end);
+      if (end==p || by<=0) return -1;
+      p=end;
+      if (*p==ph->unit) p++;
+      if (*p!='/' || !(p=parse_duration(p+1, &ph->every)) || ph->every<=0) return -1;
+      ph->step=ph->to>=ph->from? by : -by;
+      ph->steps=floor(fabs(ph->to-ph->from)/by+1e-9);
+      ph->duration=(ph->steps+1)*ph->every;
+      return *skip_spaces(p)? -1 : 0;
+    }
+    if (*p!='c' && *p!='r') return -1;
+    ph->unit=*p++;
+    p=skip_spaces(p);
+    if (strncmp(p, "every", 5)) return -1;
+    if (!(p=parse_duration(skip_spaces(p+5), &ph->every)) || ph->every<=0) return -1;
+    p=skip_spaces(p);
+    if (*p=='x') {
+      ph->steps=strtol(p+1, &end, 10);
+      if (end==p+1 || ph->steps<=0) return -1;
+      p=end;
+      ph->duration=ph->steps*ph->every;
+    }
+  }
+  else return -1;
+  return *skip_spaces(p)? -1 : 0;
+}
+
+// returns total profile duration, HUGE_VAL if open-ended, or -1 on error
+static double parse_profile(const char* spec) {
+  char* copy=strdup(spec);
+  char* saveptr;
+  char* item;
+  double total=0;
+  config.num_phases=0;
+  for (item=strtok_r(copy, ",", &saveptr); item; item=strtok_r(0, ",", &saveptr)) {
+    if (total==HUGE_VAL || config.num_phases==MAX_PHASES) { total=-1; break; } // open-ended phase must be last
+    profile_phase* ph=&config.profile[config.num_phases++];
+    if (parse_profile_phase(item, ph)) { total=-1; break; }
+    total+=ph->duration;
+  }
+  free(copy);
+  return config.num_phases? total : -1;
+}
+
+// parses "256kbit", "2mbit", "64kB" or plain bytes, optionally per "/s";
+// returns bytes per second
+static const char* parse_bandwidth(const char* s, double* value) {
+  static const struct {const char* unit; double scale;} units[]={
+    {"kbit", 1e3/8}, {"Kbit", 1e3/8}, {"mbit", 1e6/8}, {"Mbit", 1e6/8}, {"gbit", 1e9/8}, {"Gbit", 1e9/8},
+    {"bit", 1./8}, {"kB", 1e3}, {"KB", 1e3}, {"MB", 1e6}, {"GB", 1e9}, {"B", 1}
+  };
+  char* end;
+  double v=strtod(s, &end);
+  int i;
+  if (end==s || v<=0) return 0;
+  for (i=0; i<(int)(sizeof(units)/sizeof(units[0])); i++) {
+    int len=strlen(units[i].unit);
+    if (!strncmp(end, units[i].unit, len)) {
+      v*=units[i].scale;
+      end+=len;
+      break;
+    }
+  }
+  if (!strncmp(end, "/s", 2)) end+=2;
+  *value=v;
+  return end;
+}
+
+// parses "200ms" (constant), "100ms-500ms" (uniform) or "exp:300ms"
+static int parse_think(const char* spec, think_dist* d) {
+  const char* p=skip_spaces(spec);
+  d->type=TH_CONST;
+  if (!strncmp(p, "exp:", 4)) {
+    d->type=TH_EXP;
+    p+=4;
+  }
+  if (!(p=parse_duration(p, &d->a))) return -1;
+  if (*p=='-' && d->type==TH_CONST) {
+    d->type=TH_UNIFORM;
+    if (!(p=parse_duration(p+1, &d->b)) || d->b<d->a) return -1;
+  }
+  return *skip_spaces(p)? -1 : 0;
+}
+
+// parses "N", "min-max" or "exp:mean"
+static int parse_conn_requests(const char* spec, conn_requests_dist* d) {
+  char* end;
+  if (!strncmp(spec, "exp:", 4)) {
+    d->type=CR_GEOMETRIC;
+    d->a=strtod(spec+4, &end);
+    return end==spec+4 || *end || d->a<1? -1 : 0;
+  }
+  d->a=strtol(spec, &end, 10);
+  if (end==spec || d->a<1) return -1;
+  if (!*end) {
+    d->type=CR_FIXED;
+    return 0;
+  }
+  if (*end!='-') return -1;
+  d->type=CR_UNIFORM;
+  spec=end+1;
+  d->b=strtol(spec, &end, 10);
+  return end==spec || *end || d->b<d->a? -1 : 0;
+}
+
+// parses "p99<50ms,p50<5ms,err<1%"
+static int parse_slo(const char* spec) {
+  char* copy=strdup(spec);
+  char* saveptr;
+  char* item;
+  char* end;
+  int rc=0;
+  config.num_slo=0;
+  config.slo_errors=0.01;
+  for (item=strtok_r(copy, ",", &saveptr); item; item=strtok_r(0, ",", &saveptr)) {
+    const char* p=skip_spaces(item);
+    if (*p=='p') {
+      if (config.num_slo==MAX_SLO) { rc=-1; break; }
+      slo_limit* l=&config.slo[config.num_slo++];
+      l->pct=strtod(p+1, &end);
+      if (end==p+1 || l->pct<=0 || l->pct>=100) { rc=-1; break; }
+      p=skip_spaces(end);
+      if (*p!='<' || !(p=parse_duration(skip_spaces(p+1), &l->limit)) || l->limit<=0) { rc=-1; break; }
+    }
+    else if (!strncmp(p, "err", 3)) {
+      p=strchr(p, '<');
+      if (!p) { rc=-1; break; }
+      config.slo_errors=strtod(p+1, &end)/100.;
+      if (end==p+1 || *end!='%' || config.slo_errors<0) { rc=-1; break; }
+      p=end+1;
+    }
+    else { rc=-1; break; }
+    if (*skip_spaces(p)) { rc=-1; break; }
+  }
+  free(copy);
+  return rc? rc : config.num_slo? 0 : -1;
+}
+
+enum {OPT_PROFILE=256, OPT_WARMUP, OPT_RATE, OPT_SCALE, OPT_PROFILE_BASE, OPT_SLO, OPT_SEARCH, OPT_TRIAL,
+      OPT_CONNECT_RATE, OPT_TIMEOUT, OPT_TIMEOUT_END=OPT_TIMEOUT+TO_MAX-1, OPT_GRACE,
+      OPT_MAX_CONN_REQUESTS, OPT_NEW_CONN_RATIO, OPT_TOP, OPT_FLOW, OPT_THINK,
+      OPT_PLUGIN, OPT_PLUGIN_ARG, OPT_ITERATIONS, OPT_SAVE, OPT_BASELINE, OPT_MAX_REGRESSION,
+      OPT_TRACE, OPT_TRACE_SAMPLE, OPT_TRACE_SLOW, OPT_TRACE_DECODE,
+      OPT_WS, OPT_WS_SIZE, OPT_HOLD, OPT_BUF_SIZE, OPT_RECONNECT_DELAY, OPT_KTLS, OPT_HANDSHAKE, OPT_CLOSE_NOTIFY, OPT_PROXY,
+      OPT_EDGE, OPT_FASTOPEN, OPT_CLIENT_BW, OPT_RCVBUF, OPT_AGENT_BIND, OPT_AGENT_SECRET};
+
+#define SHORT_OPTIONS ":hvkqin:r:f:t:c:z:A:D:"
+
+
+static struct option long_options[]={
+  {"profile", required_argument, 0, OPT_PROFILE},
+  {"warmup", required_argument, 0, OPT_WARMUP},
+  {"rate", required_argument, 0, OPT_RATE},
+  {"scale", required_argument, 0, OPT_SCALE},
+  {"profile-base", required_argument, 0, OPT_PROFILE_BASE},
+  {"slo", required_argument, 0, OPT_SLO},
+  {"search", required_argument, 0, OPT_SEARCH},
+  {"trial", required_argument, 0, OPT_TRIAL},
+  {"connect-rate", required_argument, 0, OPT_CONNECT_RATE},
+  {"connect-timeout", required_argument, 0, OPT_TIMEOUT+TO_CONNECT},
+  {"tls-timeout", required_argument, 0, OPT_TIMEOUT+TO_TLS},
+  {"first-byte-timeout", required_argument, 0, OPT_TIMEOUT+TO_FIRST_BYTE},
+  {"timeout", required_argument, 0, OPT_TIMEOUT+TO_TOTAL},
+  {"grace", required_argument, 0, OPT_GRACE},
+  {"max-requests-per-conn", required_argument, 0, OPT_MAX_CONN_REQUESTS},
+  {"new-conn-ratio", required_argument, 0, OPT_NEW_CONN_RATIO},
+  {"top", required_argument, 0, OPT_TOP},
+  {"flow", no_argument, 0, OPT_FLOW},
+  {"think", required_argument, 0, OPT_THINK},
+  {"plugin", required_argument, 0, OPT_PLUGIN},
+  {"plugin-arg", required_argument, 0, OPT_PLUGIN_ARG},
+  {"iterations", required_argument, 0, OPT_ITERATIONS},
+  {"save", required_argument, 0, OPT_SAVE},
+  {"baseline", required_argument, 0, OPT_BASELINE},
+  {"max-regression", required_argument, 0, OPT_MAX_REGRESSION},
+  {"trace", required_argument, 0, OPT_TRACE},
+  {"trace-sample", required_argument, 0, OPT_TRACE_SAMPLE},
+  {"trace-slow", required_argument, 0, OPT_TRACE_SLOW},
+  {"trace-decode", required_argument, 0, OPT_TRACE_DECODE},
+  {"ws", no_argument, 0, OPT_WS},
+  {"ws-size", required_argument, 0, OPT_WS_SIZE},
+  {"hold", no_argument, 0, OPT_HOLD},
+  {"buf-size", required_argument, 0, OPT_BUF_SIZE},
+  {"reconnect-delay", required_argument, 0, OPT_RECONNECT_DELAY},
+  {"ktls", no_argument, 0, OPT_KTLS},
+  {"handshake", no_argument, 0, OPT_HANDSHAKE},
+  {"close-notify", no_argument, 0, OPT_CLOSE_NOTIFY},
+  {"proxy", required_argument, 0, OPT_PROXY},
+  {"edge", no_argument, 0, OPT_EDGE},
+  {"fastopen", no_argument, 0, OPT_FASTOPEN},
+  {"client-bw", required_argument, 0, OPT_CLIENT_BW},
+  {"rcvbuf", required_argument, 0, OPT_RCVBUF},
+  {"agent-bind", required_argument, 0, OPT_AGENT_BIND},
+  {"agent-secret", required_argument, 0, OPT_AGENT_SECRET},
+  {0, 0, 0, 0}
+};
+
+// returns 0 to proceed, 1 to exit successfully (help/version), -1 on error
+static int parse_args(int argc, char* argv[]) {
+  memset(&config, 0, sizeof(config));
   config.num_connections=1;
   config.num_requests=1;
   config.num_threads=1;
@@ -1136,21 +3652,26 @@ int main(int argc, char* argv[]) {
   config.uri_host=0;
   config.request_counter=0;
   config.infinite=2;
-  config.ssl_cipher_priority="NORMAL"; // NORMAL:-CIPHER-ALL:+AES-256-CBC:-VERS-TLS-ALL:+VERS-TLS1.0:-KX-ALL:+DHE-RSA
   config.run_time=120;
-  
-  start_time_rg = time(NULL);
+  config.scale=1.;
+  config.search_min=100;
+  config.trial_time=10;
+  config.top_urls=10;
+  config.iterations=1;
+  config.max_regression=5;
+  config.ws_size=64;
+
   int c;
-  char *session_file=NULL;
-  while ((c=getopt(argc, argv, ":hvkqin:r:f:t:c:z:"))!=-1) {
+  int requests_given=0;
+  while ((c=getopt_long(argc, argv, SHORT_OPTIONS, long_options, 0))!=-1) {
     switch (c) {
       case 'h':
         show_help();
-        return 0;
+        return 1;
       case 'v':
         printf("version:    " VERSION "\n");
         printf("build-date: " __DATE__ " " __TIME__ "\n\n");
-        return 0;
+        return 1;
       case 'k':
         config.keep_alive=1;
         break;
@@ -1159,6 +3680,7 @@ int main(int argc, char* argv[]) {
         break;
       case 'n':
         config.num_requests=atoi(optarg);
+        requests_given=1;
         break;
       case 't':
         config.num_threads=atoi(optarg);
@@ -1167,10 +3689,12 @@ int main(int argc, char* argv[]) {
         config.num_connections=atoi(optarg);
         break;
       case 'z':
-        config.ssl_cipher_priority=optarg;
+        // each -z adds a connection group, e.g. NORMAL:-KX-ALL:+ECDHE-RSA
+        if (config.num_priorities==MAX_PRIORITIES) nxweb_die("too many priority strings, max %d", MAX_PRIORITIES);
+        config.ssl_cipher_priority[config.num_priorities++]=optarg;
         break;
 	  case 'f':
-	    session_file=optarg;
+	    config.session_file=optarg;
 		break;
 	  case 'i':
 		config.infinite=1;
@@ -1181,40 +3705,309 @@ int main(int argc, char* argv[]) {
                                    config.infinite = 1 means infinite enabled and run_time disabled.
                                    config.infinite = 2 means run_time is disabled and requests mode is enabled */
         break;
+      case 'A':
+        config.agent_port=atoi(optarg);
+        break;
+      case 'D':
+        config.agents=optarg;
+        break;
+      case OPT_AGENT_BIND:
+        config.agent_bind=optarg;
+        break;
+      case OPT_AGENT_SECRET:
+        config.agent_secret=optarg;
+        break;
+      case OPT_PROFILE:
+        config.profile_spec=optarg;
+        break;
+      case OPT_WARMUP:
+        if (!parse_duration(optarg, &config.warmup)) nxweb_die("can't parse warm-up duration: %s", optarg);
+        break;
+      case OPT_RATE:
+        config.rate=atof(optarg);
+        if (config.rate<0) nxweb_die("wrong request rate");
+        break;
+      case OPT_SCALE:
+        config.scale=atof(optarg);
+        if (config.scale<=0 || config.scale>1) nxweb_die("wrong scale");
+        break;
+      case OPT_PROFILE_BASE:
+        config.profile_base=atoi(optarg);
+        if (config.profile_base<1) nxweb_die("wrong profile base");
+        break;
+      case OPT_SLO:
+        config.slo_spec=optarg;
+        if (parse_slo(optarg)) nxweb_die("can't parse SLO: %s", optarg);
+        break;
+      case OPT_SEARCH: {
+        char* end;
+        config.search_min=strtod(optarg, &end);
+        config.search_max=*end=='-'? atof(end+1) : 0;
+        if (config.search_min<=0 || (config.search_max && config.search_max<config.search_min))
+          nxweb_die("wrong search range: %s", optarg);
+        break;
+      }
+      case OPT_CONNECT_RATE: {
+        char* end;
+        config.connect_rate=strtod(optarg, &end); // "N" or "N/s"
+        if (config.connect_rate<=0 || (*end && strcmp(end, "/s"))) nxweb_die("wrong connect rate: %s", optarg);
+        break;
+      }
+      case OPT_TIMEOUT+TO_CONNECT:
+      case OPT_TIMEOUT+TO_TLS:
+      case OPT_TIMEOUT+TO_FIRST_BYTE:
+      case OPT_TIMEOUT+TO_TOTAL:
+        if (!parse_duration(optarg, &config.timeout[c-OPT_TIMEOUT]) || config.timeout[c-OPT_TIMEOUT]<TW_TICK)
+          nxweb_die("wrong timeout: %s", optarg);
+        config.timeouts_enabled=1;
+        break;
+      case OPT_GRACE:
+        if (!parse_duration(optarg, &config.grace)) nxweb_die("wrong grace period: %s", optarg);
+        break;
+      case OPT_MAX_CONN_REQUESTS:
+        if (parse_conn_requests(optarg, &config.conn_requests)) nxweb_die("wrong requests per connection: %s", optarg);
+        config.keep_alive=1;
+        break;
+      case OPT_NEW_CONN_RATIO: {
+        double p=atof(optarg);
+        if (p<=0 || p>1) nxweb_die("new connection ratio must be in (0, 1]");
+        config.conn_requests.type=CR_GEOMETRIC;
+        config.conn_requests.a=1/p;
+        config.keep_alive=1;
+        break;
+      }
+      case OPT_TOP:
+        config.top_urls=atoi(optarg);
+        break;
+      case OPT_FLOW:
+        config.flow=1;
+        break;
+      case OPT_THINK:
+        if (parse_think(optarg, &config.think)) nxweb_die("wrong think time: %s", optarg);
+        break;
+      case OPT_PLUGIN:
+        config.plugin_path=optarg;
+        break;
+      case OPT_PLUGIN_ARG:
+        config.plugin_arg=optarg;
+        break;
+      case OPT_ITERATIONS:
+        config.iterations=atoi(optarg);
+        if (config.iterations<1 || config.iterations>MAX_ITERATIONS) nxweb_die("wrong number of iterations");
+        break;
+      case OPT_SAVE:
+        config.save_results=optarg;
+        break;
+      case OPT_BASELINE:
+        config.baseline=optarg;
+        break;
+      case OPT_MAX_REGRESSION:
+        config.max_regression=atof(optarg); // "5" or "5%"
+        if (config.max_regression<0) nxweb_die("wrong regression threshold: %s", optarg);
+        break;
+      case OPT_TRACE:
+        config.trace_path=optarg;
+        break;
+      case OPT_TRACE_SAMPLE:
+        config.trace_sample=atoi(optarg);
+        if (config.trace_sample<1) nxweb_die("wrong trace sampling: %s", optarg);
+        break;
+      case OPT_TRACE_SLOW:
+        if (!parse_duration(optarg, &config.trace_slow) || config.trace_slow<=0) nxweb_die("wrong trace threshold: %s", optarg);
+        break;
+      case OPT_TRACE_DECODE:
+        return trace_decode(optarg)? -1 : 1;
+      case OPT_WS:
+        config.ws=1;
+        config.keep_alive=1;
+        break;
+      case OPT_WS_SIZE:
+        config.ws_size=atoi(optarg);
+        if (config.ws_size<0) nxweb_die("wrong websocket message size: %s", optarg);
+        break;
+      case OPT_HOLD:
+        config.hold=1;
+        break;
+      case OPT_BUF_SIZE:
+        config.buf_size=atoi(optarg);
+        if (config.buf_size<1024 || config.buf_size>1048576) nxweb_die("buffer size must be 1024..1048576");
+        break;
+      case OPT_RECONNECT_DELAY:
+        if (!parse_duration(optarg, &config.reconnect_delay)) nxweb_die("wrong reconnect delay: %s", optarg);
+        break;
+      case OPT_KTLS:
+#ifndef HAVE_KTLS
+        nxweb_die("kTLS is not supported by this build");
+#endif
+        config.ktls=1;
+        break;
+      case OPT_HANDSHAKE:
+        config.handshake=1;
+        break;
+      case OPT_CLOSE_NOTIFY:
+        config.close_notify=1;
+        break;
+      case OPT_PROXY:
+        if (!strchr(optarg, ':')) nxweb_die("--proxy needs host:port");
+        config.proxy=optarg;
+        break;
+      case OPT_EDGE:
+#ifndef HAVE_EPOLL
+        nxweb_die("--edge needs epoll, not available in this build");
+#endif
+        config.edge=1;
+        break;
+      case OPT_FASTOPEN:
+#ifndef TCP_FASTOPEN_CONNECT
+        nxweb_die("--fastopen needs TCP_FASTOPEN_CONNECT, not available in this build");
+#endif
+        config.fastopen=1;
+        break;
+      case OPT_CLIENT_BW: {
+        const char* p=parse_bandwidth(optarg, &config.client_bw_min);
+        config.client_bw_max=config.client_bw_min;
+        if (p && *p=='-') p=parse_bandwidth(p+1, &config.client_bw_max);
+        if (!p || *p || config.client_bw_max<config.client_bw_min) nxweb_die("wrong client bandwidth: %s", optarg);
+        break;
+      }
+      case OPT_RCVBUF:
+        config.rcvbuf=atoi(optarg);
+        if (config.rcvbuf<=0) nxweb_die("wrong receive buffer size: %s", optarg);
+        break;
+      case OPT_TRIAL: {
+        double t;
+        if (!parse_duration(optarg, &t) || t<2) nxweb_die("trial must be at least 2s");
+        config.trial_time=ceil(t);
+        break;
+      }
       case '?':
         fprintf(stderr, "unkown option: -%c\n\n", optopt);
         show_help();
-        return EXIT_FAILURE;
+        return -1;
+    }
+  }
+  if (config.trace_path && !config.trace_sample && !config.trace_slow) config.trace_sample=1;
+  if (!config.num_priorities) config.ssl_cipher_priority[config.num_priorities++]="NORMAL";
+  if (!config.agent_secret) config.agent_secret=getenv("HTTPRESS_AGENT_SECRET");
+  if ((config.agent_port || config.agents) && (!config.agent_secret || !*config.agent_secret))
+    nxweb_die("-A and -D need a shared secret: --agent-secret or HTTPRESS_AGENT_SECRET");
+  if (config.agent_port) {
+    // workload arrives over the control connection
+    if (config.agent_port<1 || config.agent_port>65535) nxweb_die("wrong agent port");
+    return 0;
+  }
+  if (config.profile_spec) {
+    double total=parse_profile(config.profile_spec);
+    if (total<0) nxweb_die("can't parse profile: %s", config.profile_spec);
+    if (total==HUGE_VAL && config.infinite==2) nxweb_die("open-ended profile needs -r or -i");
+    if (config.infinite==2 && !requests_given) {
+      config.infinite=0;
+      config.run_time=ceil(total);
     }
+    // size the connection pool for the profile's peak; an agent's -c is its
+    // share of that peak, so phases start from the coordinator's -c instead
+    config.profile_conns0=config.profile_base? config.profile_base : config.num_connections;
+    double t, end=config.infinite==0? config.run_time : total;
+    int conns, peak=config.num_connections;
+    double rate;
+    config.num_connections=INT_MAX;
+    for (t=0; t<=end && end!=HUGE_VAL; t+=0.1) {
+      profile_targets(t, &conns, &rate);
+      if (conns>peak) peak=conns;
+    }
+    config.num_connections=peak;
+  }
+  if (config.flow && !config.session_file && !config.agent_port) nxweb_die("--flow needs a session file (-f)");
+  if (config.ws && config.flow) nxweb_die("--ws can't be combined with --flow");
+  if (!config.buf_size) config.buf_size=config.hold? HOLD_BUF_SIZE : CONN_BUF_SIZE;
+  if (config.ws_size>config.buf_size-WS_MAX_HEADER)
+    nxweb_die("websocket message size must be 0..%d", config.buf_size-WS_MAX_HEADER);
+  if (config.hold && (config.ws || config.flow)) nxweb_die("--hold can't be combined with --ws or --flow");
+  if (config.handshake && (config.ws || config.flow || config.hold || config.ktls || config.plugin_path))
+    nxweb_die("--handshake can't be combined with --ws, --flow, --hold, --ktls or --plugin");
+  if (config.hold && config.infinite==2) nxweb_die("--hold needs -r or -i");
+  if (config.slo_spec) {
+    if (config.profile_spec || config.agents) nxweb_die("SLO search can't be combined with --profile or -D");
+    config.infinite=1; // trials run until the search converges
+    config.rate=config.search_min;
+    config.warmup=0;
   }
-  if (config.infinite == 0)
-	config.num_requests = 10*config.num_threads*config.num_connections;
-  if ((session_file==NULL) && (argc-optind)<1) {
+  if ((config.iterations>1 || config.baseline || config.save_results) && (config.slo_spec || config.agents))
+    nxweb_die("--iterations, --save and --baseline can't be combined with --slo or -D");
+  if (config.warmup>0 && config.infinite==0 && config.warmup>=config.run_time)
+    nxweb_die("warm-up must be shorter than run time");
+  if (config.infinite != 2) {
+	long n=10L*config.num_threads*config.num_connections;
+	config.num_requests = n>1000000000? 1000000000 : n;
+  }
+  if ((config.session_file==NULL) && (argc-optind)<1) {
     fprintf(stderr, "missing url argument\n\n");
     show_help();
-    return EXIT_FAILURE;
+    return -1;
   }
   else if ((argc-optind)>1) {
     fprintf(stderr, "too many arguments\n\n");
     show_help();
-    return EXIT_FAILURE;
+    return -1;
   }
+  if (config.session_file==NULL) config.url=argv[optind];
   if ((config.run_time<1 || config.run_time>3600) && config.infinite==0){
    nxweb_die("Recheck run time. This value should be less than 1 hour"); 
   }
   if (config.num_requests<1 || config.num_requests>1000000000) nxweb_die("wrong number of requests");
-  if (config.num_connections<1 || config.num_connections>1000000 || config.num_connections>config.num_requests) nxweb_die("wrong number of connections");
+  if (config.num_connections<1 || config.num_connections>MAX_CONNECTIONS || config.num_connections>config.num_requests) nxweb_die("wrong number of connections");
   if (config.num_threads<1 || config.num_threads>100000 || config.num_threads>config.num_connections) nxweb_die("wrong number of threads");
 
   config.progress_step=config.num_requests/4;
   if (config.progress_step>50000) config.progress_step=50000;
+  return 0;
+}
 
-  if (session_file != NULL) {
+static int load_plugin(void) {
+  plugin_handle=dlopen(config.plugin_path, RTLD_NOW|RTLD_LOCAL);
+  if (!plugin_handle) {
+    nxweb_log_error("can't load plugin: %s", dlerror());
+    return -1;
+  }
+  httpress_plugin_get_t get=(httpress_plugin_get_t)dlsym(plugin_handle, HTTPRESS_PLUGIN_SYMBOL);
+  plugin=get? get() : 0;
+  if (!plugin || plugin->abi!=HTTPRESS_PLUGIN_ABI) {
+    nxweb_log_error("%s: not an httpress plugin or ABI version mismatch", config.plugin_path);
+    dlclose(plugin_handle);
+    plugin=0;
+    return -1;
+  }
+  return 0;
+}
+
+// a fixed key is fine: the handshake only proves the server speaks WebSocket
+#define WS_UPGRADE_HEADERS "Upgrade: websocket\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n"
+
+static const char* connection_header(void) {
+  return config.ws? "Upgrade" : config.keep_alive? "keep-alive" : "close";
+}
+
+// resolves target(s), builds request data and initializes SSL; 0 on success
+static int setup_workload(void) {
+  struct rlimit rl;
+  rlim_t need=(rlim_t)config.num_connections+64; // a descriptor per connection, plus a few
+  if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur<need) {
+    rl.rlim_cur=rl.rlim_max<need? rl.rlim_max : need;
+    if (setrlimit(RLIMIT_NOFILE, &rl) || rl.rlim_cur<need)
+      nxweb_log_error("open files limit %lu is too low for %d connections, see ulimit -n",
+                      (unsigned long)rl.rlim_cur, config.num_connections);
+  }
+  if (config.session_file != NULL) {
 	  int session_id=-1;
 	  int num_urls=0;
 	  int lineno=0;
+	  int think=0;
 	  char line[MAX_REQ_SIZE];
-	  FILE *fp=fopen(session_file,"r");
+	  FILE *fp=fopen(config.session_file,"r");
+	  if (!fp) {
+		nxweb_log_error("can't open session file %s", config.session_file);
+		return -1;
+	  }
 	  config.uri_host=NULL;
 	  while (!feof(fp)) {
 		  lineno++;
@@ -1230,10 +4023,20 @@ int main(int argc, char* argv[]) {
 			if (session_id>=0)
 				config.sessions[session_id]=num_urls;
 			session_id++;
-			if (session_id>MAX_SESSIONS) {
+			if (session_id>=MAX_SESSIONS) {
 				printf("ERROR: Too many sessions!\n");
 				exit(EXIT_FAILURE);
 			}
+			think=0;
+			continue;
+		}
+		//think time before the following steps of this session (flow mode)
+		if (!strncmp(line, "!think ", 7)) {
+			if (config.num_thinks>=MAX_THINKS || parse_think(line+7, &config.thinks[config.num_thinks])) {
+				nxweb_log_error("bad think time on line %d", lineno);
+				exit(EXIT_FAILURE);
+			}
+			think=++config.num_thinks;
 			continue;
 		}
 		//hostname, capture and verify accessible.
@@ -1244,8 +4047,9 @@ int main(int argc, char* argv[]) {
 				exit(EXIT_FAILURE);
 			}
 			parse_uri(host_string);
+			config.uri_host=strdup(config.uri_host); // parse_uri_to() reuses its buffer
 			config.session_host[session_id]=config.uri_host;
-			if (resolve_host(&config.saddr, config.uri_host)) {
+			if (resolve_target(&config.saddr, config.uri_host)) {
 				nxweb_log_error("can't resolve host %s", config.uri_host);
 				exit(EXIT_FAILURE);
 			}
@@ -1256,43 +4060,48 @@ int main(int argc, char* argv[]) {
 				nxweb_log_error("Session file does not set up host!");
 				exit(EXIT_FAILURE);
 			}
-			char *data=(char *)malloc(sizeof(char) * MAX_REQ_SIZE);
-			snprintf(data, sizeof(char) * MAX_REQ_SIZE,
-				   "GET %s HTTP/1.1\r\n"
+			if (num_urls>=MAX_URLS) {
+				printf("ERROR: Too many URLs!\n");
+				exit(EXIT_FAILURE);
+			}
+			char data[MAX_REQ_SIZE];
+			snprintf(data, sizeof(data),
+				   "GET %s%s HTTP/1.1\r\n"
 				   "Host: %s\r\n"
 				   "Connection: %s\r\n"
+				   "%s"
 				   "\r\n",
-				   line, config.uri_host, config.keep_alive?"keep-alive":"close"
+				   proxy_origin(config.uri_host), line, host_header(config.uri_host), connection_header(), config.ws? WS_UPGRADE_HEADERS : ""
 				  );
 			config.request_length_arr[num_urls]=strlen(data);
-			config.request_data_arr[num_urls]=data;
+			config.request_data_arr[num_urls]=strdup(data);
+			config.url_path_arr[num_urls]=strdup(line);
+			config.url_think[num_urls]=think;
 			num_urls++;
-			if (num_urls > MAX_URLS) {
-				printf("ERROR: Too many URLs!\n");
-				exit(EXIT_FAILURE);
-			}
 			//some debug
 			if (first<3) {printf("%s\n",data);first++;}
 		}
 	  }
+	  fclose(fp);
 	  //update final counts
 	  config.sessions[session_id]=num_urls;
 	  config.num_urls=num_urls;
 	  config.last_session=session_id+1;
   } else 
   { /* single url */
-	  if (parse_uri(argv[optind])) nxweb_die("can't parse url: %s", argv[optind]);
-	  if (resolve_host(&config.saddr, config.uri_host)) {
+	  if (parse_uri(config.url)) nxweb_die("can't parse url: %s", config.url);
+	  if (resolve_target(&config.saddr, config.uri_host)) {
 		nxweb_log_error("can't resolve host %s", config.uri_host);
 		exit(EXIT_FAILURE);
 	  }
 
 	  snprintf(config.request_data, sizeof(config.request_data),
-			   "GET %s HTTP/1.1\r\n"
+			   "GET %s%s HTTP/1.1\r\n"
 			   "Host: %s\r\n"
 			   "Connection: %s\r\n"
+			   "%s"
 			   "\r\n",
-			   config.uri_path, config.uri_host, config.keep_alive?"keep-alive":"close"
+			   proxy_origin(config.uri_host), config.uri_path, host_header(config.uri_host), connection_header(), config.ws? WS_UPGRADE_HEADERS : ""
 			  );
 	  config.request_length=strlen(config.request_data);
 	if (first<3) { printf("%s\n",config.request_data); first++; }
@@ -1302,56 +4111,140 @@ int main(int argc, char* argv[]) {
   if (config.secure) {
     gnutls_global_init();
     gnutls_certificate_allocate_credentials(&config.ssl_cred);
-    int ret=gnutls_priority_init(&config.priority_cache, config.ssl_cipher_priority, 0);
-    if (ret) {
-      fprintf(stderr, "invalid priority string: %s\n\n", config.ssl_cipher_priority);
-      return EXIT_FAILURE;
+    int i;
+    for (i=0; i<config.num_priorities; i++) {
+      if (gnutls_priority_init(&config.priority_cache[i], config.ssl_cipher_priority[i], 0)) {
+        fprintf(stderr, "invalid priority string: %s\n\n", config.ssl_cipher_priority[i]);
+        return -1;
+      }
     }
   }
+  else if (config.handshake) {
+    nxweb_log_error("--handshake needs an https URL");
+    return -1;
+  }
 #endif // WITH_SSL
+  if (config.plugin_path && load_plugin()) return -1;
+  if (config.trace_path && trace_open(config.trace_path)) return -1;
+  if (config.ws) {
+    int i;
+    config.ws_payload=malloc(config.ws_size+1);
+    if (!config.ws_payload) return -1;
+    for (i=0; i<config.ws_size; i++) config.ws_payload[i]='a'+i%26;
+  }
+  return 0;
+}
 
-
-  // Block signals for all threads
-  sigset_t set;
-  sigemptyset(&set);
-  sigaddset(&set, SIGTERM);
-  sigaddset(&set, SIGPIPE);
-  sigaddset(&set, SIGINT);
-  sigaddset(&set, SIGQUIT);
-  sigaddset(&set, SIGHUP);
-  if (pthread_sigmask(SIG_BLOCK, &set, NULL)) {
-    nxweb_log_error("can't set pthread_sigmask");
-    exit(EXIT_FAILURE);
+static void cleanup_workload(void) {
+  free_host(config.saddr);
+  if (plugin_handle) {
+    dlclose(plugin_handle);
+    plugin_handle=0;
+    plugin=0;
   }
+  if (config.trace_path) trace_close();
+  free(config.ws_payload);
+  config.ws_payload=0;
+#ifdef WITH_SSL
+  if (config.secure) {
+    gnutls_certificate_free_credentials(config.ssl_cred);
+    int i;
+    for (i=0; i<config.num_priorities; i++) gnutls_priority_deinit(config.priority_cache[i]);
+    gnutls_global_deinit();
+  }
+#endif // WITH_SSL
+}
 
+typedef struct run_result {
+  run_stats total;
+  run_stats warmup;
+  ev_tstamp duration; // excludes warm-up
+  ev_tstamp warmup_duration;
+  int real_concurrency;
+  int real_concurrency1;
+  int interrupted; // stopped by a signal
+  long max_rss; // peak resident set of this process, KB; 0 if not measured
+  double cpu_time; // user+system seconds of this process during the run, warm-up included
+  double busy_min, busy_avg, busy_max; // share of the run threads spent outside poll
+  ev_tstamp done_first, done_last; // when threads finished, from the start of the run
+  long base_rss; // resident set before the run started, KB
+} run_result;
+
+// called from the main thread about once a second while workers run
+typedef void (*interval_cb_t)(thread_config** threads, int seq, void* ctx);
+
+static thread_config** start_threads(ev_tstamp ts_start) {
   thread_config** threads=calloc(config.num_threads, sizeof(thread_config*));
   if (!threads) nxweb_die("can't allocate thread pool");
 
-  ev_tstamp ts_start=ev_time();
   int i, j;
   int conns_allocated=0;
   thread_config* tdata;
 
+  threads_running=config.num_threads;
   for (i=0; i<config.num_threads; i++) {
     threads[i]=
     tdata=memalign(MEM_GUARD, sizeof(thread_config)+MEM_GUARD);
     if (!tdata) nxweb_die("can't allocate thread data");
     memset(tdata, 0, sizeof(thread_config));
     tdata->id=i+1;
+    tdata->rng=((uint64_t)time(NULL)<<16)^(0x9E3779B97F4A7C15ULL*(i+1));
     tdata->start_time=ts_start;
     tdata->num_conn=(config.num_connections-conns_allocated)/(config.num_threads-i);
+    tdata->conn_offset=conns_allocated;
     conns_allocated+=tdata->num_conn;
+    tdata->cur_stats=config.warmup>0? &tdata->warmup_stats : &tdata->stats;
+    if (config.num_urls>0) {
+      tdata->url_stats=calloc(config.num_urls, sizeof(url_stats));
+      if (!tdata->url_stats) nxweb_die("can't allocate per-URL stats");
+    }
+    tdata->log_ring=malloc(LOG_RING*sizeof(log_entry));
+    if (!tdata->log_ring) nxweb_die("can't allocate log buffer");
+    if (config.trace_path) {
+      tdata->trace_ring=malloc(TRACE_RING*sizeof(trace_record));
+      if (!tdata->trace_ring) nxweb_die("can't allocate trace buffer");
+    }
+#ifdef WITH_SSL
+    if (config.handshake) {
+      tdata->tls_suites=calloc(MAX_TLS_SUITES, sizeof(tls_suite));
+      if (!tdata->tls_suites) nxweb_die("can't allocate handshake stats");
+    }
+#endif // WITH_SSL
     tdata->conns=memalign(MEM_GUARD, tdata->num_conn*sizeof(connection)+MEM_GUARD);
     if (!tdata->conns) nxweb_die("can't allocate thread connection pool");
     memset(tdata->conns, 0, tdata->num_conn*sizeof(connection));
+    tdata->conn_bufs=malloc((size_t)tdata->num_conn*config.buf_size);
+    tdata->read_buf=malloc(READ_BUF_SIZE);
+    if (!tdata->conn_bufs || !tdata->read_buf) nxweb_die("can't allocate thread connection buffers");
 
     tdata->loop=ev_loop_new(0);
+#ifdef HAVE_EPOLL
+    if (config.edge) {
+      tdata->epfd=epoll_create1(EPOLL_CLOEXEC);
+      if (tdata->epfd<0) nxweb_die("can't create epoll instance: %d", errno);
+      ev_io_init(&tdata->watch_epoll, epoll_cb, tdata->epfd, EV_READ);
+    }
+#endif
+    ev_timer_init(&tdata->watch_pace, pace_cb, 0., 0.);
+    tdata->sched_next=ts_start;
+    if (config.num_phases) {
+      int conns;
+      double rate;
+      profile_targets(0, &conns, &rate);
+      tdata->active_target=thread_share(tdata, conns);
+      tdata->rate=rate*tdata->num_conn/config.num_connections;
+    }
+    else {
+      tdata->active_target=tdata->num_conn;
+      tdata->rate=config.rate*config.scale*tdata->num_conn/config.num_connections;
+    }
 
     connection* conn;
     for (j=0; j<tdata->num_conn; j++) {
       conn=&tdata->conns[j];
       conn->tdata=tdata;
       conn->loop=tdata->loop;
+      conn->buf=tdata->conn_bufs+(size_t)j*config.buf_size;
 	  //if sessions, check session and set accordingly
 	  if (config.last_session>0) {
 		conn->session_id=j % config.last_session;
@@ -1360,8 +4253,9 @@ int main(int argc, char* argv[]) {
 		conn->uri_path=config.uri_path;
 		int first_url=0; //first session starts at idx 0, otherwise stored in config.session
 		if (conn->session_id>0) {
-			int first_url=config.sessions[conn->session_id-1];
+			first_url=config.sessions[conn->session_id-1];
 		} 
+		conn->first_url=first_url;
 		conn->num_urls=config.sessions[conn->session_id] - first_url;
 		conn->urls = &(config.request_data_arr[ first_url ]);
 		conn->request_length_arr=&(config.request_length_arr[first_url]);
@@ -1371,68 +4265,75 @@ int main(int argc, char* argv[]) {
 		conn->uri_path=config.uri_path;
 	  }
       conn->secure=config.secure;
-      ev_io_init(&conn->watch_write, write_cb, -1, EV_WRITE);
-      ev_io_init(&conn->watch_read, read_cb, -1, EV_READ);
-	  //also set connection props like saddr from session instead of from global config
-      open_socket(conn);
+      conn->tls_group=(tdata->conn_offset+j)%config.num_priorities;
+#ifdef HAVE_EPOLL
+      if (config.edge) {
+        ev_io_init(&conn->watch_write, edge_write_cb, -1, EV_WRITE);
+        ev_io_init(&conn->watch_read, edge_read_cb, -1, EV_READ);
+      }
+      else
+#endif
+      {
+        ev_io_init(&conn->watch_write, write_cb, -1, EV_WRITE);
+        ev_io_init(&conn->watch_read, read_cb, -1, EV_READ);
+      }
+      ev_timer_init(&conn->watch_think, think_cb, 0., 0.);
+      ev_timer_init(&conn->watch_bw, bw_cb, 0., 0.);
     }
+    // connections are opened by the worker thread itself, see connect_cb()
 
     pthread_create(&tdata->tid, 0, thread_main, tdata);
     //sleep_ms(10);
   }
-  cpu_info_t cpustat;
-  pthread_create(&(cpustat.tid), 0, cpu_stat_thread, &cpustat);
-  
-  // Unblock signals for the main thread;
-  // other threads have inherited sigmask we set earlier
-  sigdelset(&set, SIGPIPE); // except SIGPIPE
-  if (pthread_sigmask(SIG_UNBLOCK, &set, NULL)) {
-    nxweb_log_error("can't unset pthread_sigmask");
-    exit(EXIT_FAILURE);
-  }
-  long total_success=0;
-  long total_fail=0;
-  long total_bytes=0;
-  long total_overhead=0;
-  long total_connect=0;
+  __sync_synchronize();
+  worker_threads=threads;
+  return threads;
+}
+
+static void stop_threads(thread_config** threads) {
+  int i;
+  stop_requested=1;
+  for (i=0; i<config.num_threads; i++) ev_async_send(threads[i]->loop, &threads[i]->watch_stop);
+}
 
+static void collect_stats(thread_config** threads, run_stats* total, int with_warmup) {
+  int i;
+  memset(total, 0, sizeof(*total));
   for (i=0; i<config.num_threads; i++) {
-    tdata=threads[i];
-    pthread_join(threads[i]->tid, 0);
-    total_success+=tdata->num_success;
-    total_fail+=tdata->num_fail;
-    total_bytes+=tdata->num_bytes_received;
-    total_overhead+=tdata->num_overhead_received;
-    total_connect+=tdata->num_connect;
+    stats_merge(total, &threads[i]->stats);
+    if (with_warmup) stats_merge(total, &threads[i]->warmup_stats);
   }
+}
 
-  int real_concurrency=0;
-  int real_concurrency1=0;
-  int real_concurrency1_threshold=config.num_requests/config.num_connections/10;
-  if (real_concurrency1_threshold<2) real_concurrency1_threshold=2;
+static void free_threads(thread_config** threads) {
+  int i;
+  thread_config* tdata;
+  worker_threads=0;
   for (i=0; i<config.num_threads; i++) {
     tdata=threads[i];
-    for (j=0; j<tdata->num_conn; j++) {
-      connection* conn=&tdata->conns[j];
-      if (conn->success_count) real_concurrency++;
-      if (conn->success_count>=real_concurrency1_threshold) real_concurrency1++;
-    }
+    ev_loop_destroy(tdata->loop);
+#ifdef HAVE_EPOLL
+    if (config.edge) close(tdata->epfd);
+#endif
+    free(tdata->url_stats);
+    free(tdata->trace_ring);
+    free(tdata->log_ring);
+    free(tdata->conns);
+    free(tdata->conn_bufs);
+    free(tdata->read_buf);
+#ifdef WITH_SSL
+    if (tdata->ssl_cert) gnutls_x509_crt_deinit(tdata->ssl_cert);
+    free(tdata->tls_suites);
+#endif // WITH_SSL
+    free(tdata);
   }
-
-  ev_tstamp ts_end=ev_time();
-  if (ts_end<=ts_start) ts_end=ts_start+0.00001;
-  ev_tstamp duration=ts_end-ts_start;
-  int sec=duration;
-  duration=(duration-sec)*1000;
-  int millisec=duration;
-  //duration=(duration-millisec)*1000;
-  //int microsec=duration;
-  double rps=total_success/(ts_end-ts_start);
-  int kbps=(total_bytes+total_overhead) / (ts_end-ts_start) / 1024;
-  ev_tstamp avg_req_time=total_success? (ts_end-ts_start) * config.num_connections / total_success : 0;
+  free(threads);
+}
 
 #ifdef WITH_SSL
-  if (config.secure && !config.quiet) {
+static void print_ssl_info(thread_config** threads) {
+  int i;
+  thread_config* tdata;
     for (i=0; i<config.num_threads; i++) {
       tdata=threads[i];
       if (tdata->ssl_identified) {
@@ -1457,16 +4358,89 @@ int main(int argc, char* argv[]) {
         break;
       }
     }
+}
+
+static int cmp_tls_suite(const void* a, const void* b) {
+  const tls_suite* x=a;
+  const tls_suite* y=b;
+  if (x->tls_group!=y->tls_group) return x->tls_group-y->tls_group;
+  return x->latency.count<y->latency.count? 1 : x->latency.count>y->latency.count? -1 : 0;
+}
+
+// --handshake: rate and latency per priority group and negotiated suite
+static void print_tls_suites(thread_config** threads, ev_tstamp duration) {
+  static tls_suite all[MAX_TLS_SUITES];
+  int num=0, i, j, k;
+  for (i=0; i<config.num_threads; i++) {
+    for (j=0; j<threads[i]->num_tls_suites; j++) {
+      const tls_suite* ts=&threads[i]->tls_suites[j];
+      for (k=0; k<num; k++) {
+        if (all[k].tls_group==ts->tls_group && all[k].protocol==ts->protocol && all[k].kx==ts->kx
+            && all[k].cipher==ts->cipher && all[k].kx_group==ts->kx_group) break;
+      }
+      if (k==num) {
+        if (num==MAX_TLS_SUITES) continue;
+        all[num]=*ts;
+        memset(&all[num].latency, 0, sizeof(all[num].latency));
+        num++;
+      }
+      hist_merge(&all[k].latency, &ts->latency);
+    }
+  }
+  if (!num) return;
+  qsort(all, num, sizeof(tls_suite), cmp_tls_suite);
+  printf("\nHANDSHAKES: time from TCP connection established\n");
+  for (i=0; i<config.num_priorities; i++) printf("  group %d: %s\n", i+1, config.ssl_cipher_priority[i]);
+  printf("  group protocol key-exchange    cipher             kx-group      count      hs/s   avg ms   p50 ms   p90 ms   p99 ms\n");
+  for (i=0; i<num; i++) {
+    const tls_suite* ts=&all[i];
+    const latency_hist* h=&ts->latency;
+    const char* kx_group=gnutls_group_get_name(ts->kx_group);
+    printf("  %5d %-8s %-15s %-18s %-10s %8ld %9.1f %8.2f %8.2f %8.2f %8.2f\n", ts->tls_group+1,
+           gnutls_protocol_get_name(ts->protocol), gnutls_kx_get_name(ts->kx) ?: "-",
+           gnutls_cipher_get_name(ts->cipher) ?: "-", kx_group? kx_group : "-", (long)h->count,
+           h->count/duration, h->count? h->sum/1000./h->count : 0., hist_percentile(h, 50)*1000,
+           hist_percentile(h, 90)*1000, hist_percentile(h, 99)*1000);
   }
+}
 #endif // WITH_SSL
 
+static void print_report(const run_result* res, const cpu_info_t* cpustat) {
+  const run_stats* total=&res->total;
+  long total_success=total->num_success;
+  long total_fail=total->num_fail;
+  long total_bytes=total->num_bytes_received;
+  long total_overhead=total->num_overhead_received;
+  long total_connect=total->num_connect;
+  ev_tstamp duration=res->duration;
+  int sec=duration;
+  duration=(duration-sec)*1000;
+  int millisec=duration;
+  //duration=(duration-millisec)*1000;
+  //int microsec=duration;
+  double rps=total_success/res->duration;
+  int kbps=(total_bytes+total_overhead) / res->duration / 1024;
+  ev_tstamp avg_req_time=total_success? res->duration * config.num_connections / total_success : 0;
+
   if (!config.quiet) printf("\n");
+  if (res->interrupted) printf("INTERRUPTED: partial results\n");
+  if (res->warmup_duration>0) {
+    const run_stats* w=&res->warmup;
+    printf("WARMUP:  %.1f seconds excluded, %ld requests, %ld success, %ld fail, %.2f ms p50, %.2f ms p99\n",
+           res->warmup_duration, w->num_success+w->num_fail, w->num_success, w->num_fail,
+           hist_percentile(&w->latency, 50)*1000, hist_percentile(&w->latency, 99)*1000);
+  }
   printf("TOTALS:  %ld connect, %ld requests, %ld success, %ld fail, %d (%d) real concurrency, keepalive %d\n",
-         total_connect, total_success+total_fail, total_success, total_fail, real_concurrency, real_concurrency1, config.keep_alive);
+         total_connect, total_success+total_fail, total_success, total_fail, res->real_concurrency, res->real_concurrency1, config.keep_alive);
+  if (total_fail) {
+    int i;
+    printf("ERRCLASS:");
+    for (i=0; i<EC_MAX; i++) printf(" %ld %s%s", total->num_errors[i], error_class_names[i], i<EC_MAX-1? "," : "\n");
+  }
   printf("TRAFFIC: %ld avg bytes, %ld avg overhead, %ld bytes, %ld overhead\n",
          total_success?total_bytes/total_success:0L, total_success?total_overhead/total_success:0L, total_bytes, total_overhead);
-  printf("CPUSTAT:  max,%.1Lf,min,%.1Lf,avg,%.1Lf \n",
-         cpustat.max, cpustat.min,cpustat.avg);
+  if (cpustat) printf("CPUSTAT:  max,%.1Lf,min,%.1Lf,avg,%.1Lf \n",
+         cpustat->max, cpustat->min,cpustat->avg);
   if (rps > 100) {
 	int irps=floor(rps);
   	printf("TIMING:  %d.%03d seconds, %d rps, %d kbps, %.1f ms avg req time\n",
@@ -1476,27 +4450,1380 @@ int main(int argc, char* argv[]) {
   	printf("TIMING:  %d.%03d seconds, %.2f rps, %d kbps, %.1f ms avg req time\n",
          sec, millisec, /*microsec,*/ rps, kbps, (float)(avg_req_time*1000));
   }
+  if (config.num_threads>1 && res->busy_max>0) {
+    printf("THREADS: %d, %.0f%% avg busy, %.0f%% min, %.0f%% max, finished %.3f-%.3f seconds\n", config.num_threads,
+           res->busy_avg*100, res->busy_min*100, res->busy_max*100, res->done_first, res->done_last);
+  }
+  const latency_hist* ch=&total->connect_latency;
+  if (ch->count || total->num_connect_fail) {
+    printf("CONNECT: %ld established, %ld fail, %.2f ms avg, %.2f ms p50, %.2f ms p99, %.2f ms max\n",
+           (long)ch->count, total->num_connect_fail, ch->count? ch->sum/1000./ch->count : 0.,
+           hist_percentile(ch, 50)*1000, hist_percentile(ch, 99)*1000, ch->max/1000.);
+  }
+  const latency_hist* th=&total->tunnel_latency;
+  if (th->count || total->num_tunnel_fail) {
+    printf("TUNNEL:  %ld established, %ld fail, %.2f ms avg, %.2f ms p50, %.2f ms p99, %.2f ms max\n",
+           (long)th->count, total->num_tunnel_fail, th->count? th->sum/1000./th->count : 0.,
+           hist_percentile(th, 50)*1000, hist_percentile(th, 99)*1000, th->max/1000.);
+  }
+  if (config.keep_alive && total_success) {
+    latency_hist reused;
+    const latency_hist* fh=&total->first_latency;
+    hist_sub(&reused, &total->latency, fh);
+    printf("CHURN:   %.1f%% of requests on new connections, %.1f requests per connection\n",
+           fh->count*100./total_success, fh->count? (double)total_success/fh->count : 0.);
+    printf("FIRST:   %ld requests, %.0f rps, %.2f ms avg, %.2f ms p50, %.2f ms p99\n", (long)fh->count,
+           fh->count/res->duration, fh->count? fh->sum/1000./fh->count : 0.,
+           hist_percentile(fh, 50)*1000, hist_percentile(fh, 99)*1000);
+    printf("REUSED:  %ld requests, %.0f rps, %.2f ms avg, %.2f ms p50, %.2f ms p99\n", (long)reused.count,
+           reused.count/res->duration, reused.count? reused.sum/1000./reused.count : 0.,
+           hist_percentile(&reused, 50)*1000, hist_percentile(&reused, 99)*1000);
+  }
+  const latency_hist* fl=&total->flow_latency;
+  if (config.flow) {
+    printf("FLOWS:   %ld completed, %ld aborted, %.2f ms avg, %.2f ms p50, %.2f ms p90, %.2f ms p99, %.2f ms max\n",
+           (long)fl->count, total->num_flow_fail, fl->count? fl->sum/1000./fl->count : 0.,
+           hist_percentile(fl, 50)*1000, hist_percentile(fl, 90)*1000, hist_percentile(fl, 99)*1000, fl->max/1000.);
+  }
+  if (config.hold) {
+    const latency_hist* eg=&total->event_gap;
+    printf("HOLD:    %ld established, %ld dropped, %ld reconnected, %ld held at end\n", total->num_established,
+           total->num_dropped, total->num_reconnect, total->num_established-total->num_dropped);
+    printf("EVENTS:  %ld received, %.0f per second, gap %.2f ms avg, %.2f ms p50, %.2f ms p99, %.2f ms max\n",
+           (long)eg->count, eg->count/res->duration, eg->count? eg->sum/1000./eg->count : 0.,
+           hist_percentile(eg, 50)*1000, hist_percentile(eg, 99)*1000, eg->max/1000.);
+    if (res->max_rss>0) {
+      printf("MEMORY:  %.1f MB peak RSS, %.2f KB per connection above %.1f MB at start\n", res->max_rss/1024.,
+             (double)(res->max_rss-res->base_rss)/config.num_connections, res->base_rss/1024.);
+    }
+  }
+  if (config.ktls && (total->num_ktls || total->num_ktls_fallback)) {
+    printf("KTLS:    %ld connections offloaded to the kernel, %ld fell back to gnutls\n",
+           total->num_ktls, total->num_ktls_fallback);
+  }
+  if (config.fastopen) {
+    printf("FASTOPEN: %ld connections sent data with the SYN, %ld accepted by the server, "
+           "%ld without cookie, %ld fell back to connect()\n", total->num_tfo_data, total->num_tfo_accepted,
+           total->num_tfo_no_cookie, total->num_tfo_fallback);
+  }
+  if (config.client_bw_max>0 && !config.hold && total->bw_requests) {
+    const latency_hist* lat=&total->latency;
+    const latency_hist* fb=&total->first_byte_latency;
+    char range[32];
+    if (config.client_bw_max>config.client_bw_min) {
+      snprintf(range, sizeof(range), "%.0f-%.0f", config.client_bw_min*8/1000, config.client_bw_max*8/1000);
+    }
+    else snprintf(range, sizeof(range), "%.0f", config.client_bw_min*8/1000);
+    printf("CLIENT-BW: %s kbit/s per connection, %.1f kbit/s achieved per request, %.1f%% of the limit; "
+           "first byte %.2f ms avg, %.2f ms p99\n", range,
+           (total->num_bytes_received+total->num_overhead_received)*8/1000./(lat->sum/1e6),
+           total->bw_permille/10./total->bw_requests, fb->count? fb->sum/1000./fb->count : 0.,
+           hist_percentile(fb, 99)*1000);
+  }
+  const long* io=total->io;
+  if (io[IO_RW] && total_success+total_fail) {
+    double requests=total_success+total_fail;
+    printf("SYSCALLS: %.2f per request: %.2f read/write, %.2f poll, %.2f epoll_ctl, %.2f other; "
+           "%ld EAGAIN, %ld partial writes, %.0f bytes per read\n",
+           (io[IO_RW]+io[IO_POLL]+io[IO_CTL]+io[IO_OTHER])/requests, io[IO_RW]/requests,
+           io[IO_POLL]/requests, io[IO_CTL]/requests, io[IO_OTHER]/requests, io[IO_EAGAIN],
+           io[IO_PARTIAL_WRITE], io[IO_READS]? (double)io[IO_READ_BYTES]/io[IO_READS] : 0.);
+  }
+  long all_requests=total_success+total_fail+res->warmup.num_success+res->warmup.num_fail;
+  if (res->cpu_time>0 && all_requests) {
+    printf("CPU:     %.1f us per request, user+system\n", res->cpu_time*1e6/all_requests);
+  }
+  if (config.timeouts_enabled) {
+    printf("TIMEOUTS: %ld connect, %ld tls, %ld first-byte, %ld total\n", total->num_timeout[TO_CONNECT],
+           total->num_timeout[TO_TLS], total->num_timeout[TO_FIRST_BYTE], total->num_timeout[TO_TOTAL]);
+  }
+  const latency_hist* h=&total->latency;
+  if (h->count) {
+    printf("LATENCY: %.2f ms avg, %.2f ms p50, %.2f ms p90, %.2f ms p99, %.2f ms p99.9, %.2f ms max\n",
+           h->sum/1000./h->count, hist_percentile(h, 50)*1000, hist_percentile(h, 90)*1000,
+           hist_percentile(h, 99)*1000, hist_percentile(h, 99.9)*1000, h->max/1000.);
+  }
+}
 
-  pthread_join(cpustat.tid,0);
-		 
-  freeaddrinfo(config.saddr);
+// held streams are counted from the start of the run, the rest per interval
+static void print_hold_interval(int seq, const run_stats* cur, const run_stats* interval) {
+  printf("[%4ds] %ld held, %ld established, %ld dropped, %ld reconnected, %ld events, %.2f ms p50, %.2f ms p99 gap",
+         seq, cur->num_established-cur->num_dropped, interval->num_established, interval->num_dropped,
+         interval->num_reconnect, (long)interval->event_gap.count,
+         hist_percentile(&interval->event_gap, 50)*1000, hist_percentile(&interval->event_gap, 99)*1000);
+}
+
+static void local_interval_cb(thread_config** threads, int seq, void* ctx) {
+  static run_stats prev, cur, interval;
+  int i, conns=0;
+  double rate=0;
+  collect_stats(threads, &cur, 1);
+  stats_sub(&interval, &cur, &prev);
+  prev=cur;
+  for (i=0; i<config.num_threads; i++) {
+    conns+=threads[i]->active_target;
+    rate+=threads[i]->rate;
+  }
+  if (config.hold) print_hold_interval(seq, &cur, &interval);
+  else {
+    printf("[%4ds] %d conns, %ld rps, %ld fail, %.2f ms p50, %.2f ms p99", seq, conns,
+           interval.num_success, interval.num_fail,
+           hist_percentile(&interval.latency, 50)*1000, hist_percentile(&interval.latency, 99)*1000);
+  }
+  if (rate>0) printf(", %.0f target rps", rate);
+  printf("%s\n", seq<=config.warmup? " (warmup)" : "");
+  fflush(stdout);
+}
+
+typedef struct slo_search {
+  int trials;
+  int trial_start; // second the current trial started
+  double rate; // current trial target
+  double pass; // highest rate that met the SLO, 0 if none yet
+  double fail; // lowest rate that broke it, 0 if none yet
+  run_stats snap; // cumulative stats when measurement started
+  run_stats pass_stats;
+} slo_search;
+
+static int settle_time(void) {
+  return config.trial_time/5>1? config.trial_time/5 : 1;
+}
+
+// prints one trial and returns 1 if it met the SLO
+static int slo_check(const run_stats* st, double rate, ev_tstamp duration, int trial) {
+  const latency_hist* h=&st->latency;
+  long requests=st->num_success+st->num_fail;
+  double errors=requests? (double)st->num_fail/requests : 0;
+  int i, ok=1;
+  printf("TRIAL %2d: %.0f rps target, %.0f rps, %.2f%% errors", trial, rate, requests/duration, errors*100);
+  for (i=0; i<config.num_slo; i++) {
+    ev_tstamp lo, hi, v=hist_percentile(h, config.slo[i].pct);
+    hist_percentile_ci(h, config.slo[i].pct, &lo, &hi);
+    printf(", p%g %.2f ms (%.2f-%.2f)", config.slo[i].pct, v*1000, lo*1000, hi*1000);
+    if (v>config.slo[i].limit) ok=0;
+  }
+  if (errors>config.slo_errors) ok=0;
+  // requests that never completed would otherwise escape the latency check
+  if (requests<rate*duration*0.95) ok=0;
+  printf(" -> %s\n", ok? "PASS" : "FAIL");
+  fflush(stdout);
+  return ok;
+}
+
+static void print_search_result(const slo_search* s) {
+  int i;
+  printf("\nSEARCH:  SLO %s, %.0f%% error budget, %d trials\n", config.slo_spec, config.slo_errors*100, s->trials);
+  if (!s->pass) {
+    printf("SEARCH:  SLO not met at %.0f rps\n", config.search_min);
+    return;
+  }
+  if (s->fail) printf("SEARCH:  max %.0f rps meets SLO, %.0f rps breaks it\n", s->pass, s->fail);
+  else printf("SEARCH:  max %.0f rps meets SLO (search limit reached)\n", s->pass);
+  const latency_hist* h=&s->pass_stats.latency;
+  for (i=0; i<config.num_slo; i++) {
+    ev_tstamp lo, hi;
+    hist_percentile_ci(h, config.slo[i].pct, &lo, &hi);
+    printf("SEARCH:  at %.0f rps p%g %.2f ms, 95%% CI %.2f-%.2f ms, limit %.2f ms\n", s->pass, config.slo[i].pct,
+           hist_percentile(h, config.slo[i].pct)*1000, lo*1000, hi*1000, config.slo[i].limit*1000);
+  }
+}
+
+static void search_interval_cb(thread_config** threads, int seq, void* ctx) {
+  slo_search* s=ctx;
+  int elapsed=seq-s->trial_start;
+  if (elapsed==settle_time()) {
+    collect_stats(threads, &s->snap, 0);
+    return;
+  }
+  if (elapsed<config.trial_time || stop_requested) return;
+
+  run_stats cur, st;
+  collect_stats(threads, &cur, 0);
+  stats_sub(&st, &cur, &s->snap);
+  int ok=slo_check(&st, s->rate, config.trial_time-settle_time(), ++s->trials);
+  if (ok) {
+    s->pass=s->rate;
+    s->pass_stats=st;
+  }
+  else s->fail=s->rate;
+
+  double next;
+  if (!s->pass) next=0; // fails at the minimum rate
+  else if (!s->fail) next=config.search_max && s->rate*2>config.search_max? config.search_max : s->rate*2;
+  else next=(s->pass+s->fail)/2;
+  if (!next || next==s->rate || (s->fail && s->fail-s->pass<=s->pass*0.05) || s->trials==MAX_TRIALS) {
+    print_search_result(s);
+    stop_threads(threads);
+    return;
+  }
+  s->rate=next;
+  s->trial_start=seq;
+  search_target.rate=next;
+  search_target.trial++;
+}
+
+static void url_stats_merge(url_stats* dst, const url_stats* src) {
+  int i;
+  dst->num_success+=src->num_success;
+  dst->num_fail+=src->num_fail;
+  dst->sum+=src->sum;
+  if (src->max>dst->max) dst->max=src->max;
+  for (i=0; i<URL_HIST_BUCKETS; i++) dst->buckets[i]+=src->buckets[i];
+}
+
+static double url_percentile(const url_stats* us, double pct) {
+  uint64_t target=ceil(pct/100.*us->num_success), seen=0;
+  int i;
+  if (!us->num_success) return 0;
+  if (target<1) target=1;
+  for (i=0; i<URL_HIST_BUCKETS; i++) {
+    seen+=us->buckets[i];
+    if (seen>=target) {
+      uint64_t low=log_bucket_low(i, URL_HIST_SUB_BITS);
+      uint64_t v=low+(log_bucket_low(i+1, URL_HIST_SUB_BITS)-low)/2;
+      return (v>us->max? us->max : v)/1000000.;
+    }
+  }
+  return us->max/1000000.;
+}
+
+static int session_of_url(int url) {
+  int i;
+  for (i=0; i<config.last_session-1 && url>=config.sessions[i]; i++);
+  return i;
+}
+
+static void print_url_row(const url_stats* us, const char* host, const char* path) {
+  printf("  %9u %7u %9.2f %9.2f %9.2f  %s%s\n", us->num_success+us->num_fail, us->num_fail,
+         us->num_success? us->sum/1000./us->num_success : 0., url_percentile(us, 50)*1000,
+         url_percentile(us, 99)*1000, host? host : "", path? path : "");
+}
+
+static const url_stats* sort_urls;
+static const double* sort_p99; // computed once per URL before sorting
+static int cmp_url_p99(const void* a, const void* b) {
+  double pa=sort_p99[*(const int*)a], pb=sort_p99[*(const int*)b];
+  return pa<pb? 1 : pa>pb? -1 : 0;
+}
+static int cmp_url_fail(const void* a, const void* b) {
+  uint32_t fa=sort_urls[*(const int*)a].num_fail, fb=sort_urls[*(const int*)b].num_fail;
+  return fa<fb? 1 : fa>fb? -1 : 0;
+}
+
+// session mode: per-URL totals of the last run, merged from the threads or,
+// in distributed mode, from the agents' URL lines
+static url_stats* url_totals;
+
+static void merge_url_stats(thread_config** threads) {
+  int i, j, n=config.num_urls;
+  if (!n) return;
+  if (!url_totals && !(url_totals=malloc(n*sizeof(url_stats)))) nxweb_die("can't allocate per-URL stats");
+  memset(url_totals, 0, n*sizeof(url_stats));
+  for (i=0; i<config.num_threads; i++) {
+    for (j=0; j<n; j++) {
+      if (threads[i]->url_stats[j].num_success || threads[i]->url_stats[j].num_fail)
+        url_stats_merge(&url_totals[j], &threads[i]->url_stats[j]);
+    }
+  }
+}
+
+// prints per-session-host totals and the top slowest and most failing URLs
+static void print_url_stats(void) {
+  int i, j, n=config.num_urls, shown;
+  if (!n || !url_totals || config.top_urls<=0) return;
+  const url_stats* total=url_totals;
+  url_stats* sessions=calloc(config.last_session, sizeof(url_stats));
+  int* order=malloc(n*sizeof(int));
+  double* p99=malloc(n*sizeof(double));
+  if (!sessions || !order || !p99) nxweb_die("can't allocate per-URL report");
+  for (j=0; j<n; j++) {
+    url_stats_merge(&sessions[session_of_url(j)], &total[j]);
+    order[j]=j;
+    p99[j]=url_percentile(&total[j], 99);
+  }
+  printf("\nSESSIONS:  requests    fail    avg ms    p50 ms    p99 ms  host\n");
+  for (i=0; i<config.last_session; i++) print_url_row(&sessions[i], config.session_host[i], 0);
+
+  sort_urls=total;
+  sort_p99=p99;
+  qsort(order, n, sizeof(int), cmp_url_p99);
+  printf("\nSLOWEST:   requests    fail    avg ms    p50 ms    p99 ms  url\n");
+  for (i=0, shown=0; i<n && shown<config.top_urls; i++) {
+    if (!total[order[i]].num_success) continue;
+    print_url_row(&total[order[i]], config.session_host[session_of_url(order[i])], config.url_path_arr[order[i]]);
+    shown++;
+  }
+  qsort(order, n, sizeof(int), cmp_url_fail);
+  if (total[order[0]].num_fail) {
+    printf("\nERRORS:    requests    fail    avg ms    p50 ms    p99 ms  url\n");
+    for (i=0; i<n && i<config.top_urls && total[order[i]].num_fail; i++) {
+      print_url_row(&total[order[i]], config.session_host[session_of_url(order[i])], config.url_path_arr[order[i]]);
+    }
+  }
+  free(p99);
+  free(order);
+  free(sessions);
+}
+
+// fills in results for everything done between ts_start and ts_end;
+// also used for snapshots while threads are still running
+static inline double rusage_cpu(const struct rusage* ru) {
+  return ru->ru_utime.tv_sec+ru->ru_stime.tv_sec+(ru->ru_utime.tv_usec+ru->ru_stime.tv_usec)/1e6;
+}
+
+static void fill_result(thread_config** threads, ev_tstamp ts_start, ev_tstamp ts_end, run_result* res) {
+  int i, j;
+  thread_config* tdata;
+  collect_stats(threads, &res->total, 0);
+  memset(&res->warmup, 0, sizeof(res->warmup));
+  for (i=0; i<config.num_threads; i++) stats_merge(&res->warmup, &threads[i]->warmup_stats);
+
+  res->real_concurrency=0;
+  res->real_concurrency1=0;
+  int real_concurrency1_threshold=config.num_requests/config.num_connections/10;
+  if (real_concurrency1_threshold<2) real_concurrency1_threshold=2;
   for (i=0; i<config.num_threads; i++) {
     tdata=threads[i];
-    free(tdata->conns);
+    for (j=0; j<tdata->num_conn; j++) {
+      connection* conn=&tdata->conns[j];
+      if (conn->success_count) res->real_concurrency++;
+      if (conn->success_count>=real_concurrency1_threshold) res->real_concurrency1++;
+    }
+  }
+
+  res->busy_min=1;
+  res->busy_avg=res->busy_max=0;
+  res->done_first=ts_end-ts_start;
+  res->done_last=0;
+  for (i=0; i<config.num_threads; i++) {
+    tdata=threads[i];
+    ev_tstamp done=(tdata->end_time? tdata->end_time : ts_end)-ts_start;
+    // over the thread's own run, as in its thread line
+    double busy=done>0? tdata->busy_time/done : 0;
+    if (busy<res->busy_min) res->busy_min=busy;
+    if (busy>res->busy_max) res->busy_max=busy;
+    res->busy_avg+=busy/config.num_threads;
+    if (done<res->done_first) res->done_first=done;
+    if (done>res->done_last) res->done_last=done;
+  }
+
+  res->warmup_duration=0;
+  if (config.warmup>0) {
+    // rates are computed over the measured part of the run only
+    res->warmup_duration=ts_end-ts_start<config.warmup? ts_end-ts_start : config.warmup;
+    ts_start+=res->warmup_duration;
+  }
+  if (ts_end<=ts_start) ts_end=ts_start+0.00001;
+  res->duration=ts_end-ts_start;
+}
+
+static void print_snapshot(thread_config** threads, ev_tstamp ts_start) {
+  run_result res;
+  ev_tstamp now=ev_time();
+  memset(&res, 0, sizeof(res));
+  fill_result(threads, ts_start, now, &res);
+  printf("\nSNAPSHOT: %.1f seconds into the run\n", now-ts_start);
+  print_report(&res, 0);
+  fflush(stdout);
+}
+
+// prints launch progress; main thread only, the workers just count.
+// *reported is the last count printed in requests mode, the last second
+// printed in time mode
+static void progress_flush(int* reported) {
+  int launched=config.request_counter;
+  if (config.quiet) return;
+  if (config.infinite==2) {
+    if (config.progress_step<10) return;
+    if (launched>config.num_requests) launched=config.num_requests;
+    while (*reported<launched) {
+      int next=(*reported/config.progress_step+1)*config.progress_step;
+      if (next>config.num_requests) next=config.num_requests;
+      if (next>launched) break;
+      printf("%d requests launched\n", next);
+      *reported=next;
+    }
+  }
+  else if (config.infinite==0) {
+    int sec=time(NULL)-start_time_rg;
+    if (sec-*reported>4) {
+      printf("%d sec:  %d requests launched\n", sec, launched);
+      *reported=sec;
+    }
+  }
+}
+
+// SIGINT/SIGTERM/SIGHUP/SIGQUIT stop the run gracefully (a second one exits
+// at once), SIGUSR1 prints a snapshot; returns 1 if the run was stopped
+static int wait_threads(thread_config** threads, ev_tstamp ts_start, interval_cb_t cb, void* ctx) {
+  int i, seq=0, interrupted=0, progress=0;
+  sigset_t set;
+  struct timespec timeout={0, 10000000};
+  sigemptyset(&set);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGQUIT);
+  sigaddset(&set, SIGHUP);
+  sigaddset(&set, SIGUSR1);
+  while (threads_running>0) {
+    int sig=sigtimedwait(&set, 0, &timeout);
+    if (sig==SIGUSR1) print_snapshot(threads, ts_start);
+    else if (sig>0) {
+      if (interrupted) exit(EXIT_FAILURE);
+      interrupted=1;
+      stop_threads(threads);
+    }
+    if (config.infinite==0 && !stop_requested && ev_time()-ts_start>=config.run_time) stop_threads(threads);
+    if (cb && ev_time()-ts_start>=seq+1) cb(threads, ++seq, ctx);
+    if (config.trace_path) trace_flush(threads);
+    log_flush(threads);
+    progress_flush(&progress);
+  }
+  for (i=0; i<config.num_threads; i++) pthread_join(threads[i]->tid, 0);
+  if (config.trace_path) trace_flush(threads);
+  log_flush(threads);
+  progress_flush(&progress);
+  return interrupted;
+}
+
+// runs the configured workload in this process and prints the report
+static void run_benchmark(interval_cb_t cb, void* ctx, run_result* res) {
+  // Block signals for all threads; the main thread takes them
+  // synchronously in wait_threads()
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGPIPE);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGQUIT);
+  sigaddset(&set, SIGHUP);
+  sigaddset(&set, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL)) {
+    nxweb_log_error("can't set pthread_sigmask");
+    exit(EXIT_FAILURE);
+  }
+
+  start_time_rg = time(NULL);
+  stop_requested=0;
+  config.request_counter=0;
+  stop_cpu_stats=0; // before workers start: a short run may finish first
+  struct rusage ru;
+  int have_ru=!getrusage(RUSAGE_SELF, &ru);
+  res->base_rss=have_ru? ru.ru_maxrss : 0;
+  double cpu_start=have_ru? rusage_cpu(&ru) : 0;
+  ev_tstamp ts_start=ev_time();
+  thread_config** threads=start_threads(ts_start);
+
+  cpu_info_t cpustat;
+  pthread_create(&(cpustat.tid), 0, cpu_stat_thread, &cpustat);
+
+  res->interrupted=wait_threads(threads, ts_start, cb, ctx);
+  fill_result(threads, ts_start, ev_time(), res);
+
 #ifdef WITH_SSL
-    if (tdata->ssl_cert) gnutls_x509_crt_deinit(tdata->ssl_cert);
+  if (config.secure && !config.quiet) print_ssl_info(threads);
 #endif // WITH_SSL
-    free(tdata);
-  }
-  free(threads);
 
+  pthread_join(cpustat.tid,0);
+  have_ru=have_ru && !getrusage(RUSAGE_SELF, &ru);
+  res->max_rss=have_ru? ru.ru_maxrss : 0;
+  res->cpu_time=have_ru? rusage_cpu(&ru)-cpu_start : 0;
+  print_report(res, &cpustat);
+  merge_url_stats(threads);
+  print_url_stats();
 #ifdef WITH_SSL
-  if (config.secure) {
-    gnutls_certificate_free_credentials(config.ssl_cred);
-    gnutls_priority_deinit(config.priority_cache);
-    gnutls_global_deinit();
-  }
+  if (config.handshake) print_tls_suites(threads, res->duration);
 #endif // WITH_SSL
+  if (config.trace_path) {
+    long dropped=0;
+    int i;
+    for (i=0; i<config.num_threads; i++) dropped+=threads[i]->trace_dropped;
+    printf("TRACE:   %llu records in %s, %ld dropped\n", (unsigned long long)trace.records, config.trace_path, dropped);
+  }
+  free_threads(threads);
+}
+
+/*
+ * Repeated runs (--iterations) and comparison with saved results (--baseline).
+ *
+ * Every iteration contributes one sample per metric. Means get a Student's t
+ * 95% confidence interval, and each metric is compared with the baseline by
+ * Welch's t-test, which does not assume equal variances. A metric regresses
+ * when the difference is significant (p<0.05) and worse than --max-regression.
+ */
+
+enum {M_RPS, M_P50, M_P90, M_P99, M_MAX};
+static const char* metric_names[M_MAX]={"rps", "p50_ms", "p90_ms", "p99_ms"};
+
+typedef struct trial_set {
+  int n;
+  double v[MAX_ITERATIONS][M_MAX];
+} trial_set;
+
+static void trial_record(trial_set* ts, const run_result* res) {
+  if (ts->n>=MAX_ITERATIONS) return;
+  double* v=ts->v[ts->n++];
+  v[M_RPS]=res->total.num_success/res->duration;
+  v[M_P50]=hist_percentile(&res->total.latency, 50)*1000;
+  v[M_P90]=hist_percentile(&res->total.latency, 90)*1000;
+  v[M_P99]=hist_percentile(&res->total.latency, 99)*1000;
+}
+
+static void trial_mean_var(const trial_set* ts, int m, double* mean, double* var) {
+  int i;
+  double sum=0, sq=0;
+  for (i=0; i<ts->n; i++) sum+=ts->v[i][m];
+  *mean=ts->n? sum/ts->n : 0;
+  for (i=0; i<ts->n; i++) sq+=(ts->v[i][m]-*mean)*(ts->v[i][m]-*mean);
+  *var=ts->n>1? sq/(ts->n-1) : 0;
+}
+
+// continued fraction for the incomplete beta function (modified Lentz)
+static double beta_cf(double x, double a, double b) {
+  const double tiny=1e-30;
+  double c=1, d=1-(a+b)*x/(a+1), h, aa, del;
+  int m;
+  if (fabs(d)<tiny) d=tiny;
+  d=1/d;
+  h=d;
+  for (m=1; m<=300; m++) {
+    aa=m*(b-m)*x/((a+2*m-1)*(a+2*m));
+    d=1+aa*d; if (fabs(d)<tiny) d=tiny;
+    c=1+aa/c; if (fabs(c)<tiny) c=tiny;
+    d=1/d;
+    h*=d*c;
+    aa=-(a+m)*(a+b+m)*x/((a+2*m)*(a+2*m+1));
+    d=1+aa*d; if (fabs(d)<tiny) d=tiny;
+    c=1+aa/c; if (fabs(c)<tiny) c=tiny;
+    d=1/d;
+    del=d*c;
+    h*=del;
+    if (fabs(del-1)<1e-12) break;
+  }
+  return h;
+}
+
+// regularized incomplete beta function I_x(a, b)
+static double incomplete_beta(double x, double a, double b) {
+  if (x<=0) return 0;
+  if (x>=1) return 1;
+  double bt=exp(lgamma(a+b)-lgamma(a)-lgamma(b)+a*log(x)+b*log(1-x));
+  if (x<(a+1)/(a+b+2)) return bt*beta_cf(x, a, b)/a;
+  return 1-bt*beta_cf(1-x, b, a)/b;
+}
+
+// two-sided p-value of Student's t
+static double student_t_p(double t, double df) {
+  return incomplete_beta(df/(df+t*t), df/2, 0.5);
+}
+
+// t with two-sided p of 0.05, for 95% confidence intervals
+static double student_t_crit(double df) {
+  double lo=0, hi=1000, mid;
+  int i;
+  for (i=0; i<60; i++) {
+    mid=(lo+hi)/2;
+    if (student_t_p(mid, df)>0.05) lo=mid;
+    else hi=mid;
+  }
+  return (lo+hi)/2;
+}
+
+static void print_trials(const trial_set* ts) {
+  int m;
+  double mean, var;
+  printf("ITERATIONS: %d runs, mean and 95%% confidence interval\n", ts->n);
+  for (m=0; m<M_MAX; m++) {
+    trial_mean_var(ts, m, &mean, &var);
+    double ci=ts->n>1? student_t_crit(ts->n-1)*sqrt(var/ts->n) : 0;
+    printf("  %-7s %12.2f +- %-10.2f (%.1f%%), sd %.2f\n", metric_names[m], mean, ci,
+           mean? ci/mean*100 : 0, sqrt(var));
+  }
+}
+
+static int save_trials(const char* path, const trial_set* ts) {
+  FILE* f=fopen(path, "w");
+  int i, m;
+  if (!f) {
+    nxweb_log_error("can't write results to %s", path);
+    return -1;
+  }
+  fprintf(f, "# httpress results: iteration");
+  for (m=0; m<M_MAX; m++) fprintf(f, " %s", metric_names[m]);
+  fprintf(f, "\n");
+  for (i=0; i<ts->n; i++) {
+    fprintf(f, "%d", i+1);
+    for (m=0; m<M_MAX; m++) fprintf(f, " %.6f", ts->v[i][m]);
+    fprintf(f, "\n");
+  }
+  return fclose(f);
+}
+
+static int load_trials(const char* path, trial_set* ts) {
+  FILE* f=fopen(path, "r");
+  char line[512];
+  int iteration;
+  if (!f) return -1;
+  ts->n=0;
+  while (ts->n<MAX_ITERATIONS && fgets(line, sizeof(line), f)) {
+    double* v=ts->v[ts->n];
+    if (*line=='#' || empty_line(line)) continue;
+    if (sscanf(line, "%d %lf %lf %lf %lf", &iteration, &v[M_RPS], &v[M_P50], &v[M_P90], &v[M_P99])!=1+M_MAX) {
+      fclose(f);
+      return -1;
+    }
+    ts->n++;
+  }
+  fclose(f);
+  return ts->n? 0 : -1;
+}
+
+// prints the comparison table; returns number of regressed metrics
+static int compare_trials(const trial_set* base, const trial_set* cur) {
+  int m, regressions=0;
+  printf("BASELINE: %s, %d runs vs %d runs, Welch's t-test\n", config.baseline, base->n, cur->n);
+  for (m=0; m<M_MAX; m++) {
+    double m1, v1, m2, v2;
+    trial_mean_var(base, m, &m1, &v1);
+    trial_mean_var(cur, m, &m2, &v2);
+    double change=m1? (m2-m1)/m1*100 : 0;
+    double worse=m==M_RPS? -change : change;
+    const char* verdict="";
+    double p=-1;
+    if (base->n>1 && cur->n>1) {
+      double se2=v1/base->n+v2/cur->n;
+      if (se2>0) {
+        double df=se2*se2/((v1/base->n)*(v1/base->n)/(base->n-1)+(v2/cur->n)*(v2/cur->n)/(cur->n-1));
+        p=student_t_p((m2-m1)/sqrt(se2), df);
+      }
+      else p=m1==m2? 1 : 0;
+      if (p<0.05) {
+        if (worse>config.max_regression) {
+          verdict="REGRESSION";
+          regressions++;
+        }
+        else verdict=worse>0? "worse" : "better";
+      }
+    }
+    if (p<0) printf("  %-7s %12.2f -> %-12.2f %+6.1f%%  p=n/a (needs 2+ runs on each side)\n", metric_names[m], m1, m2, change);
+    else printf("  %-7s %12.2f -> %-12.2f %+6.1f%%  p=%.4f %s\n", metric_names[m], m1, m2, change, p, verdict);
+  }
+  return regressions;
+}
+
+/*
+ * Distributed mode.
+ *
+ * An agent (-A port) accepts one coordinator at a time and forks a child
+ * per workload, so every run starts from a clean config. It listens on
+ * loopback unless --agent-bind says otherwise, drops coordinators that don't
+ * know the shared secret and takes only workload options from them, see
+ * forwarded_option(). The coordinator (-D list) splits -n and -c across
+ * agents, waits until all of them are READY, starts them together and
+ * merges their counters and histograms. Control protocol is line based:
+ *
+ *   coordinator -> agent: AUTH <secret>
+ *                         [SESSION <len>\n<session file bytes>]
+ *                         RUN <argc>\n<one argument per line>
+ *                         START
+ *   agent -> coordinator: READY | ERROR <msg>
+ *                         INTERVAL <seq> <stats>   (cumulative, once a second)
+ *                         [URL <index> <session> <url_stats> <host> <path>]...
+ *                         RESULT <duration> <rc> <rc1> <stats>
+ *
+ * <stats> is a space separated list of run_stats fields, in this order:
+ *
+ *   connect success fail bytes overhead connect_fail
+ *   timeout_connect timeout_tls timeout_first_byte timeout_total
+ *   flow_fail established dropped reconnect ktls ktls_fallback
+ *   <errors>
+ *   tunnel_fail tfo_data tfo_accepted tfo_no_cookie tfo_fallback bw_requests bw_permille
+ *   <io>
+ *   <latency> <connect_latency> <first_latency> <flow_latency> <event_gap> <tunnel_latency>
+ *   <first_byte_latency>
+ *
+ * <errors> is EC_MAX counts, one per error class in enum order.
+ * <io> is IO_MAX counts, one per enum io_count.
+ * The seven histograms are, in order: request latency, connect latency,
+ * latency of requests first on their connection, flow latency, gaps
+ * between stream events, tunnel setup time and --client-bw time to first
+ * byte. Each one is
+ * "count sum max b:n,b:n,..." listing only non-empty buckets, or "-" in
+ * place of the bucket list when all are empty.
+ */
+
+#define CTL_HIST_SIZE (64+HIST_BUCKETS*42)
+#define CTL_STATS_SIZE (300+(EC_MAX+IO_MAX)*20+7*CTL_HIST_SIZE)
+
+typedef struct ctl_conn {
+  int fd;
+  int eof;
+  char* buf;
+  int len;
+  int pos; // start of unconsumed data
+  int size;
+} ctl_conn;
 
+static void ctl_init(ctl_conn* cc, int fd) {
+  cc->fd=fd;
+  cc->eof=0;
+  cc->len=cc->pos=0;
+  cc->size=CTL_STATS_SIZE+1024;
+  cc->buf=malloc(cc->size);
+  if (!cc->buf) nxweb_die("can't allocate control buffer");
+}
+
+static int ctl_write(int fd, const char* data, size_t len) {
+  while (len) {
+    ssize_t ret=send(fd, data, len, MSG_NOSIGNAL);
+    if (ret<0) {
+      if (errno==EINTR) continue;
+      if (errno==EAGAIN) {
+        struct pollfd pfd={fd, POLLOUT, 0};
+        poll(&pfd, 1, 1000);
+        continue;
+      }
+      return -1;
+    }
+    data+=ret;
+    len-=ret;
+  }
+  return 0;
+}
+
+static int ctl_send(int fd, const char* fmt, ...) {
+  char* line;
+  va_list ap;
+  va_start(ap, fmt);
+  int len=vsnprintf(0, 0, fmt, ap);
+  va_end(ap);
+  if (len<0 || !(line=malloc(len+1))) return -1;
+  va_start(ap, fmt);
+  vsnprintf(line, len+1, fmt, ap);
+  va_end(ap);
+  int ret=ctl_write(fd, line, len);
+  free(line);
+  return ret;
+}
+
+// returns next complete line without trailing newline, or 0 if none is
+// buffered and read would block; sets cc->eof when peer closes.
+// Returned pointer is valid until the next call.
+static char* ctl_readline(ctl_conn* cc) {
+  for (;;) {
+    char* nl=memchr(cc->buf+cc->pos, '\n', cc->len-cc->pos);
+    if (nl) {
+      char* line=cc->buf+cc->pos;
+      *nl='\0';
+      cc->pos=nl+1-cc->buf;
+      return line;
+    }
+    if (cc->pos) {
+      memmove(cc->buf, cc->buf+cc->pos, cc->len-cc->pos);
+      cc->len-=cc->pos;
+      cc->pos=0;
+    }
+    if (cc->len==cc->size) {
+      cc->eof=1; // line too long: protocol error
+      return 0;
+    }
+    ssize_t ret=read(cc->fd, cc->buf+cc->len, cc->size-cc->len);
+    if (ret>0) {
+      cc->len+=ret;
+      continue;
+    }
+    if (ret<0 && (errno==EAGAIN || errno==EINTR)) return 0;
+    cc->eof=1;
+    return 0;
+  }
+}
+
+static char* ctl_getline(ctl_conn* cc, int timeout_ms) {
+  char* line;
+  while (!(line=ctl_readline(cc)) && !cc->eof) {
+    struct pollfd pfd={cc->fd, POLLIN, 0};
+    if (poll(&pfd, 1, timeout_ms)<=0) return 0;
+  }
+  return line;
+}
+
+static int hist_format(char* buf, int size, const latency_hist* h) {
+  int i, sep=0;
+  int pos=snprintf(buf, size, "%llu %llu %llu ", (unsigned long long)h->count,
+                   (unsigned long long)h->sum, (unsigned long long)h->max);
+  for (i=0; i<HIST_BUCKETS && pos<size; i++) {
+    if (!h->buckets[i]) continue;
+    pos+=snprintf(buf+pos, size-pos, "%s%d:%llu", sep? ",":"", i, (unsigned long long)h->buckets[i]);
+    sep=1;
+  }
+  if (!sep && pos<size) pos+=snprintf(buf+pos, size-pos, "-");
+  return pos<size? pos : size;
+}
+
+static void stats_format(char* buf, int size, const run_stats* st) {
+  int i;
+  int pos=snprintf(buf, size, "%ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld ",
+                   st->num_connect, st->num_success, st->num_fail, st->num_bytes_received,
+                   st->num_overhead_received, st->num_connect_fail, st->num_timeout[TO_CONNECT],
+                   st->num_timeout[TO_TLS], st->num_timeout[TO_FIRST_BYTE], st->num_timeout[TO_TOTAL],
+                   st->num_flow_fail, st->num_established, st->num_dropped, st->num_reconnect,
+                   st->num_ktls, st->num_ktls_fallback);
+  for (i=0; i<EC_MAX && pos<size; i++) pos+=snprintf(buf+pos, size-pos, "%ld ", st->num_errors[i]);
+  if (pos<size) pos+=snprintf(buf+pos, size-pos, "%ld %ld %ld %ld %ld %ld %ld ", st->num_tunnel_fail, st->num_tfo_data,
+                              st->num_tfo_accepted, st->num_tfo_no_cookie, st->num_tfo_fallback, st->bw_requests,
+                              st->bw_permille);
+  for (i=0; i<IO_MAX && pos<size; i++) pos+=snprintf(buf+pos, size-pos, "%ld ", st->io[i]);
+  if (pos>=size) return;
+  pos+=hist_format(buf+pos, size-pos, &st->latency);
+  if (pos<size-1) {
+    buf[pos++]=' ';
+    pos+=hist_format(buf+pos, size-pos, &st->connect_latency);
+  }
+  if (pos<size-1) {
+    buf[pos++]=' ';
+    pos+=hist_format(buf+pos, size-pos, &st->first_latency);
+  }
+  if (pos<size-1) {
+    buf[pos++]=' ';
+    pos+=hist_format(buf+pos, size-pos, &st->flow_latency);
+  }
+  if (pos<size-1) {
+    buf[pos++]=' ';
+    pos+=hist_format(buf+pos, size-pos, &st->event_gap);
+  }
+  if (pos<size-1) {
+    buf[pos++]=' ';
+    pos+=hist_format(buf+pos, size-pos, &st->tunnel_latency);
+  }
+  if (pos<size-1) {
+    buf[pos++]=' ';
+    hist_format(buf+pos, size-pos, &st->first_byte_latency);
+  }
+}
+
+// returns pointer past the parsed histogram or 0 on error
+static const char* hist_parse(const char* s, latency_hist* h) {
+  unsigned long long count, sum, max;
+  int n=0;
+  if (sscanf(s, "%llu %llu %llu %n", &count, &sum, &max, &n)<3 || !n) return 0;
+  h->count=count;
+  h->sum=sum;
+  h->max=max;
+  s+=n;
+  if (*s=='-') return s+1;
+  while (*s && *s!=' ') {
+    char* end;
+    long b=strtol(s, &end, 10);
+    if (*end!=':' || b<0 || b>=HIST_BUCKETS) return 0;
+    h->buckets[b]=strtoull(end+1, &end, 10);
+    if (*end==',') end++;
+    else if (*end && *end!=' ') return 0;
+    s=end;
+  }
+  return s;
+}
+
+static int stats_parse(const char* s, run_stats* st) {
+  int i, n=0;
+  memset(st, 0, sizeof(*st));
+  if (sscanf(s, "%ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %ld %n",
+             &st->num_connect, &st->num_success, &st->num_fail, &st->num_bytes_received,
+             &st->num_overhead_received, &st->num_connect_fail, &st->num_timeout[TO_CONNECT],
+             &st->num_timeout[TO_TLS], &st->num_timeout[TO_FIRST_BYTE], &st->num_timeout[TO_TOTAL],
+             &st->num_flow_fail, &st->num_established, &st->num_dropped, &st->num_reconnect,
+             &st->num_ktls, &st->num_ktls_fallback, &n)<16 || !n) return -1;
+  s+=n;
+  for (i=0; i<EC_MAX; i++) {
+    n=0;
+    if (sscanf(s, "%ld %n", &st->num_errors[i], &n)<1 || !n) return -1;
+    s+=n;
+  }
+  n=0;
+  if (sscanf(s, "%ld %ld %ld %ld %ld %ld %ld %n", &st->num_tunnel_fail, &st->num_tfo_data, &st->num_tfo_accepted,
+             &st->num_tfo_no_cookie, &st->num_tfo_fallback, &st->bw_requests, &st->bw_permille, &n)<7 || !n)
+    return -1;
+  s+=n;
+  for (i=0; i<IO_MAX; i++) {
+    n=0;
+    if (sscanf(s, "%ld %n", &st->io[i], &n)<1 || !n) return -1;
+    s+=n;
+  }
+  s=hist_parse(s, &st->latency);
+  if (!s || *s++!=' ') return -1;
+  s=hist_parse(s, &st->connect_latency);
+  if (!s || *s++!=' ') return -1;
+  s=hist_parse(s, &st->first_latency);
+  if (!s || *s++!=' ') return -1;
+  s=hist_parse(s, &st->flow_latency);
+  if (!s || *s++!=' ') return -1;
+  s=hist_parse(s, &st->event_gap);
+  if (!s || *s++!=' ') return -1;
+  s=hist_parse(s, &st->tunnel_latency);
+  if (!s || *s++!=' ') return -1;
+  s=hist_parse(s, &st->first_byte_latency);
+  return s && !*s? 0 : -1;
+}
+
+/*
+ * Session mode: after the run, one URL line per URL with requests, where
+ * <url_stats> is "success fail sum max b:n,..." like <hist> but with the
+ * per-URL buckets. The coordinator rebuilds url_totals and the session
+ * layout from them, so it needs no session file parsing of its own.
+ */
+static int send_url_stats(int fd) {
+  static char buf[URL_HIST_BUCKETS*24+64];
+  int i, j;
+  for (i=0; i<config.num_urls && url_totals; i++) {
+    const url_stats* us=&url_totals[i];
+    if (!us->num_success && !us->num_fail) continue;
+    int session=session_of_url(i), pos=0;
+    for (j=0; j<URL_HIST_BUCKETS; j++) {
+      if (us->buckets[j]) pos+=snprintf(buf+pos, sizeof(buf)-pos, "%s%d:%u", pos? "," : "", j, us->buckets[j]);
+    }
+    if (!pos) snprintf(buf, sizeof(buf), "-");
+    if (ctl_send(fd, "URL %d %d %u %u %llu %u %s %s %s\n", i, session, us->num_success, us->num_fail,
+                 (unsigned long long)us->sum, us->max, buf, config.session_host[session], config.url_path_arr[i]))
+      return -1;
+  }
+  return 0;
+}
+
+static int parse_url_stats(char* s) {
+  url_stats us;
+  unsigned long long sum;
+  int index, session, b, n=0;
+  unsigned count;
+  memset(&us, 0, sizeof(us));
+  if (sscanf(s, "%d %d %u %u %llu %u %n", &index, &session, &us.num_success, &us.num_fail, &sum, &us.max, &n)<6 || !n)
+    return -1;
+  if (index<0 || index>=MAX_URLS || session<0 || session>=MAX_SESSIONS) return -1;
+  us.sum=sum;
+  s+=n;
+  if (*s=='-') s++;
+  else {
+    for (;;) {
+      if (sscanf(s, "%d:%u%n", &b, &count, &n)<2 || b<0 || b>=URL_HIST_BUCKETS) return -1;
+      us.buckets[b]=count;
+      s+=n;
+      if (*s!=',') break;
+      s++;
+    }
+  }
+  if (*s++!=' ') return -1;
+  char* path=strchr(s, ' ');
+  if (!path) return -1;
+  *path++='\0';
+  if (!url_totals && !(url_totals=calloc(MAX_URLS, sizeof(url_stats)))) nxweb_die("can't allocate per-URL stats");
+  url_stats_merge(&url_totals[index], &us);
+  if (!config.url_path_arr[index]) config.url_path_arr[index]=strdup(path);
+  if (!config.session_host[session]) config.session_host[session]=strdup(s);
+  if (index>=config.num_urls) config.num_urls=index+1;
+  if (config.sessions[session]<index+1) config.sessions[session]=index+1;
+  if (session>=config.last_session) config.last_session=session+1;
+  return 0;
+}
+
+static void agent_interval_cb(thread_config** threads, int seq, void* ctx) {
+  static char buf[CTL_STATS_SIZE];
+  run_stats total;
+  collect_stats(threads, &total, 1);
+  stats_format(buf, sizeof(buf), &total);
+  if (ctl_send(*(int*)ctx, "INTERVAL %d %s\n", seq, buf)) nxweb_die("coordinator connection lost");
+}
+
+// options a coordinator may set on an agent: the workload itself, nothing
+// that loads code or reads and writes the agent's files
+static int forwarded_option(int c) {
+  if (c>=OPT_TIMEOUT && c<=OPT_TIMEOUT_END) return 1;
+  switch (c) {
+    case 'k': case 'q': case 'i': case 'n': case 'r': case 't': case 'c': case 'z':
+    case OPT_PROFILE: case OPT_WARMUP: case OPT_RATE: case OPT_SCALE: case OPT_PROFILE_BASE: case OPT_CONNECT_RATE:
+    case OPT_GRACE: case OPT_MAX_CONN_REQUESTS: case OPT_NEW_CONN_RATIO: case OPT_TOP:
+    case OPT_FLOW: case OPT_THINK: case OPT_WS: case OPT_WS_SIZE: case OPT_HOLD: case OPT_BUF_SIZE:
+    case OPT_RECONNECT_DELAY: case OPT_KTLS: case OPT_HANDSHAKE: case OPT_CLOSE_NOTIFY: case OPT_PROXY:
+    case OPT_EDGE: case OPT_FASTOPEN: case OPT_CLIENT_BW: case OPT_RCVBUF:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+static int check_forwarded_args(int argc, char* argv[]) {
+  int c, longindex=-1;
+  optind=0;
+  while ((c=getopt_long(argc, argv, SHORT_OPTIONS, long_options, &longindex))!=-1) {
+    if (forwarded_option(c)) continue;
+    if (c>=OPT_PROFILE) nxweb_log_error("option --%s is not accepted from a coordinator", long_options[longindex].name);
+    else if (c!='?' && c!=':') nxweb_log_error("option -%c is not accepted from a coordinator", c);
+    else nxweb_log_error("bad option from coordinator");
+    return -1;
+  }
+  return 0;
+}
+
+// compares in time independent of where the strings differ
+static int secret_equal(const char* secret, const char* given) {
+  size_t len=strlen(secret), given_len=strlen(given), i;
+  unsigned char d=len!=given_len;
+  for (i=0; i<len; i++) d|=secret[i]^(i<given_len? given[i] : 0);
+  return !d;
+}
+
+static char session_path[]="/tmp/httpress-session-XXXXXX";
+static int has_session=0;
+
+// the session runs in its own process; nxweb_die() and every early return
+// end in exit(), so this removes the workload file on all of them
+static void remove_session_file(void) {
+  if (has_session) unlink(session_path);
+  has_session=0;
+}
+
+static int agent_session(int fd) {
+  static char buf[CTL_STATS_SIZE];
+  ctl_conn cc;
+  char* line;
+  int i, nargs;
+
+  ctl_init(&cc, fd);
+  line=ctl_getline(&cc, 10000);
+  if (!line || strncmp(line, "AUTH ", 5) || !secret_equal(config.agent_secret, line+5)) {
+    nxweb_log_error("coordinator not authorized");
+    ctl_send(fd, "ERROR not authorized\n");
+    return EXIT_FAILURE;
+  }
+  line=ctl_getline(&cc, -1);
+  if (line && !strncmp(line, "SESSION ", 8)) {
+    long len=atol(line+8);
+    int sfd=mkstemp(session_path);
+    if (sfd<0) nxweb_die("can't create session file");
+    has_session=1;
+    atexit(remove_session_file);
+    while (len>0) {
+      if (cc.pos==cc.len) {
+        cc.pos=0;
+        cc.len=read(fd, cc.buf, cc.size);
+        if (cc.len<=0) nxweb_die("coordinator connection lost");
+      }
+      int n=cc.len-cc.pos<len? cc.len-cc.pos : len;
+      if (write(sfd, cc.buf+cc.pos, n)!=n) nxweb_die("can't write session file");
+      cc.pos+=n;
+      len-=n;
+    }
+    close(sfd);
+    line=ctl_getline(&cc, -1);
+  }
+  if (!line || sscanf(line, "RUN %d", &nargs)!=1 || nargs<0 || nargs>1000) {
+    nxweb_log_error("bad workload from coordinator");
+    return EXIT_FAILURE;
+  }
+  char** args=calloc(nargs+4, sizeof(char*));
+  args[0]="httpress";
+  for (i=1; i<=nargs; i++) {
+    if (!(line=ctl_getline(&cc, -1))) nxweb_die("coordinator connection lost");
+    args[i]=strdup(line);
+  }
+  if (check_forwarded_args(i, args)) {
+    ctl_send(fd, "ERROR option not accepted\n");
+    return EXIT_FAILURE;
+  }
+  if (has_session) {
+    args[i++]="-f";
+    args[i++]=session_path;
+  }
+  optind=0; // reinitialize getopt for the forwarded arguments
+  if (parse_args(i, args) || setup_workload()) {
+    ctl_send(fd, "ERROR bad workload\n");
+    return EXIT_FAILURE;
+  }
+  remove_session_file();
+  ctl_send(fd, "READY\n");
+  if (!(line=ctl_getline(&cc, -1)) || strcmp(line, "START")) {
+    nxweb_log_error("coordinator didn't start the run");
+    return EXIT_FAILURE;
+  }
+
+  run_result res;
+  run_benchmark(agent_interval_cb, &fd, &res);
+  if (send_url_stats(fd)) nxweb_die("coordinator connection lost");
+  stats_format(buf, sizeof(buf), &res.total);
+  ctl_send(fd, "RESULT %.6f %d %d %s\n", res.duration, res.real_concurrency, res.real_concurrency1, buf);
+  cleanup_workload();
+  close(fd);
   return EXIT_SUCCESS;
 }
+
+static int run_agent(int port) {
+  struct sockaddr_in sa;
+  int one=1;
+  int lfd=socket(AF_INET, SOCK_STREAM, 0);
+  if (lfd<0) nxweb_die("can't open agent socket");
+  setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family=AF_INET;
+  sa.sin_port=htons(port);
+  const char* bind_addr=config.agent_bind? config.agent_bind : "127.0.0.1";
+  if (inet_pton(AF_INET, bind_addr, &sa.sin_addr)!=1) nxweb_die("wrong agent bind address: %s", bind_addr);
+  if (bind(lfd, (struct sockaddr*)&sa, sizeof(sa)) || listen(lfd, 16))
+    nxweb_die("can't listen on agent port %d [%d] %s", port, errno, strerror(errno));
+  printf("agent listening on %s:%d\n", bind_addr, port);
+  fflush(stdout);
+
+  for (;;) {
+    int fd=accept(lfd, 0, 0);
+    if (fd<0) {
+      if (errno==EINTR) continue;
+      nxweb_die("agent accept failed [%d]", errno);
+    }
+    pid_t pid=fork();
+    if (pid==0) {
+      close(lfd);
+      exit(agent_session(fd));
+    }
+    close(fd);
+    if (pid<0) nxweb_log_error("can't fork agent session [%d]", errno);
+    else waitpid(pid, 0, 0); // one workload at a time
+    fflush(stdout);
+  }
+  return EXIT_SUCCESS;
+}
+
+typedef struct agent_conn {
+  const char* address;
+  ctl_conn ctl;
+  int done;
+  int failed;
+  int seq;
+  run_stats stats; // latest cumulative stats
+  run_result result;
+} agent_conn;
+
+static int connect_agent(const char* address) {
+  struct addrinfo* saddr;
+  if (!strchr(address, ':')) nxweb_die("agent address must be host:port: %s", address);
+  if (resolve_host(&saddr, address)) nxweb_die("can't resolve agent %s", address);
+  int fd=socket(saddr->ai_family, saddr->ai_socktype, saddr->ai_protocol);
+  if (fd<0 || connect(fd, saddr->ai_addr, saddr->ai_addrlen))
+    nxweb_die("can't connect to agent %s [%d] %s", address, errno, strerror(errno));
+  free_host(saddr);
+  int nodelay=1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  return fd;
+}
+
+static void coordinator_line(agent_conn* a, char* line) {
+  int n=0;
+  if (!strncmp(line, "INTERVAL ", 9)) {
+    if (sscanf(line+9, "%d %n", &a->seq, &n)<1 || !n || stats_parse(line+9+n, &a->stats))
+      nxweb_log_error("agent %s: malformed interval", a->address);
+  }
+  else if (!strncmp(line, "URL ", 4)) {
+    if (parse_url_stats(line+4)) nxweb_log_error("agent %s: malformed url stats", a->address);
+  }
+  else if (!strncmp(line, "RESULT ", 7)) {
+    if (sscanf(line+7, "%lf %d %d %n", &a->result.duration, &a->result.real_concurrency,
+               &a->result.real_concurrency1, &n)<3 || !n || stats_parse(line+7+n, &a->result.total)) {
+      nxweb_log_error("agent %s: malformed result", a->address);
+      a->failed=1;
+    }
+    a->stats=a->result.total;
+    a->done=1;
+  }
+  else {
+    nxweb_log_error("agent %s: %s", a->address, line);
+  }
+}
+
+static int run_coordinator(int argc, char* argv[]) {
+  char* list=strdup(config.agents);
+  char* p;
+  int i, j, num_agents=1;
+  for (p=list; *p; p++) if (*p==',') num_agents++;
+  agent_conn* agents=calloc(num_agents, sizeof(agent_conn));
+  if (!agents) nxweb_die("can't allocate agents");
+  for (i=0, p=strtok(list, ","); p; p=strtok(0, ","), i++) agents[i].address=p;
+  num_agents=i;
+  if (!num_agents) nxweb_die("no agents given");
+  if (config.num_connections<num_agents*config.num_threads)
+    nxweb_die("need at least %d connections to run %d thread(s) on %d agents", num_agents*config.num_threads, config.num_threads, num_agents);
+
+  char* session=0;
+  long session_len=0;
+  if (config.session_file) {
+    FILE* fp=fopen(config.session_file, "r");
+    if (!fp) nxweb_die("can't open session file %s", config.session_file);
+    fseek(fp, 0, SEEK_END);
+    session_len=ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    session=malloc(session_len+1);
+    if (!session || fread(session, 1, session_len, fp)!=session_len) nxweb_die("can't read session file %s", config.session_file);
+    fclose(fp);
+  }
+
+  // forward our own arguments except the ones the coordinator handles
+  char** fwd=calloc(argc+4, sizeof(char*));
+  int nfwd=0;
+  for (i=1; i<argc; i++) {
+    if (!strcmp(argv[i], "-D") || !strcmp(argv[i], "-f") || !strcmp(argv[i], "--scale") || !strcmp(argv[i], "--profile-base")) { i++; continue; }
+    if (!strncmp(argv[i], "-D", 2) || !strncmp(argv[i], "-f", 2)) continue;
+    if (!strcmp(argv[i], "--agent-secret") || !strcmp(argv[i], "--agent-bind")) { i++; continue; }
+    if (!strncmp(argv[i], "--agent-secret=", 15) || !strncmp(argv[i], "--agent-bind=", 13)) continue;
+    fwd[nfwd++]=argv[i];
+  }
+
+  int requests_allocated=0, conns_allocated=0;
+  for (i=0; i<num_agents; i++) {
+    agent_conn* a=&agents[i];
+    int num_requests=(config.num_requests-requests_allocated)/(num_agents-i);
+    int num_conn=(config.num_connections-conns_allocated)/(num_agents-i);
+    requests_allocated+=num_requests;
+    conns_allocated+=num_conn;
+    ctl_init(&a->ctl, connect_agent(a->address));
+    if (ctl_send(a->ctl.fd, "AUTH %s\n", config.agent_secret)) nxweb_die("can't send workload to agent %s", a->address);
+    if (session) {
+      if (ctl_send(a->ctl.fd, "SESSION %ld\n", session_len) || ctl_write(a->ctl.fd, session, session_len))
+        nxweb_die("can't send session to agent %s", a->address);
+    }
+    ctl_send(a->ctl.fd, "RUN %d\n", nfwd+(config.infinite==2? 6 : 4)+(config.profile_spec? 2 : 0));
+    for (j=0; j<nfwd; j++) ctl_send(a->ctl.fd, "%s\n", fwd[j]);
+    if (config.infinite==2) ctl_send(a->ctl.fd, "-n\n%d\n", num_requests);
+    // profile and rate targets are global; each agent runs its share
+    ctl_send(a->ctl.fd, "-c\n%d\n--scale\n%.9f\n", num_conn, (double)num_conn/config.num_connections);
+    if (config.profile_spec) ctl_send(a->ctl.fd, "--profile-base\n%d\n", config.profile_conns0);
+  }
+  for (i=0; i<num_agents; i++) {
+    char* line=ctl_getline(&agents[i].ctl, 60000);
+    if (!line || strcmp(line, "READY"))
+      nxweb_die("agent %s is not ready: %s", agents[i].address, line? line : "no response");
+  }
+  // lockstep start
+  for (i=0; i<num_agents; i++) {
+    if (ctl_send(agents[i].ctl.fd, "START\n")) nxweb_die("can't start agent %s", agents[i].address);
+    fcntl(agents[i].ctl.fd, F_SETFL, fcntl(agents[i].ctl.fd, F_GETFL)|O_NONBLOCK);
+  }
+  if (!config.quiet) printf("started %d agents\n", num_agents);
+
+  struct pollfd* pfds=calloc(num_agents, sizeof(struct pollfd));
+  run_stats printed, current, interval;
+  memset(&printed, 0, sizeof(printed));
+  int printed_seq=0;
+  for (;;) {
+    int nfds=0;
+    for (i=0; i<num_agents; i++) {
+      if (agents[i].done) continue;
+      pfds[nfds].fd=agents[i].ctl.fd;
+      pfds[nfds].events=POLLIN;
+      pfds[nfds].revents=0;
+      nfds++;
+    }
+    if (!nfds) break;
+    poll(pfds, nfds, 1000);
+    int min_seq=INT_MAX;
+    for (i=0; i<num_agents; i++) {
+      agent_conn* a=&agents[i];
+      char* line;
+      if (a->done) continue;
+      while (!a->done && (line=ctl_readline(&a->ctl))) coordinator_line(a, line);
+      if (!a->done && a->ctl.eof) {
+        nxweb_log_error("agent %s disconnected before reporting results", a->address);
+        a->done=a->failed=1;
+      }
+      if (!a->done && a->seq<min_seq) min_seq=a->seq;
+    }
+    if (min_seq!=INT_MAX && min_seq>printed_seq) {
+      memset(&current, 0, sizeof(current));
+      for (i=0; i<num_agents; i++) stats_merge(&current, &agents[i].stats);
+      stats_sub(&interval, &current, &printed);
+      ev_tstamp span=min_seq-printed_seq;
+      if (!config.quiet && config.hold) {
+        print_hold_interval(min_seq, &current, &interval);
+        printf("\n");
+        fflush(stdout);
+      }
+      else if (!config.quiet) {
+        printf("[%4ds] %.0f rps, %ld fail, %.2f ms p50, %.2f ms p99\n", min_seq,
+               interval.num_success/span, interval.num_fail,
+               hist_percentile(&interval.latency, 50)*1000, hist_percentile(&interval.latency, 99)*1000);
+        fflush(stdout);
+      }
+      printed=current;
+      printed_seq=min_seq;
+    }
+  }
+
+  run_result res;
+  int failed=0;
+  memset(&res, 0, sizeof(res));
+  for (i=0; i<num_agents; i++) {
+    agent_conn* a=&agents[i];
+    if (a->failed) failed++;
+    stats_merge(&res.total, &a->stats);
+    if (a->result.duration>res.duration) res.duration=a->result.duration;
+    res.real_concurrency+=a->result.real_concurrency;
+    res.real_concurrency1+=a->result.real_concurrency1;
+    if (!config.quiet) {
+      printf("agent %s: %ld connect, %ld requests, %ld success, %ld fail, %.3f seconds%s\n", a->address,
+             a->stats.num_connect, a->stats.num_success+a->stats.num_fail, a->stats.num_success,
+             a->stats.num_fail, a->result.duration, a->failed? " (FAILED)":"");
+    }
+    close(a->ctl.fd);
+  }
+  if (res.duration<=0) res.duration=0.00001;
+  print_report(&res, 0);
+  // sessions without requests sent no lines: keep the session bounds ordered
+  for (i=1; i<config.last_session; i++) {
+    if (config.sessions[i]<config.sessions[i-1]) config.sessions[i]=config.sessions[i-1];
+  }
+  print_url_stats();
+  return failed? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int main(int argc, char* argv[]) {
+  // keep original order: getopt permutes argv, coordinator forwards it
+  char** args=malloc((argc+1)*sizeof(char*));
+  memcpy(args, argv, (argc+1)*sizeof(char*));
+
+  int r=parse_args(argc, argv);
+  if (r) return r<0? EXIT_FAILURE : EXIT_SUCCESS;
+
+  if (config.agent_port) return run_agent(config.agent_port);
+  if (config.agents) return run_coordinator(argc, args);
+
+  static trial_set trials, baseline;
+  if (config.baseline && load_trials(config.baseline, &baseline)) {
+    nxweb_log_error("can't read baseline results from %s", config.baseline);
+    return EXIT_FAILURE;
+  }
+
+  if (setup_workload()) return EXIT_FAILURE;
+
+  run_result res;
+  int i, rc=EXIT_SUCCESS;
+  if (config.slo_spec) {
+    slo_search search;
+    memset(&search, 0, sizeof(search));
+    search.rate=config.search_min;
+    search_target.rate=search.rate;
+    search_target.trial=1;
+    run_benchmark(search_interval_cb, &search, &res);
+  }
+  else {
+    // setup (name resolution, TLS and plugin init) is shared by all iterations
+    for (i=0; i<config.iterations; i++) {
+      if (config.iterations>1 && !config.quiet) printf("\nITERATION %d/%d\n", i+1, config.iterations);
+      if (!config.quiet && (config.num_phases || config.warmup>0 || config.rate>0 || config.hold))
+        run_benchmark(local_interval_cb, 0, &res);
+      else
+        run_benchmark(0, 0, &res);
+      if (res.interrupted) break;
+      trial_record(&trials, &res);
+    }
+    if (config.iterations>1 || config.baseline) printf("\n");
+    if (config.iterations>1 && trials.n) print_trials(&trials);
+    if (config.save_results && save_trials(config.save_results, &trials)) rc=EXIT_FAILURE;
+    if (config.baseline && trials.n && compare_trials(&baseline, &trials)) rc=2;
+  }
+  cleanup_workload();
+
+  return rc;
+}
@@ -0,0 +1,49 @@
+/*
+ * httpress plugin interface
+ *
+ * A plugin is a shared object loaded with --plugin path.so. It exports
+ * httpress_plugin_get(), returning a table of hooks; any hook may be NULL.
+ *
+ * Hooks are called directly from worker threads' event loops. Each thread
+ * gets its own context from thread_init() and it is passed back to every
+ * other hook of that thread, so plugins need no locks. Hooks must not block
+ * and should not allocate per request.
+ *
+ * conn_id is the connection's index within its thread (0..num_conn-1),
+ * so per-connection state fits in an array allocated by thread_init().
+ */
+
+#ifndef HTTPRESS_PLUGIN_H
+#define HTTPRESS_PLUGIN_H
+
+#define HTTPRESS_PLUGIN_ABI 1
+
+typedef struct httpress_plugin {
+  int abi; // HTTPRESS_PLUGIN_ABI the plugin was built with
+
+  // thread_id counts from 1; arg is --plugin-arg or NULL;
+  // store thread context in *ctx; return 0 on success
+  int (*thread_init)(int thread_id, int num_conn, const char* arg, void** ctx);
+  void (*thread_done)(void* ctx);
+
+  // write the next request into buf; return its length,
+  // 0 to send httpress's own request, -1 to close this connection for good
+  int (*build_request)(void* ctx, int conn_id, char* buf, int size);
+
+  // headers: the response header block, NUL-terminated, without the blank line;
+  // return -1 to fail the request and drop the connection
+  int (*on_headers)(void* ctx, int conn_id, int status, const char* headers, int len);
+
+  // body bytes as received, chunked framing included; same return as on_headers
+  int (*on_body)(void* ctx, int conn_id, const char* data, int len);
+
+  // response complete; return 0 to count it as success, nonzero as failure;
+  // not called for --hold streams, which count once their headers arrive
+  int (*on_complete)(void* ctx, int conn_id, int status);
+} httpress_plugin;
+
+typedef const httpress_plugin* (*httpress_plugin_get_t)(void);
+
+#define HTTPRESS_PLUGIN_SYMBOL "httpress_plugin_get"
+
+#endif // HTTPRESS_PLUGIN_H
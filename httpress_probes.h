@@ -0,0 +1,65 @@
+/*
+ * USDT probes (provider "httpress") for perf, bpftrace and SystemTap:
+ *
+ *   bpftrace -e 'usdt:./httpress:httpress:request_done { @[arg4]=count(); }'
+ *
+ * Uses <sys/sdt.h> when available. Otherwise, on x86-64 and AArch64 with GCC
+ * or clang, emits the same .note.stapsdt records itself, so there is no
+ * build or runtime dependency. A probe site is a single nop until a tracer
+ * attaches; arguments are left wherever the compiler already has them.
+ * Build with -DNO_PROBES to compile them out.
+ *
+ * All probes take: connection pointer, thread id, bytes, connection state
+ * and one probe specific value (see README.md).
+ */
+
+#ifndef HTTPRESS_PROBES_H
+#define HTTPRESS_PROBES_H
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE(name, conn, tid, bytes, state, extra) \
+  STAP_PROBE5(httpress, name, conn, tid, bytes, state, extra)
+#endif
+#endif
+
+#if !defined(PROBE) && !defined(NO_PROBES) && defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__))
+
+// every argument is passed as a signed 64-bit value ("-8@operand")
+#define _PROBE_ARGS "-8@%[a1] -8@%[a2] -8@%[a3] -8@%[a4] -8@%[a5]"
+
+#define PROBE(name, conn, tid, bytes, state, extra) \
+  __asm__ __volatile__ ( \
+    "990: nop\n" \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+    ".balign 4\n" \
+    ".4byte 992f-991f, 994f-993f, 3\n" \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n" \
+    "993: .8byte 990b\n" \
+    ".8byte _.stapsdt.base\n" \
+    ".8byte 0\n" \
+    ".asciz \"httpress\"\n" \
+    ".asciz \"" #name "\"\n" \
+    ".asciz \"" _PROBE_ARGS "\"\n" \
+    "994: .balign 4\n" \
+    ".popsection\n" \
+    ".ifndef _.stapsdt.base\n" \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n" \
+    ".hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n" \
+    :: [a1] "nor" ((long)(conn)), [a2] "nor" ((long)(tid)), [a3] "nor" ((long)(bytes)), \
+       [a4] "nor" ((long)(state)), [a5] "nor" ((long)(extra)))
+
+#endif
+
+#ifndef PROBE
+#define PROBE(name, conn, tid, bytes, state, extra) ((void)0)
+#endif
+
+#endif // HTTPRESS_PROBES_H
@@ -0,0 +1,96 @@
+/*
+ * WebSocket framing helpers shared by httpress and httpress-fixture.
+ */
+
+#ifndef HTTPRESS_WS_H
+#define HTTPRESS_WS_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define WS_OP_TEXT 0x1
+#define WS_OP_BINARY 0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+#define WS_OP_PONG 0xA
+#define WS_MAX_HEADER 14 // 2 + 8 byte length + 4 byte mask
+
+typedef uint8_t ws_vec __attribute__((vector_size(16)));
+
+// dst=src^key with the 4 key bytes repeating from offset 0; dst may be src.
+// Works on 64 bytes per step with GCC vector extensions (SSE2/NEON).
+static inline void ws_mask(void* dst, const void* src, size_t len, const uint8_t key[4]) {
+  uint8_t* d=dst;
+  const uint8_t* s=src;
+  ws_vec k, v0, v1, v2, v3;
+  size_t i;
+  for (i=0; i<16; i++) k[i]=key[i&3];
+  for (i=0; i+64<=len; i+=64) {
+    memcpy(&v0, s+i, 16);
+    memcpy(&v1, s+i+16, 16);
+    memcpy(&v2, s+i+32, 16);
+    memcpy(&v3, s+i+48, 16);
+    v0^=k; v1^=k; v2^=k; v3^=k;
+    memcpy(d+i, &v0, 16);
+    memcpy(d+i+16, &v1, 16);
+    memcpy(d+i+32, &v2, 16);
+    memcpy(d+i+48, &v3, 16);
+  }
+  for (; i+16<=len; i+=16) {
+    memcpy(&v0, s+i, 16);
+    v0^=k;
+    memcpy(d+i, &v0, 16);
+  }
+  for (; i<len; i++) d[i]=s[i]^key[i&3];
+}
+
+// writes a frame header to buf (WS_MAX_HEADER bytes); returns its length
+static inline int ws_frame_header(uint8_t* buf, int opcode, uint64_t len, const uint8_t* mask_key) {
+  int n=2, i;
+  buf[0]=0x80|opcode; // FIN
+  if (len<126) buf[1]=len;
+  else if (len<65536) {
+    buf[1]=126;
+    buf[2]=len>>8;
+    buf[3]=len;
+    n=4;
+  }
+  else {
+    buf[1]=127;
+    for (i=0; i<8; i++) buf[2+i]=len>>(56-8*i);
+    n=10;
+  }
+  if (mask_key) {
+    buf[1]|=0x80;
+    memcpy(buf+n, mask_key, 4);
+    n+=4;
+  }
+  return n;
+}
+
+// parses a frame header; returns its length, 0 if more bytes are needed
+static inline int ws_parse_header(const uint8_t* buf, int avail, int* opcode, uint64_t* len, const uint8_t** mask_key) {
+  int n=2, i;
+  if (avail<2) return 0;
+  *opcode=buf[0]&0x0F;
+  *len=buf[1]&0x7F;
+  if (*len==126) {
+    if (avail<4) return 0;
+    *len=(buf[2]<<8)|buf[3];
+    n=4;
+  }
+  else if (*len==127) {
+    if (avail<10) return 0;
+    for (*len=0, i=0; i<8; i++) *len=(*len<<8)|buf[2+i];
+    n=10;
+  }
+  *mask_key=0;
+  if (buf[1]&0x80) {
+    if (avail<n+4) return 0;
+    *mask_key=buf+n;
+    n+=4;
+  }
+  return n;
+}
+
+#endif // HTTPRESS_WS_H
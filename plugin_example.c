@@ -0,0 +1,78 @@
+/*
+ * Example httpress plugin.
+ *
+ * Sends GET requests tagged with a per-connection sequence number and
+ * counts only 2xx responses as success:
+ *
+ *   httpress -n 10000 -c 50 -k --plugin ./httpress-plugin-example.so \
+ *            --plugin-arg localhost:8080/index.html http://localhost:8080/
+ *
+ * --plugin-arg is host[/path]; without it httpress's own request is sent.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "httpress_plugin.h"
+
+typedef struct example_thread {
+  const char* host;
+  int host_len;
+  const char* path;
+  int num_conn;
+  unsigned* seq; // per connection
+  long non_2xx;
+} example_thread;
+
+static int example_thread_init(int thread_id, int num_conn, const char* arg, void** ctx) {
+  example_thread* t=calloc(1, sizeof(example_thread));
+  if (!t) return -1;
+  t->seq=calloc(num_conn, sizeof(unsigned));
+  if (!t->seq) {
+    free(t);
+    return -1;
+  }
+  t->num_conn=num_conn;
+  if (arg) {
+    const char* slash=strchr(arg, '/');
+    t->host=arg;
+    t->host_len=slash? slash-arg : strlen(arg);
+    t->path=slash? slash : "/";
+  }
+  *ctx=t;
+  return 0;
+}
+
+static void example_thread_done(void* ctx) {
+  example_thread* t=ctx;
+  if (t->non_2xx) fprintf(stderr, "plugin: %ld non-2xx responses\n", t->non_2xx);
+  free(t->seq);
+  free(t);
+}
+
+static int example_build_request(void* ctx, int conn_id, char* buf, int size) {
+  example_thread* t=ctx;
+  if (!t->host) return 0;
+  return snprintf(buf, size, "GET %s%cseq=%u HTTP/1.1\r\nHost: %.*s\r\n\r\n",
+                  t->path, strchr(t->path, '?')? '&' : '?', t->seq[conn_id]++, t->host_len, t->host);
+}
+
+static int example_on_complete(void* ctx, int conn_id, int status) {
+  example_thread* t=ctx;
+  if (status>=200 && status<300) return 0;
+  t->non_2xx++;
+  return 1;
+}
+
+static const httpress_plugin example_plugin={
+  .abi=HTTPRESS_PLUGIN_ABI,
+  .thread_init=example_thread_init,
+  .thread_done=example_thread_done,
+  .build_request=example_build_request,
+  .on_complete=example_on_complete
+};
+
+const httpress_plugin* httpress_plugin_get(void) {
+  return &example_plugin;
+}